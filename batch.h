@@ -0,0 +1,90 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <sys/types.h>
+
+#include "ftree.h"      // struct request
+
+#define BATCH_MAGIC "rcopyba1"		// first bytes of a batch file
+#define BATCH_INDEX_MAGIC "rcopybi1"	// last bytes of a complete batch file
+#define BATCH_END -1				// record type after the last record
+#define BATCH_COPYSIZE (64 << 10)	// bytes moved at a time into the batch
+
+/*
+ * A batch file holds the changes a sync made to a reference server, so they
+ * can be applied to other copies of it without a connection:
+ *
+ *   BATCH_MAGIC
+ *   records, each a request as sent on the wire:
+ *     TRANSFILE          a directory to make, or a file followed by its
+ *                        extent frames and hash exactly as they were sent
+ *     LINKFILE           a hard link to make
+ *     REGFILE, REGDIR,   a path the reference already had; only its
+ *     PROBEFILE          permissions are applied
+ *   a request of type BATCH_END
+ *   the index: for every record, its offset (int64) and path (MAXPATH)
+ *   the offset of the index (int64), the number of records (int64) and
+ *   BATCH_INDEX_MAGIC
+ *
+ * Integers are big-endian, as on the wire. The records can be applied while
+ * the file is streamed; the index at the end tells a reader that can seek
+ * that the batch is complete before it changes anything.
+ */
+
+/**
+ * Start recording a batch. Transfer children append their records as they
+ * finish, so the file is only complete once batch_finish() returns.
+ * @param  path the batch file to create
+ * @return      0 on success, -1 on failure
+ */
+int batch_create(const char *path);
+
+/**
+ * Tell whether a batch is being recorded
+ * @return 1 if batch_create() succeeded and the batch is not yet finished
+ */
+int batch_recording();
+
+/**
+ * Record a request that needs no data, made by the main client
+ * @param  req the request the reference server answered OK
+ * @return     0 on success, -1 on failure
+ */
+int batch_request(struct request *req);
+
+/**
+ * Open a private file for a transfer child to write one record into, since
+ * the records of several children must not interleave
+ * @return the file descriptor, or -1 on failure
+ */
+int batch_spool();
+
+/**
+ * Append the record in a spool file to the batch in one piece and close the
+ * spool file
+ * @param  spool_fd the spool file from batch_spool()
+ * @return          0 on success, -1 on failure
+ */
+int batch_append(int spool_fd);
+
+/**
+ * Close the records with BATCH_END, add the index and move the batch to the
+ * path given to batch_create()
+ * @return the number of records, or -1 on failure
+ */
+long batch_finish();
+
+/**
+ * Drop a batch that could not be recorded completely
+ */
+void batch_discard();
+
+/**
+ * Open a batch file to be applied and check that it is complete
+ * @param  path  the batch file, or "-" for a stream on standard input
+ * @param  count filled with the number of records, or -1 if unknown
+ * @return       a file descriptor at the first record, or -1 on failure
+ */
+int batch_open(const char *path, long *count);
+
+#endif // _BATCH_H_
@@ -0,0 +1,448 @@
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "client.h"
+#include "ftree.h"
+
+// the offset of the index, the number of records and BATCH_INDEX_MAGIC
+#define FOOTER_SIZE (2 * sizeof(int64_t) + sizeof(BATCH_INDEX_MAGIC) - 1)
+#define INDEX_RECSIZE (sizeof(int64_t) + MAXPATH)
+// the BATCH_END record, as send_request() writes it
+#define END_RECSIZE \
+	(sizeof(int) + MAXPATH + sizeof(mode_t) + BLOCKSIZE + sizeof(int64_t))
+
+static int batch_fd = -1;
+static char batch_path[MAXPATH + 32];
+static char tmp_path[MAXPATH + 40];
+
+static int lock_batch(int type);
+static int read_record(int fd, struct request *req);
+static int skip_data(int fd);
+static int read_full(int fd, void *buf, size_t len);
+static int write_full(int fd, const void *buf, size_t len);
+
+
+/**
+ * Start recording a batch. Transfer children append their records as they
+ * finish, so the file is only complete once batch_finish() returns.
+ * @param  path the batch file to create
+ * @return      0 on success, -1 on failure
+ */
+int batch_create(const char *path) {
+	if (snprintf(batch_path, sizeof(batch_path), "%s", path) >=
+			(int)sizeof(batch_path) ||
+		snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >=
+			(int)sizeof(tmp_path)) {
+		fprintf(stderr, "batch_create: %s: Path too long\n", path);
+		return -1;
+	}
+
+	// every write lands at the end, whichever process makes it
+	if ((batch_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+						 0644)) < 0) {
+		perror("batch_create: open");
+		return -1;
+	}
+	if (write_full(batch_fd, BATCH_MAGIC, sizeof(BATCH_MAGIC) - 1) < 0) {
+		batch_discard();
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Tell whether a batch is being recorded
+ * @return 1 if batch_create() succeeded and the batch is not yet finished
+ */
+int batch_recording() {
+	return batch_fd >= 0;
+}
+
+
+/**
+ * Record a request that needs no data, made by the main client
+ * @param  req the request the reference server answered OK
+ * @return     0 on success, -1 on failure
+ */
+int batch_request(struct request *req) {
+	if (lock_batch(F_WRLCK) < 0) {
+		return -1;
+	}
+	int ret = send_request(batch_fd, req);
+	lock_batch(F_UNLCK);
+	return ret;
+}
+
+
+/**
+ * Open a private file for a transfer child to write one record into, since
+ * the records of several children must not interleave
+ * @return the file descriptor, or -1 on failure
+ */
+int batch_spool() {
+	// next to the batch, which is about to hold the record anyway
+	char spool_path[MAXPATH + 48];
+	snprintf(spool_path, sizeof(spool_path), "%s.XXXXXX", tmp_path);
+
+	int fd;
+	if ((fd = mkstemp(spool_path)) < 0) {
+		perror("batch_spool: mkstemp");
+		return -1;
+	}
+	unlink(spool_path);
+	return fd;
+}
+
+
+/**
+ * Append the record in a spool file to the batch in one piece and close the
+ * spool file
+ * @param  spool_fd the spool file from batch_spool()
+ * @return          0 on success, -1 on failure
+ */
+int batch_append(int spool_fd) {
+	char *buf = malloc(BATCH_COPYSIZE);
+	if (!buf) {
+		perror("batch_append: malloc");
+		close(spool_fd);
+		return -1;
+	}
+	if (lseek(spool_fd, 0, SEEK_SET) < 0 || lock_batch(F_WRLCK) < 0) {
+		perror("batch_append: lseek");
+		free(buf);
+		close(spool_fd);
+		return -1;
+	}
+
+	int ret = 0;
+	ssize_t n;
+	while ((n = read(spool_fd, buf, BATCH_COPYSIZE)) > 0) {
+		if (write_full(batch_fd, buf, n) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	if (n < 0) {
+		perror("batch_append: read");
+		ret = -1;
+	}
+
+	lock_batch(F_UNLCK);
+	free(buf);
+	close(spool_fd);
+	return ret;
+}
+
+
+/**
+ * Close the records with BATCH_END, add the index and move the batch to the
+ * path given to batch_create()
+ * @return the number of records, or -1 on failure
+ */
+long batch_finish() {
+	struct request req;
+	memset(&req, 0, sizeof(struct request));
+	req.type = BATCH_END;
+	if (send_request(batch_fd, &req) < 0) {
+		batch_discard();
+		return -1;
+	}
+
+	// the children could not tell the parent where their records went, so
+	// the index is made by walking the records once, seeking over the data
+	int fd;
+	if ((fd = open(tmp_path, O_RDONLY)) < 0 ||
+		lseek(fd, sizeof(BATCH_MAGIC) - 1, SEEK_SET) < 0) {
+		perror("batch_finish: open");
+		if (fd >= 0) {
+			close(fd);
+		}
+		batch_discard();
+		return -1;
+	}
+
+	FILE *index = tmpfile();
+	if (!index) {
+		perror("batch_finish: tmpfile");
+		close(fd);
+		batch_discard();
+		return -1;
+	}
+
+	long count = 0;
+	int ret = 0;
+	while (1) {
+		off_t offset = lseek(fd, 0, SEEK_CUR);
+		if ((ret = read_record(fd, &req)) < 0 || req.type == BATCH_END) {
+			break;
+		}
+		char entry[INDEX_RECSIZE] = {0};
+		int64_t net_offset = htobe64(offset);
+		memcpy(entry, &net_offset, sizeof(int64_t));
+		memcpy(entry + sizeof(int64_t), req.path, MAXPATH);
+		if (fwrite(entry, INDEX_RECSIZE, 1, index) != 1) {
+			perror("batch_finish: fwrite");
+			ret = -1;
+			break;
+		}
+		count++;
+	}
+	off_t index_offset = lseek(fd, 0, SEEK_END);
+	close(fd);
+
+	// the index and the footer go after the end record
+	char buf[INDEX_RECSIZE];
+	rewind(index);
+	while (ret == 0 && fread(buf, INDEX_RECSIZE, 1, index) == 1) {
+		ret = write_full(batch_fd, buf, INDEX_RECSIZE);
+	}
+	fclose(index);
+
+	char footer[FOOTER_SIZE];
+	int64_t net_index = htobe64(index_offset);
+	int64_t net_count = htobe64(count);
+	memcpy(footer, &net_index, sizeof(int64_t));
+	memcpy(footer + sizeof(int64_t), &net_count, sizeof(int64_t));
+	memcpy(footer + 2 * sizeof(int64_t), BATCH_INDEX_MAGIC,
+		   sizeof(BATCH_INDEX_MAGIC) - 1);
+	if (ret == 0) {
+		ret = write_full(batch_fd, footer, FOOTER_SIZE);
+	}
+
+	if (ret == 0 && close(batch_fd) < 0) {
+		perror("batch_finish: close");
+		ret = -1;
+	}
+	if (ret < 0) {
+		batch_discard();
+		return -1;
+	}
+	batch_fd = -1;
+	if (rename(tmp_path, batch_path) < 0) {
+		perror("batch_finish: rename");
+		unlink(tmp_path);
+		return -1;
+	}
+	return count;
+}
+
+
+/**
+ * Drop a batch that could not be recorded completely
+ */
+void batch_discard() {
+	if (batch_fd >= 0) {
+		close(batch_fd);
+		batch_fd = -1;
+		unlink(tmp_path);
+	}
+}
+
+
+/**
+ * Open a batch file to be applied and check that it is complete
+ * @param  path  the batch file, or "-" for a stream on standard input
+ * @param  count filled with the number of records, or -1 if unknown
+ * @return       a file descriptor at the first record, or -1 on failure
+ */
+int batch_open(const char *path, long *count) {
+	int fd;
+	char magic[sizeof(BATCH_MAGIC) - 1];
+
+	*count = -1;
+	if (strcmp(path, "-") == 0) {
+		fd = STDIN_FILENO;
+	} else if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		perror("batch_open: open");
+		return -1;
+	}
+
+	// a batch that can be seeked must end with its index
+	off_t end = lseek(fd, 0, SEEK_END);
+	if (end >= 0) {
+		char footer[FOOTER_SIZE];
+		int64_t net_index, net_count;
+		if (end < (off_t)(sizeof(magic) + FOOTER_SIZE) ||
+			pread(fd, footer, FOOTER_SIZE, end - FOOTER_SIZE) !=
+				FOOTER_SIZE ||
+			memcmp(footer + 2 * sizeof(int64_t), BATCH_INDEX_MAGIC,
+				   sizeof(BATCH_INDEX_MAGIC) - 1) != 0) {
+			fprintf(stderr, "batch_open: %s is not a complete batch\n", path);
+			close(fd);
+			return -1;
+		}
+		memcpy(&net_index, footer, sizeof(int64_t));
+		memcpy(&net_count, footer + sizeof(int64_t), sizeof(int64_t));
+
+		// the index must fill the space up to the footer and follow the
+		// end record; the count is checked by division so that a corrupt
+		// one cannot overflow
+		int64_t index = be64toh(net_index);
+		int64_t records = be64toh(net_count);
+		int end_type;
+		if (index < (off_t)(sizeof(magic) + END_RECSIZE) ||
+			index > end - (off_t)FOOTER_SIZE || records < 0 ||
+			(end - (off_t)FOOTER_SIZE - index) % (off_t)INDEX_RECSIZE != 0 ||
+			(end - (off_t)FOOTER_SIZE - index) / (off_t)INDEX_RECSIZE !=
+				records ||
+			pread(fd, &end_type, sizeof(int), index - END_RECSIZE) !=
+				sizeof(int) ||
+			(int)ntohl(end_type) != BATCH_END) {
+			fprintf(stderr, "batch_open: %s has a broken index\n", path);
+			close(fd);
+			return -1;
+		}
+		*count = records;
+		lseek(fd, 0, SEEK_SET);
+	}
+
+	if (read_full(fd, magic, sizeof(magic)) < 0 ||
+		memcmp(magic, BATCH_MAGIC, sizeof(magic)) != 0) {
+		fprintf(stderr, "batch_open: %s is not a batch\n", path);
+		if (fd != STDIN_FILENO) {
+			close(fd);
+		}
+		return -1;
+	}
+	return fd;
+}
+
+
+/**
+ * Helper function that locks or unlocks the whole batch. Record locks are
+ * held by a process, so they keep the parent and its children apart even
+ * though they share the open file.
+ * @param  type F_WRLCK or F_UNLCK
+ * @return      0 on success, -1 on failure
+ */
+static int lock_batch(int type) {
+	struct flock fl;
+	memset(&fl, 0, sizeof(struct flock));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	while (fcntl(batch_fd, F_SETLKW, &fl) < 0) {
+		if (errno != EINTR) {
+			perror("lock_batch: fcntl");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Helper function that reads one record and seeks over its file data.
+ * @param  fd  the batch, at the start of a record
+ * @param  req filled with the request of the record
+ * @return     0 on success, -1 on failure
+ */
+static int read_record(int fd, struct request *req) {
+	int type;
+	mode_t mode;
+	int64_t size;
+
+	memset(req, 0, sizeof(struct request));
+	if (read_full(fd, &type, sizeof(int)) < 0 ||
+		read_full(fd, req->path, MAXPATH) < 0 ||
+		read_full(fd, &mode, sizeof(mode_t)) < 0 ||
+		read_full(fd, req->hash, BLOCKSIZE) < 0 ||
+		read_full(fd, &size, sizeof(int64_t)) < 0) {
+		fprintf(stderr, "read_record: the batch is cut short\n");
+		return -1;
+	}
+	req->type = ntohl(type);
+	req->path[MAXPATH - 1] = '\0';
+	req->mode = ntohs(mode);
+	req->size = be64toh(size);
+
+	if (req->type == LINKFILE && read_full(fd, req->target, MAXPATH) < 0) {
+		fprintf(stderr, "read_record: the batch is cut short\n");
+		return -1;
+	}
+	if (req->type == TRANSFILE && S_ISREG(req->mode)) {
+		return skip_data(fd);
+	}
+	return 0;
+}
+
+
+/**
+ * Helper function that seeks over the extent frames and the hash of a file.
+ * @return 0 on success, -1 on failure
+ */
+static int skip_data(int fd) {
+	char hdr[EXTENT_HDRSIZE];
+	int type;
+	int64_t length;
+
+	do {
+		if (read_full(fd, hdr, EXTENT_HDRSIZE) < 0) {
+			fprintf(stderr, "skip_data: the batch is cut short\n");
+			return -1;
+		}
+		memcpy(&type, hdr, sizeof(int));
+		memcpy(&length, hdr + sizeof(int) + sizeof(int64_t), sizeof(int64_t));
+		type = ntohl(type);
+		if (type == EXTENT_DATA &&
+			lseek(fd, be64toh(length), SEEK_CUR) < 0) {
+			perror("skip_data: lseek");
+			return -1;
+		}
+	} while (type != EXTENT_END);
+
+	return lseek(fd, BLOCKSIZE, SEEK_CUR) < 0 ? -1 : 0;
+}
+
+
+/**
+ * Helper function that reads exactly len bytes.
+ * @return 0 on success, -1 on failure or at the end of the file
+ */
+static int read_full(int fd, void *buf, size_t len) {
+	char *p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			if (n < 0) {
+				perror("read_full: read");
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+/**
+ * Helper function that writes exactly len bytes.
+ * @return 0 on success, -1 on failure
+ */
+static int write_full(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("write_full: write");
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
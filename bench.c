@@ -0,0 +1,430 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "ftree.h"
+#include "hash.h"
+#include "server.h"
+
+#define BENCH_REPS 31		// timed repetitions of every kernel
+#define BENCH_WARMUP 3		// untimed repetitions before them
+#define BENCH_THRESHOLD 10	// slowdown in percent reported as a regression
+#define BENCH_MAXKERNELS 16
+#define BENCH_MAXNAME 64
+#define BENCH_REQUESTS 256	// requests queued in a socketpair per repetition
+
+/**
+ * A kernel to measure
+ * name				the name in the report and the baseline file
+ * setup			untimed preparation before each repetition, or NULL
+ * op				one operation of the kernel
+ * arg				passed to setup and op
+ * iters			operations per repetition
+ * bytes			bytes processed by one operation, 0 if not meaningful
+ */
+struct kernel {
+	char name[BENCH_MAXNAME];
+	void (*setup)(void *arg, long iters);
+	void (*op)(void *arg);
+	void *arg;
+	long iters;
+	size_t bytes;
+};
+
+/**
+ * The nanoseconds per operation of one kernel at a few percentiles
+ */
+struct result {
+	double p50;
+	double p90;
+	double p99;
+};
+
+/**
+ * State of the hash kernels
+ * f				the in-memory file to hash
+ */
+struct hash_arg {
+	FILE *f;
+};
+
+/**
+ * State of the socket kernels
+ * sv				a connected socketpair; requests go from sv[0] to sv[1]
+ * req				the request that is sent and parsed
+ * wire				req as it appears on the wire
+ * cp				the server side client state of sv[1]
+ */
+struct sock_arg {
+	int sv[2];
+	struct request req;
+	char wire[sizeof(int) + MAXPATH + sizeof(mode_t) + BLOCKSIZE +
+			  sizeof(int64_t)];
+	struct client *cp;
+};
+
+static int add_hash_kernel(struct kernel *k, const char *name, off_t size,
+						   int sparse);
+static void hash_op(void *arg);
+static void check_hash_op(void *arg);
+static void send_request_op(void *arg);
+static void read_request_setup(void *arg, long iters);
+static void read_request_op(void *arg);
+static void measure(struct kernel *k, int reps, int warmup,
+					struct result *res);
+static double now_ns();
+static int compare_doubles(const void *a, const void *b);
+static int load_baseline(const char *path, const char *name, double *p50);
+
+
+static void usage(char *prog) {
+	printf("Usage:\n\t%s [--reps N] [--warmup N] [--threshold PCT]\n"
+		   "\t\t[--baseline FILE] [--save FILE]\n", prog);
+	printf("\t --baseline FILE - Flag kernels whose median is more than PCT "
+		   "percent\n\t\tslower than in FILE (default %d), or missing from "
+		   "it; fail\n\t\tif FILE does not exist\n", BENCH_THRESHOLD);
+	printf("\t --save FILE - Write the medians of this run to FILE\n");
+}
+
+int main(int argc, char **argv) {
+	static struct option long_options[] = {
+		{"reps", required_argument, NULL, 'r'},
+		{"warmup", required_argument, NULL, 'w'},
+		{"threshold", required_argument, NULL, 't'},
+		{"baseline", required_argument, NULL, 'b'},
+		{"save", required_argument, NULL, 's'},
+		{NULL, 0, NULL, 0}
+	};
+	int reps = BENCH_REPS, warmup = BENCH_WARMUP;
+	double threshold = BENCH_THRESHOLD;
+	char *baseline = NULL, *save = NULL;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "r:w:t:b:s:", long_options,
+							  NULL)) != -1) {
+		switch (opt) {
+		case 'r':
+			reps = atoi(optarg);
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		case 't':
+			threshold = atof(optarg);
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 's':
+			save = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (reps < 1 || warmup < 0 || optind != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	// a check against no baseline would pass whatever it measured
+	if (baseline && access(baseline, R_OK) < 0) {
+		fprintf(stderr, "bench: %s: %s; save one with --save FILE or make "
+						"bench-baseline\n",
+				baseline, strerror(errno));
+		return 1;
+	}
+
+	struct kernel kernels[BENCH_MAXKERNELS];
+	int n = 0;
+
+	// hashing of dense files on the sequential and the tree path, and of a
+	// file that is one big hole
+	if (add_hash_kernel(&kernels[n++], "hash/4K", 4 << 10, 0) < 0 ||
+		add_hash_kernel(&kernels[n++], "hash/1M", 1 << 20, 0) < 0 ||
+		add_hash_kernel(&kernels[n++], "hash/64M", HASH_PARALLEL_MIN, 0) < 0 ||
+		add_hash_kernel(&kernels[n++], "hash_sparse/64M", HASH_PARALLEL_MIN,
+						1) < 0) {
+		return 1;
+	}
+
+	static char hash1[BLOCKSIZE] = "abcdefg", hash2[BLOCKSIZE] = "abcdefg";
+	static char *hashes[2] = {hash1, hash2};
+	struct kernel *k = &kernels[n++];
+	strncpy(k->name, "check_hash", BENCH_MAXNAME);
+	k->setup = NULL;
+	k->op = check_hash_op;
+	k->arg = hashes;
+	k->iters = 1 << 20;
+	k->bytes = 0;
+
+	// the request path over a local socketpair
+	struct sock_arg sock;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock.sv) < 0) {
+		perror("bench: socketpair");
+		return 1;
+	}
+	memset(&sock.req, 0, sizeof(struct request));
+	sock.req.type = REGFILE;
+	strncpy(sock.req.path, "bench/dir/file", MAXPATH);
+	sock.req.mode = S_IFREG | 0644;
+	memcpy(sock.req.hash, hash1, BLOCKSIZE);
+	sock.req.size = 1 << 20;
+	struct in_addr addr = {0};
+	if (!(sock.cp = add_client(NULL, sock.sv[1], addr))) {
+		return 1;
+	}
+	// capture the wire form once to queue it cheaply later
+	if (send_request(sock.sv[0], &sock.req) < 0 ||
+		read(sock.sv[1], sock.wire, sizeof(sock.wire)) != sizeof(sock.wire)) {
+		fprintf(stderr, "bench: could not capture a request\n");
+		return 1;
+	}
+
+	k = &kernels[n++];
+	strncpy(k->name, "send_request", BENCH_MAXNAME);
+	k->setup = NULL;
+	k->op = send_request_op;
+	k->arg = &sock;
+	k->iters = 4096;
+	k->bytes = sizeof(sock.wire);
+
+	k = &kernels[n++];
+	strncpy(k->name, "read_request", BENCH_MAXNAME);
+	k->setup = read_request_setup;
+	k->op = read_request_op;
+	k->arg = &sock;
+	k->iters = BENCH_REQUESTS;
+	k->bytes = sizeof(sock.wire);
+
+	FILE *save_f = NULL;
+	if (save && !(save_f = fopen(save, "w"))) {
+		perror("bench: fopen");
+		return 1;
+	}
+
+	int regressions = 0, unknown = 0;
+	printf("%-18s %12s %12s %12s %10s\n", "kernel", "p50 ns/op", "p90 ns/op",
+		   "p99 ns/op", "MB/s");
+	for (int i = 0; i < n; i++) {
+		struct result res;
+		measure(&kernels[i], reps, warmup, &res);
+
+		printf("%-18s %12.1f %12.1f %12.1f", kernels[i].name, res.p50,
+			   res.p90, res.p99);
+		if (kernels[i].bytes) {
+			printf(" %10.1f", kernels[i].bytes / res.p50 * 1e3);
+		} else {
+			printf(" %10s", "-");
+		}
+
+		double base;
+		if (baseline && load_baseline(baseline, kernels[i].name, &base) == 0) {
+			double change = (res.p50 - base) / base * 100;
+			printf("  %+6.1f%%", change);
+			if (change > threshold) {
+				printf("  REGRESSION");
+				regressions++;
+			}
+		} else if (baseline) {
+			printf("  NO BASELINE");
+			unknown++;
+		}
+		printf("\n");
+
+		if (save_f) {
+			fprintf(save_f, "%s %.1f\n", kernels[i].name, res.p50);
+		}
+	}
+
+	if (save_f && fclose(save_f) != 0) {
+		perror("bench: fclose");
+		return 1;
+	}
+	if (regressions) {
+		printf("%d kernel(s) slower than the baseline by more than %.0f%%\n",
+			   regressions, threshold);
+	}
+	if (unknown) {
+		printf("%d kernel(s) missing from the baseline\n", unknown);
+	}
+	return regressions || unknown ? 1 : 0;
+}
+
+
+/**
+ * Helper function that sets up a hash kernel over an in-memory file.
+ * @param  k      the kernel to fill in
+ * @param  size   the size of the file
+ * @param  sparse 1 for a file without any data extent
+ * @return        0 on success, -1 on failure
+ */
+static int add_hash_kernel(struct kernel *k, const char *name, off_t size,
+						   int sparse) {
+	struct hash_arg *arg = malloc(sizeof(struct hash_arg));
+	int fd = memfd_create(name, 0);
+	if (!arg || fd < 0 || ftruncate(fd, size) < 0) {
+		perror("bench: memfd_create");
+		return -1;
+	}
+
+	if (!sparse) {
+		char buf[MAXDATA];
+		unsigned int x = 2463534242u;
+		for (off_t off = 0; off < size; off += MAXDATA) {
+			for (int i = 0; i < MAXDATA; i++) { // xorshift
+				x ^= x << 13;
+				x ^= x >> 17;
+				x ^= x << 5;
+				buf[i] = x;
+			}
+			if (pwrite(fd, buf, MAXDATA, off) != MAXDATA) {
+				perror("bench: pwrite");
+				return -1;
+			}
+		}
+	}
+	if (!(arg->f = fdopen(fd, "rb"))) {
+		perror("bench: fdopen");
+		return -1;
+	}
+
+	strncpy(k->name, name, BENCH_MAXNAME);
+	k->setup = NULL;
+	k->op = hash_op;
+	k->arg = arg;
+	k->iters = size >= (8 << 20) ? 1 : (8 << 20) / size;
+	k->bytes = size;
+	return 0;
+}
+
+static void hash_op(void *arg) {
+	char hash_val[BLOCKSIZE];
+	hash(hash_val, ((struct hash_arg *)arg)->f);
+}
+
+static void check_hash_op(void *arg) {
+	char **hashes = arg;
+	if (check_hash(hashes[0], hashes[1]) != 0) {
+		fprintf(stderr, "bench: check_hash mismatch\n");
+	}
+}
+
+/**
+ * One request sent by the client and drained from the other end.
+ */
+static void send_request_op(void *arg) {
+	struct sock_arg *sock = arg;
+	char buf[sizeof(sock->wire)];
+	send_request(sock->sv[0], &sock->req);
+	if (read(sock->sv[1], buf, sizeof(buf)) != sizeof(buf)) {
+		fprintf(stderr, "bench: short read\n");
+	}
+}
+
+/**
+ * Queue the requests that the timed repetition will parse.
+ */
+static void read_request_setup(void *arg, long iters) {
+	struct sock_arg *sock = arg;
+	for (long i = 0; i < iters; i++) {
+		if (write(sock->sv[0], sock->wire, sizeof(sock->wire)) !=
+			sizeof(sock->wire)) {
+			perror("bench: write");
+		}
+	}
+}
+
+/**
+ * One request parsed field by field by the server state machine.
+ */
+static void read_request_op(void *arg) {
+	struct sock_arg *sock = arg;
+	int result;
+	sock->cp->current_state = WAIT_TYPE;
+	while ((result = read_request(sock->cp)) == HANDLE_READOK)
+		;
+	if (result != HANDLE_READDONE) {
+		fprintf(stderr, "bench: read_request %d\n", result);
+	}
+}
+
+
+/**
+ * Helper function that times a kernel and reports its percentiles.
+ */
+static void measure(struct kernel *k, int reps, int warmup,
+					struct result *res) {
+	double *samples = malloc(reps * sizeof(double));
+	if (!samples) {
+		perror("bench: malloc");
+		exit(1);
+	}
+
+	for (int r = -warmup; r < reps; r++) {
+		if (k->setup) {
+			k->setup(k->arg, k->iters);
+		}
+		double start = now_ns();
+		for (long i = 0; i < k->iters; i++) {
+			k->op(k->arg);
+		}
+		double elapsed = now_ns() - start;
+		if (r >= 0) {
+			samples[r] = elapsed / k->iters;
+		}
+	}
+
+	qsort(samples, reps, sizeof(double), compare_doubles);
+	res->p50 = samples[reps * 50 / 100];
+	res->p90 = samples[reps * 90 / 100];
+	res->p99 = samples[reps * 99 / 100];
+	free(samples);
+}
+
+static double now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Helper function that finds the median of a kernel in a baseline file of
+ * "name p50" lines.
+ * @return 0 if found, -1 otherwise
+ */
+static int load_baseline(const char *path, const char *name, double *p50) {
+	FILE *f;
+	if (!(f = fopen(path, "r"))) {
+		if (errno != ENOENT) {
+			perror("bench: fopen baseline");
+		}
+		return -1;
+	}
+
+	char line_name[BENCH_MAXNAME];
+	double value;
+	int ret = -1;
+	while (fscanf(f, "%63s %lf", line_name, &value) == 2) {
+		if (strcmp(line_name, name) == 0 && value > 0) {
+			*p50 = value;
+			ret = 0;
+			break;
+		}
+	}
+	fclose(f);
+	return ret;
+}
@@ -14,22 +14,145 @@
 
 #include "hash.h"       // hash()
 #include "ftree.h"      // request stuct
+#include "fanout.h"     // MAXDEST
+
+#define UNIX_PREFIX "unix:"		// host prefix of a server on a Unix socket
+#define LINK_BUCKETS 1024		// buckets of the hard link table
+
+// read-ahead of the files whose transfers are about to start
+#define PREFETCH_DEPTH 8				// files read ahead by default
+#define PREFETCH_FILEMAX (4 << 20)		// bytes read ahead of one file
+#define PREFETCH_MAXBYTES (32 << 20)	// bytes read ahead of all files
+
+// digests of the files the transfer children sent, for the digest cache
+#define REPORT_PIPESIZE (1 << 20)		// bytes of reports the pipe holds
+
+/**
+ * The first link seen of a file with several hard links
+ * dev, ino			the identity of the file
+ * src_path			the path of the first link
+ * server_path		the server path of the first link
+ * pid				the child transferring the first link, 0 if none
+ * next				the next entry in the same bucket
+ */
+struct link_entry {
+    dev_t dev;
+    ino_t ino;
+    char src_path[MAXPATH];
+    char server_path[MAXPATH];
+    pid_t pid;
+    struct link_entry *next;
+};
+
+/**
+ * A file transfer held back while its file is read ahead
+ * src_path			the file or directory to send
+ * req				the request the servers answered SENDFILE
+ * sendto			the indices of those servers in the dests
+ * nsend			the length of sendto
+ * link				the hard link entry if this is a first link, or NULL
+ * prefetched		the bytes of the file asked of the disk
+ */
+struct transfer {
+    char src_path[MAXPATH];
+    struct request req;
+    int sendto[MAXDEST];
+    int nsend;
+    struct link_entry *link;
+    off_t prefetched;
+};
+
+/**
+ * The digest of a file a transfer child computed while sending it, reported
+ * to the main client so the next run does not read the file again
+ * dev, ino			the identity of the file
+ * size				the size of the file
+ * mtime, ctime		the timestamps of the file, unchanged while it was read
+ * hash				the digest of the data sent
+ */
+struct digest_report {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    char hash[BLOCKSIZE];
+};
+
+/**
+ * The servers a source tree is replicated to
+ * n				the number of servers
+ * hosts			the host name of each server
+ * socks			the main connection to each server
+ * port				the port the servers listen on
+ */
+struct dests {
+    int n;
+    char *hosts[MAXDEST];
+    int socks[MAXDEST];
+    unsigned short port;
+};
 
 /**
  * Initialize a client socket
- * @param  host the host address
+ * @param  host the host address, or unix:PATH for a server on this host
+ *              listening on the Unix domain socket PATH
  * @return      the socket file descriptor
  */
 int client_sock(char *host, unsigned short port);
 
+/**
+ * Initialize a client socket connected to a Unix domain socket
+ * @param  path the path of the socket the server listens on
+ * @return      the socket file descriptor
+ */
+int client_unix_sock(char *path);
+
 int main_client_wait();
 
+/**
+ * Send the request struct to the server
+ * @param  sock_fd the connecting socket file descriptor
+ * @param  request the request to send
+ * @return         0 on success, -1 on failure.
+ */
+int send_request(int sock_fd, struct request *request);
+
+/**
+ * Reap the transfer children that have already exited without blocking.
+ * @return 0 if all reaped children succeeded; -1 otherwise.
+ */
+int main_client_reap();
+
+/**
+ * Set how many files are read ahead of the transfer that sends them
+ * @param  depth the number of files, 0 to start every transfer at once
+ */
+void prefetch_configure(int depth);
+
+/**
+ * Start every transfer still waiting in the read-ahead queue
+ * @param  d the servers to sync to
+ * @return   0 on success; -1 on failure.
+ */
+int flush_transfers(struct dests *d);
+
+/**
+ * Sync the single file or directory at src_path without descending into it.
+ * The transfer of a file may wait in the read-ahead queue until
+ * flush_transfers(). A file with several hard links is sent once; its other
+ * links are made on the servers with LINKFILE requests.
+ * @param  d the servers to sync to
+ * @return   1 if every server already has the whole directory subtree,
+ *           0 on success; -1 on failure.
+ */
+int sync_path(struct dests *d, char *src_path, char *server_path);
+
 /**
  * traverse the file rooted at src
- * @param  sock_fd the socket file descriptor
- * @return         0 on success; -1 on failure.
+ * @param  d the servers to sync to
+ * @return   0 on success; -1 on failure.
  */
-int traverse(int sock_fd, char *src_path, char *server_path, char *host,
-	unsigned short port);
+int traverse(struct dests *d, char *src_path, char *server_path);
 
 #endif
@@ -1,42 +1,80 @@
+#define _GNU_SOURCE
 #include <dirent.h>
+#include <endian.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
+#include "batch.h"
 #include "client.h"
+#include "digest.h"
+#include "filter.h"
 #include "ftree.h"
 #include "hash.h"
 
-static int generate_request(int sock_fd, char *src_path, char *server_path,
-							struct request *request);
-static int send_request(int sock_fd, struct request *request);
-static int send_data(int sock_fd, char *src_path);
+static int generate_request(char *src_path, char *server_path,
+							struct request *request, int probe);
+static int send_file(struct dests *d, int *which, int n, char *src_path,
+					 struct request *req);
+static int send_data(struct fanout *fo, char *src_path, off_t size);
+static int send_extent(struct fanout *fo, int type, off_t offset,
+					   off_t length);
+static struct link_entry *find_link(struct stat *st, char *src_path,
+									char *server_path);
+static int wait_child(pid_t pid);
+static int wait_dirs();
+static int queue_transfer(struct dests *d, struct transfer *t);
+static int start_oldest(struct dests *d);
+static int start_transfer(struct dests *d, struct transfer *t);
+static off_t prefetch(char *src_path, off_t size);
+static void report_digest(const struct stat *st, const char *hash_val);
+static void collect_digests();
 
 int CHILD_COUNT = 0;
+static struct link_entry *links[LINK_BUCKETS];
+static pid_t *dir_children = NULL; // children creating directories
+static int ndir_children = 0, dir_children_cap = 0;
+static int prefetch_depth = PREFETCH_DEPTH;
+static struct transfer *pending = NULL; // ring of transfers reading ahead
+static int pending_head = 0, npending = 0;
+static off_t pending_bytes = 0; // bytes asked of the disk for pending
+static int report_fds[2] = {-1, -1}; // digest reports from the children
 
 
 /**
  * Initialize a client socket.
- * @param  host the host address.
+ * @param  host the host address, or unix:PATH for a server on this host
+ *              listening on the Unix domain socket PATH.
  * @return      the socket file descriptor.
  */
 int client_sock(char *host, unsigned short port) {
 	int sock_fd;
-	struct hostent *hp;
+	struct addrinfo hints, *res;
 	struct sockaddr_in peer;
 
+	// a server on the same host can skip the TCP/IP stack
+	if (strncmp(host, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+		return client_unix_sock(host + strlen(UNIX_PREFIX));
+	}
+
 	peer.sin_family = PF_INET;
 	peer.sin_port = htons(port);
 
-	/* fill in peer address */
-	hp = gethostbyname(host);
-	if (hp == NULL) {
+	/* fill in peer address; unlike gethostbyname this is safe in the
+	 * threads of verify and rcopy_loadgen */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, NULL, &hints, &res) != 0) {
 		fprintf(stderr, "client_sock: %s unknown host\n", host);
 		return -1;
 	}
 
-	peer.sin_addr = *((struct in_addr *)hp->h_addr);
+	peer.sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+	freeaddrinfo(res);
 
 	/* create socket */
 	if ((sock_fd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
@@ -55,6 +93,37 @@ int client_sock(char *host, unsigned short port) {
 }
 
 
+/**
+ * Initialize a client socket connected to a Unix domain socket.
+ * @param  path the path of the socket the server listens on.
+ * @return      the socket file descriptor.
+ */
+int client_unix_sock(char *path) {
+	int sock_fd;
+	struct sockaddr_un peer;
+
+	memset(&peer, 0, sizeof(peer));
+	peer.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(peer.sun_path)) {
+		fprintf(stderr, "client_unix_sock: %s: Path too long\n", path);
+		return -1;
+	}
+	strcpy(peer.sun_path, path);
+
+	if ((sock_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("client_unix_sock: socket");
+		return -1;
+	}
+	if (connect(sock_fd, (struct sockaddr *)&peer, sizeof(peer)) < 0) {
+		perror("client_unix_sock: connect");
+		close(sock_fd);
+		return -1;
+	}
+
+	return sock_fd;
+}
+
+
 int main_client_wait() {
 	while(CHILD_COUNT != 0){
         pid_t pid;
@@ -75,98 +144,217 @@ int main_client_wait() {
         }
 		CHILD_COUNT --;
     }
+	collect_digests();
     return 0;
 }
 
 
 /**
- * Traverse the file rooted at src.
- * @param  sock_fd the socket file descriptor.
- * @return         0 on success; -1 on failure.
+ * Reap the transfer children that have already exited without blocking.
+ * @return 0 if all reaped children succeeded; -1 otherwise.
  */
-int traverse(int sock_fd, char *src_path, char *server_path, char *host,
-			 unsigned short port) {
-	// first generate and send request
-	struct request req;
-	if (generate_request(sock_fd, src_path, server_path, &req) < 0) {
-		fprintf(stderr, "traverse: generate_request\n");
-		return -1;
+int main_client_reap() {
+	int ret = 0;
+	pid_t pid;
+	int status;
+
+	while (CHILD_COUNT != 0 && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "main_client_reap: child %d failed\n", pid);
+			ret = -1;
+		}
+		CHILD_COUNT --;
 	}
-	printf("path: %s; type: %d; mode: %u; hash: %s; size: %u\n", req.path,
-		   req.type, req.mode, req.hash, req.size);
+	collect_digests();
+	return ret;
+}
 
-	if (send_request(sock_fd, &req) < 0) {
-		fprintf(stderr, "traverse: send_request\n");
-		return -1;
+
+/**
+ * Set how many files are read ahead of the transfer that sends them.
+ * @param  depth the number of files, 0 to start every transfer at once.
+ */
+void prefetch_configure(int depth) {
+	prefetch_depth = depth;
+}
+
+
+/**
+ * Start every transfer still waiting in the read-ahead queue.
+ * @param  d the servers to sync to.
+ * @return   0 on success; -1 on failure.
+ */
+int flush_transfers(struct dests *d) {
+	while (npending > 0) {
+		if (start_oldest(d) < 0) {
+			return -1;
+		}
 	}
+	return 0;
+}
+
+
+/**
+ * Sync the single file or directory at src_path: send its request to every
+ * server and, if any of them answers SENDFILE, fork one child that reads the
+ * file once and transfers it to all of those servers. The child of a file
+ * may wait in the read-ahead queue until flush_transfers(). A file with
+ * several hard links is sent once; its other links are made on the servers
+ * with LINKFILE requests.
+ * @param  d the servers to sync to.
+ * @return   1 if every server already has the whole directory subtree,
+ *           0 on success; -1 on failure.
+ */
+int sync_path(struct dests *d, char *src_path, char *server_path) {
+	struct request req;
+	struct stat src_stat;
+	struct link_entry *link = NULL;
 
-	// read the response to see if client should fork and send file
-	int response = ERROR;
-	if (read(sock_fd, &response, sizeof(int)) < 0) {
-		perror("traverse: read");
+	if (lstat(src_path, &src_stat) != 0) {
+		perror("sync_path: lstat");
+		return -1;
+	}
+	if (S_ISREG(src_stat.st_mode) && src_stat.st_nlink > 1 &&
+		!(link = find_link(&src_stat, src_path, server_path))) {
 		return -1;
 	}
-	response = ntohl(response);
 
-	if (response == SENDFILE) {
-		// fork a new process and send file
-		int result = fork();
-		CHILD_COUNT ++;
-		if (result < 0) {
-			perror("traverse: fork");
+	// first generate and send request
+	if (link && strcmp(link->src_path, src_path) != 0) {
+		// the data of the first link and the directory of the new one must
+		// be on the servers before the servers can link
+		if (flush_transfers(d) < 0 ||
+			(link->pid > 0 && wait_child(link->pid) < 0) || wait_dirs() < 0) {
 			return -1;
-		} else if (result == 0) { // child
-			// create a new socket
-			sock_fd = client_sock(host, port);
-			int file_type = req.type;
-			req.type = TRANSFILE;
-			if (send_request(sock_fd, &req) < 0) {
-				fprintf(stderr, "traverse: send_request\n");
-				exit(-1);
-			}
+		}
+		link->pid = 0;
+
+		memset(&req, 0, sizeof(struct request));
+		req.type = LINKFILE;
+		strncpy(req.path, server_path, MAXPATH - 1);
+		req.mode = src_stat.st_mode;
+		req.size = src_stat.st_size;
+		strncpy(req.target, link->server_path, MAXPATH - 1);
+		printf("path: %s; type: %d; mode: %u; link to: %s\n", req.path,
+			   req.type, req.mode, req.target);
+	} else {
+		if (generate_request(src_path, server_path, &req, 1) < 0) {
+			fprintf(stderr, "sync_path: generate_request\n");
+			return -1;
+		}
+		printf("path: %s; type: %d; mode: %u; hash: %s; size: %lld\n",
+			   req.path, req.type, req.mode, req.hash, (long long)req.size);
+	}
 
-			// only send data when the file is REGFILE and its size > 0
-			if (file_type == REGFILE && req.size > 0) {
-				if (send_data(sock_fd, src_path) < 0) {
-					fprintf(stderr, "traverse: send_data %s\n", src_path);
-					close(sock_fd);
-					exit(-1);
-				}
+	// read the responses to see which servers need the file; a server that
+	// cannot tell without the hash is asked again with it
+	int ask[MAXDEST];
+	int nask = d->n;
+	int sendto[MAXDEST];
+	int nsend = 0;
+	int nskip = 0;
+	int ret = 0;
+	for (int i = 0; i < d->n; i++) {
+		ask[i] = i;
+	}
+	while (nask > 0) {
+		for (int k = 0; k < nask; k++) {
+			if (send_request(d->socks[ask[k]], &req) < 0) {
+				fprintf(stderr, "sync_path: send_request to %s\n",
+						d->hosts[ask[k]]);
+				return -1;
 			}
+		}
 
-			// send data or not, read another response from the server
-			if (read(sock_fd, &response, sizeof(int)) < 0) {
-				perror("traverse: read");
-				close(sock_fd);
+		int nhash = 0;
+		for (int k = 0; k < nask; k++) {
+			int i = ask[k];
+			int response = ERROR;
+			if (read(d->socks[i], &response, sizeof(int)) < 0) {
+				perror("sync_path: read");
 				return -1;
 			}
 			response = ntohl(response);
 
-			close(sock_fd);
-
-			if (response == OK) {
-				exit(0);
+			if (response == SENDFILE) {
+				sendto[nsend++] = i;
+			} else if (response == HASHFILE && req.type == PROBEFILE) {
+				ask[nhash++] = i;
+			} else if (response == SKIPDIR) {
+				nskip++;
 			} else if (response == ERROR) {
-				fprintf(stderr, "traverse child for %s: server read data",
-						src_path);
-			} else {
 				fprintf(stderr,
-						"traverse child for %s: server incorrect response\n",
-						src_path);
+						"sync_path: %s responded with ERROR on file %s\n",
+						d->hosts[i], src_path);
+				ret = -1;
+			} else if (response != OK) {
+				fprintf(stderr, "sync_path: invalid response from %s\n",
+						d->hosts[i]);
+				ret = -1;
 			}
-			exit(-1);
 		}
 
-	} else if (response == ERROR) {
-		fprintf(stderr,
-				"traverse: the server responded with ERROR on file %s\n",
-				src_path);
+		if (nhash > 0 &&
+			generate_request(src_path, server_path, &req, 0) < 0) {
+			fprintf(stderr, "sync_path: generate_request\n");
+			return -1;
+		}
+		nask = nhash;
+	}
+
+	// a path the reference server already has only carries its permissions
+	if (nsend == 0 && ret == 0 && nskip == 0 && batch_recording() &&
+		batch_request(&req) < 0) {
 		return -1;
-	} else if (response != OK) {
-		fprintf(stderr, "traverse: invalid response from server\n");
+	}
+
+	// a server that cannot link, because it lacks the first link, gets the
+	// data after all
+	if (nsend > 0 && req.type == LINKFILE &&
+		generate_request(src_path, server_path, &req, 1) < 0) {
+		fprintf(stderr, "sync_path: generate_request\n");
 		return -1;
 	}
 
+	if (nsend > 0) {
+		struct transfer t;
+		strncpy(t.src_path, src_path, MAXPATH - 1);
+		t.src_path[MAXPATH - 1] = '\0';
+		t.req = req;
+		memcpy(t.sendto, sendto, nsend * sizeof(int));
+		t.nsend = nsend;
+		t.link = link && strcmp(link->src_path, src_path) == 0 ? link : NULL;
+
+		// a file waits in the read-ahead queue while the disk fetches it;
+		// a directory has nothing to read
+		if (prefetch_depth > 0 && S_ISREG(req.mode)) {
+			if (queue_transfer(d, &t) < 0) {
+				return -1;
+			}
+		} else if (start_transfer(d, &t) < 0) {
+			return -1;
+		}
+	}
+
+	if (ret == 0 && nskip == d->n) {
+		return 1;
+	}
+	return ret;
+}
+
+
+/**
+ * Traverse the file rooted at src.
+ * @param  d the servers to sync to.
+ * @return   0 on success; -1 on failure.
+ */
+int traverse(struct dests *d, char *src_path, char *server_path) {
+	int result = sync_path(d, src_path, server_path);
+	if (result < 0) {
+		return -1;
+	} else if (result > 0) { // the servers have the same subtree
+		return 0;
+	}
 
 	struct stat src_stat;
 	if (lstat(src_path, &src_stat) != 0) {
@@ -206,8 +394,13 @@ int traverse(int sock_fd, char *src_path, char *server_path, char *host,
 			strncat(new_server_path, dirent->d_name,
 					sizeof(new_server_path) - strlen(dirent->d_name) - 1);
 
-			if (traverse(sock_fd, new_src_path, new_server_path, host, port) <
-				0) {
+			// an excluded subtree is never stat'ed or opened
+			if (filter_excluded(filter_rel(new_server_path),
+								dirent->d_type)) {
+				continue;
+			}
+
+			if (traverse(d, new_src_path, new_server_path) < 0) {
 				fprintf(stderr, "traverse: traverse\n");
 				return -1;
 			}
@@ -225,14 +418,16 @@ int traverse(int sock_fd, char *src_path, char *server_path, char *host,
 /**
  * Helper function that makes a request to the server to identify itself for
  * being the main client.
- * @param  sock_fd     the connecting socket file descriptor.
  * @param  src_path    the absolute or relative source path.
  * @param  server_path the server path.
  * @param  request	   the request to be filled in.
+ * @param  probe	   1 to make a PROBEFILE request if the digest cannot be
+ *                     had without reading file data, leaving the hashing to
+ *                     when it is needed.
  * @return             0 on success, -1 on failure.
  */
-static int generate_request(int sock_fd, char *src_path, char *server_path,
-							struct request *request) {
+static int generate_request(char *src_path, char *server_path,
+							struct request *request, int probe) {
 	struct stat src_stat;
 
 	if (lstat(src_path, &src_stat) != 0) {
@@ -244,106 +439,556 @@ static int generate_request(int sock_fd, char *src_path, char *server_path,
 	request->mode = src_stat.st_mode;
 	request->size = src_stat.st_size;
 
-	if (S_ISREG(src_stat.st_mode)) {
-		// open file for hash
-		FILE *src_f;
-		if (!(src_f = fopen(src_path, "rb"))) {
-			perror("generate_request: fopen");
+	if (!S_ISREG(src_stat.st_mode) && !S_ISDIR(src_stat.st_mode)) {
+		fprintf(stderr, "generate_request: Unsupported file type\n");
+		return -1;
+	} else if (probe && (S_ISREG(src_stat.st_mode)
+						 ? digest_cached(&src_stat, request->hash)
+						 : digest_dir_cached(AT_FDCWD, src_path, &src_stat,
+											 request->hash,
+											 filter_rel(server_path))) < 0) {
+		// a server without the path needs no hash, a file it needs is
+		// hashed as it is sent, and a directory is descended into so that
+		// each of its files is read at most once more
+		memset(request->hash, 0, BLOCKSIZE);
+		request->type = PROBEFILE;
+	} else if (S_ISREG(src_stat.st_mode)) {
+		if (digest_file(AT_FDCWD, src_path, &src_stat, request->hash) < 0) {
+			fprintf(stderr, "generate_request: digest_file\n");
 			return -1;
 		}
-
-		hash(request->hash, src_f);
 		request->type = REGFILE;
-
-		if (fclose(src_f) < 0) {
-			perror("generate_request: fclose");
+	} else {
+		// the digest of the whole subtree lets the server skip it at once
+		if (digest_dir(AT_FDCWD, src_path, &src_stat, request->hash,
+					   filter_rel(server_path)) < 0) {
+			fprintf(stderr, "generate_request: digest_dir\n");
 			return -1;
 		}
-	} else if (S_ISDIR(src_stat.st_mode)) {
-		strncpy(request->hash, "\0", BLOCKSIZE);
 		request->type = REGDIR;
-	} else {
-		fprintf(stderr, "generate_request: Unsupported file type\n");
-		return -1;
 	}
 
 	return 0;
 }
 
 /**
- * Helper function that sends the request struct to the server.
+ * Send the request struct to the server.
  * @param  sock_fd the connecting socket file descriptor.
  * @param  request the request struct that has been filled out by
  *                 generate_request.
  * @return         0 on success, -1 on failure.
  */
-static int send_request(int sock_fd, struct request *request) {
+int send_request(int sock_fd, struct request *request) {
+	// the fields go out in a single write, so that Nagle's algorithm never
+	// holds one back waiting for the ack of the previous one
+	char buf[sizeof(int) + MAXPATH + sizeof(mode_t) + BLOCKSIZE +
+			 sizeof(int64_t) + MAXPATH];
+	char *p = buf;
 
 	int type = htonl(request->type);
-	if (write(sock_fd, &type, sizeof(int)) < 0) {
-		perror("send_request: write type");
-		return -1;
+	memcpy(p, &type, sizeof(int));
+	p += sizeof(int);
+
+	memcpy(p, request->path, MAXPATH);
+	p += MAXPATH;
+
+	mode_t mode = htons(request->mode);
+	memcpy(p, &mode, sizeof(mode_t));
+	p += sizeof(mode_t);
+
+	memcpy(p, request->hash, BLOCKSIZE);
+	p += BLOCKSIZE;
+
+	int64_t size = htobe64(request->size);
+	memcpy(p, &size, sizeof(int64_t));
+	p += sizeof(int64_t);
+
+	if (request->type == LINKFILE) {
+		memcpy(p, request->target, MAXPATH);
+		p += MAXPATH;
 	}
 
-	if (write(sock_fd, request->path, MAXPATH) < 0) {
-		perror("send_request: write path");
-		return -1;
+	size_t len = p - buf;
+	for (size_t sent = 0; sent < len;) {
+		ssize_t n = write(sock_fd, buf + sent, len - sent);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("send_request: write");
+			return -1;
+		}
+		sent += n;
 	}
 
-	mode_t mode = htons(request->mode);
-	if (write(sock_fd, &mode, sizeof(mode_t)) < 0) {
-		perror("send_request: write mode");
+	return 0;
+}
+
+
+/**
+ * Helper function run by a transfer child: connect to each server in which,
+ * send the TRANSFILE request and stream the file to all of them at once.
+ * @param  d        the servers of the main client.
+ * @param  which    the indices in d of the servers that need the file.
+ * @param  n        the length of which.
+ * @param  src_path the path of the file to send.
+ * @param  req      the request that the servers answered with SENDFILE.
+ * @return          0 if every server stored the file, -1 otherwise.
+ */
+static int send_file(struct dests *d, int *which, int n, char *src_path,
+					 struct request *req) {
+	int fds[MAXDEST];
+	int nfds = 0;
+	int ret = 0;
+
+	req->type = TRANSFILE;
+
+	// a recorded batch gets the same request and stream as the servers
+	int spool_fd = -1;
+	if (batch_recording() &&
+		((spool_fd = batch_spool()) < 0 || send_request(spool_fd, req) < 0)) {
 		return -1;
 	}
 
-	if (write(sock_fd, request->hash, BLOCKSIZE) < 0) {
-		perror("send_request: write hash");
-		return -1;
+	for (int k = 0; k < n; k++) {
+		// a server that cannot be reached does not hold back the others
+		int sock_fd = client_sock(d->hosts[which[k]], d->port);
+		if (sock_fd < 0 || send_request(sock_fd, req) < 0) {
+			fprintf(stderr, "send_file: send_request to %s\n",
+					d->hosts[which[k]]);
+			if (sock_fd >= 0) {
+				close(sock_fd);
+			}
+			ret = -1;
+			continue;
+		}
+		fds[nfds++] = sock_fd;
+	}
+
+	// regular files are followed by their extents, even when empty
+	if (S_ISREG(req->mode) && nfds > 0) {
+		struct fanout fo;
+		if (fanout_init(&fo, fds, nfds) < 0) {
+			ret = -1;
+		} else {
+			fo.record = spool_fd;
+			if (send_data(&fo, src_path, req->size) < 0) {
+				fprintf(stderr, "send_file: send_data %s\n", src_path);
+				ret = -1;
+			}
+			if (fanout_finish(&fo) < 0) {
+				ret = -1;
+			}
+		}
+	}
+
+	// send data or not, read another response from each server
+	for (int k = 0; k < nfds; k++) {
+		int response = ERROR;
+		if (read(fds[k], &response, sizeof(int)) < 0) {
+			perror("send_file: read");
+		}
+		response = ntohl(response);
+		close(fds[k]);
+
+		if (response == ERROR) {
+			fprintf(stderr, "send_file for %s: server read data\n", src_path);
+			ret = -1;
+		} else if (response != OK) {
+			fprintf(stderr, "send_file for %s: server incorrect response\n",
+					src_path);
+			ret = -1;
+		}
 	}
 
-	int size = htons(request->size);
-	if (write(sock_fd, &size, sizeof(int)) < 0) {
-		perror("send_request: write size");
+	// only what the reference server took goes into the batch
+	if (spool_fd >= 0) {
+		if (ret == 0) {
+			ret = batch_append(spool_fd);
+		} else {
+			close(spool_fd);
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * Helper function that sends one extent frame header to the servers.
+ * @param  fo      the fan-out stream to the servers.
+ * @param  type    EXTENT_DATA, EXTENT_HOLE or EXTENT_END.
+ * @param  offset  the offset of the extent in the file.
+ * @param  length  the length of the extent.
+ * @return         0 on success, -1 on failure.
+ */
+static int send_extent(struct fanout *fo, int type, off_t offset,
+					   off_t length) {
+	char hdr[EXTENT_HDRSIZE];
+	int net_type = htonl(type);
+	int64_t net_offset = htobe64(offset);
+	int64_t net_length = htobe64(length);
+
+	memcpy(hdr, &net_type, sizeof(int));
+	memcpy(hdr + sizeof(int), &net_offset, sizeof(int64_t));
+	memcpy(hdr + sizeof(int) + sizeof(int64_t), &net_length, sizeof(int64_t));
+	if (fanout_write(fo, hdr, EXTENT_HDRSIZE) < 0) {
+		fprintf(stderr, "send_extent: fanout_write\n");
 		return -1;
 	}
 
 	return 0;
 }
 
-
-static int send_data(int sock_fd, char *src_path) {
-	FILE *f;
-	if (!(f = fopen(src_path, "rb"))) {
-		perror("send_data: fopen");
+/**
+ * Helper function that sends the content of a regular file as extent frames.
+ * Only the data extents are read and sent; holes are sent as EXTENT_HOLE
+ * frames so the server can recreate them without transferring zeros. The
+ * data is hashed as it is read, and the hash follows the EXTENT_END frame
+ * so the server can check what it wrote.
+ * @param  fo       the fan-out stream to the servers.
+ * @param  src_path the path of the file to send.
+ * @param  size     the size of the file when its request was generated.
+ * @return          0 on success, -1 on failure.
+ */
+static int send_data(struct fanout *fo, char *src_path, off_t size) {
+	int fd;
+	if ((fd = open(src_path, O_RDONLY)) < 0) {
+		perror("send_data: open");
+		return -1;
+	}
+	// read ahead further than usual past what prefetch() asked for
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	struct stat before, after;
+	if (fstat(fd, &before) < 0) {
+		perror("send_data: fstat");
+		close(fd);
 		return -1;
 	}
 
 	char buf[MAXDATA];
-	int num_read;
-	while ((num_read = fread(buf, 1, MAXDATA, f)) > 0) {
-		if (write(sock_fd, buf, num_read) < 0) {
-			perror("send_data: write");
-			if (fclose(f) != 0) {
-				perror("send_data: fclose");
+	char hash_val[BLOCKSIZE] = {0};
+	off_t pos = 0, data, hole;
+	while (pos < size) {
+		// find the next data extent; without SEEK_DATA support the file is
+		// sent as a single dense extent
+		if ((data = lseek(fd, pos, SEEK_DATA)) < 0) {
+			if (errno == ENXIO) {
+				data = size;
+			} else if (errno == EINVAL) {
+				data = pos;
+			} else {
+				perror("send_data: lseek");
+				close(fd);
 				return -1;
 			}
+		}
+		if (data > size) {
+			data = size;
+		}
+		if (data > pos) {
+			if (send_extent(fo, EXTENT_HOLE, pos, data - pos) < 0) {
+				close(fd);
+				return -1;
+			}
+			pos = data;
+		}
+		if (pos == size) {
+			break;
+		}
+
+		if ((hole = lseek(fd, pos, SEEK_HOLE)) < 0 || hole > size) {
+			hole = size;
+		}
+		if (send_extent(fo, EXTENT_DATA, pos, hole - pos) < 0) {
+			close(fd);
 			return -1;
 		}
+		while (pos < hole) {
+			size_t want = hole - pos < MAXDATA ? hole - pos : MAXDATA;
+			ssize_t num_read = pread(fd, buf, want, pos);
+			if (num_read <= 0) {
+				fprintf(stderr, "send_data: %s shrank during transfer\n",
+						src_path);
+				close(fd);
+				return -1;
+			}
+			if (fanout_write(fo, buf, num_read) < 0) {
+				fprintf(stderr, "send_data: fanout_write\n");
+				close(fd);
+				return -1;
+			}
+			hash_update(hash_val, buf, num_read, pos);
+			pos += num_read;
+		}
+	}
+
+	// the digest is only worth keeping if the file did not change under us
+	if (fstat(fd, &after) == 0 && after.st_size == size &&
+		after.st_mtim.tv_sec == before.st_mtim.tv_sec &&
+		after.st_mtim.tv_nsec == before.st_mtim.tv_nsec &&
+		after.st_ctim.tv_sec == before.st_ctim.tv_sec &&
+		after.st_ctim.tv_nsec == before.st_ctim.tv_nsec) {
+		report_digest(&after, hash_val);
+	}
+	if (close(fd) < 0) {
+		perror("send_data: close");
+		return -1;
+	}
+
+	if (send_extent(fo, EXTENT_END, size, 0) < 0) {
+		return -1;
+	}
+	if (fanout_write(fo, hash_val, BLOCKSIZE) < 0) {
+		fprintf(stderr, "send_data: fanout_write\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Helper function that asks the disk for the start of a file and queues its
+ * transfer, starting the oldest queued transfers once more than
+ * prefetch_depth files or PREFETCH_MAXBYTES bytes are waiting.
+ * @param  d the servers to sync to.
+ * @param  t the transfer, copied into the queue.
+ * @return   0 on success; -1 on failure.
+ */
+static int queue_transfer(struct dests *d, struct transfer *t) {
+	if (!pending &&
+		!(pending = calloc(prefetch_depth, sizeof(struct transfer)))) {
+		perror("queue_transfer: calloc");
+		return -1;
 	}
 
-	if (!feof(f)) {
-		fprintf(stderr, "send_data: fread\n");
-		if (fclose(f) != 0) {
-			perror("send_data: fclose");
+	while (npending == prefetch_depth ||
+		   (npending > 0 && pending_bytes >= PREFETCH_MAXBYTES)) {
+		if (start_oldest(d) < 0) {
 			return -1;
 		}
-		return -1;
 	}
 
-	if (fclose(f) != 0) {
-		perror("send_data: fclose");
+	t->prefetched = prefetch(t->src_path, t->req.size);
+	pending_bytes += t->prefetched;
+	pending[(pending_head + npending) % prefetch_depth] = *t;
+	npending++;
+	return 0;
+}
+
+/**
+ * Helper function that takes the oldest transfer off the read-ahead queue
+ * and starts it.
+ * @param  d the servers to sync to.
+ * @return   0 on success; -1 on failure.
+ */
+static int start_oldest(struct dests *d) {
+	struct transfer *t = &pending[pending_head];
+	pending_head = (pending_head + 1) % prefetch_depth;
+	npending--;
+	pending_bytes -= t->prefetched;
+	return start_transfer(d, t);
+}
+
+/**
+ * Helper function that forks the child sending one file or directory.
+ * @param  d the servers to sync to.
+ * @param  t the transfer.
+ * @return   0 on success; -1 on failure.
+ */
+static int start_transfer(struct dests *d, struct transfer *t) {
+	// the directory a transfer goes to must be made first; without the
+	// time spent hashing, the transfer would often get there first
+	if (wait_dirs() < 0) {
+		return -1;
+	}
+	// the children report the digests of what they send; a full pipe only
+	// loses reports, so neither side ever waits on it
+	if (report_fds[0] < 0) {
+		if (pipe2(report_fds, O_CLOEXEC | O_NONBLOCK) < 0) {
+			perror("start_transfer: pipe2");
+			return -1;
+		}
+		fcntl(report_fds[1], F_SETPIPE_SZ, REPORT_PIPESIZE);
+	}
+	collect_digests();
+	// fork a new process and send file
+	fflush(stdout);
+	int result = fork();
+	CHILD_COUNT ++;
+	if (result < 0) {
+		perror("start_transfer: fork");
 		return -1;
+	} else if (result == 0) { // child
+		exit(send_file(d, t->sendto, t->nsend, t->src_path, &t->req) < 0
+				 ? -1
+				 : 0);
+	}
+	if (t->link) {
+		t->link->pid = result;
+	} else if (S_ISDIR(t->req.mode)) {
+		if (ndir_children == dir_children_cap) {
+			int cap = dir_children_cap ? dir_children_cap * 2 : 16;
+			pid_t *grown = realloc(dir_children, cap * sizeof(pid_t));
+			if (!grown) {
+				perror("start_transfer: realloc");
+				return -1;
+			}
+			dir_children = grown;
+			dir_children_cap = cap;
+		}
+		dir_children[ndir_children++] = result;
+	}
+	return 0;
+}
+
+/**
+ * Helper function that has the kernel read the start of a file into the
+ * page cache in the background, so its transfer does not wait for the disk.
+ * @param  src_path the file.
+ * @param  size     the size of the file.
+ * @return          the number of bytes asked for.
+ */
+static off_t prefetch(char *src_path, off_t size) {
+	int fd;
+	off_t len = size < PREFETCH_FILEMAX ? size : PREFETCH_FILEMAX;
+	if (len == 0 || (fd = open(src_path, O_RDONLY | O_CLOEXEC)) < 0) {
+		return 0;
+	}
+	// only advice; a failure just leaves the file to be read cold
+	if (posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED) != 0) {
+		len = 0;
+	}
+	close(fd);
+	return len;
+}
+
+
+/**
+ * Helper function that finds the first link of a file with several hard
+ * links, making src_path the first link if the file has not been seen or
+ * its first link has since been removed or replaced.
+ * @param  st          the lstat of src_path.
+ * @param  src_path    the path of the link.
+ * @param  server_path the server path of the link.
+ * @return             the entry of the file, or NULL if out of memory.
+ */
+static struct link_entry *find_link(struct stat *st, char *src_path,
+									char *server_path) {
+	struct link_entry **bucket =
+		&links[(st->st_ino ^ st->st_dev) % LINK_BUCKETS];
+	struct link_entry *e;
+	for (e = *bucket; e; e = e->next) {
+		if (e->dev == st->st_dev && e->ino == st->st_ino) {
+			break;
+		}
+	}
+
+	if (e) {
+		struct stat first_stat;
+		if (lstat(e->src_path, &first_stat) == 0 &&
+			first_stat.st_dev == st->st_dev && first_stat.st_ino == st->st_ino) {
+			return e;
+		}
+	} else {
+		if (!(e = calloc(1, sizeof(struct link_entry)))) {
+			perror("find_link: calloc");
+			return NULL;
+		}
+		e->dev = st->st_dev;
+		e->ino = st->st_ino;
+		e->next = *bucket;
+		*bucket = e;
 	}
 
+	strncpy(e->src_path, src_path, MAXPATH - 1);
+	strncpy(e->server_path, server_path, MAXPATH - 1);
+	e->pid = 0;
+	return e;
+}
+
+
+/**
+ * Helper function that waits for one transfer child.
+ * @param  pid the child.
+ * @return     0 if the child succeeded or was already reaped; -1 otherwise.
+ */
+static int wait_child(pid_t pid) {
+	int status;
+	if (waitpid(pid, &status, 0) < 0) {
+		if (errno == ECHILD) { // reaped by main_client_reap
+			return 0;
+		}
+		perror("wait_child: waitpid");
+		return -1;
+	}
+	CHILD_COUNT --;
+	collect_digests();
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "wait_child: child %d failed\n", pid);
+		return -1;
+	}
 	return 0;
 }
+
+
+/**
+ * Helper function that waits for the children creating directories.
+ * @return 0 if they all succeeded; -1 otherwise.
+ */
+static int wait_dirs() {
+	int ret = 0;
+	for (int i = 0; i < ndir_children; i++) {
+		if (wait_child(dir_children[i]) < 0) {
+			ret = -1;
+		}
+	}
+	ndir_children = 0;
+	return ret;
+}
+
+
+/**
+ * Helper function run by a transfer child that reports the digest of a file
+ * it sent to the main client. A report that does not fit in the pipe is
+ * dropped, which only costs the next run a read of the file.
+ * @param  st       the stat of the file, unchanged while it was sent.
+ * @param  hash_val the digest of the file.
+ */
+static void report_digest(const struct stat *st, const char *hash_val) {
+	if (report_fds[1] < 0) {
+		return;
+	}
+	struct digest_report r;
+	memset(&r, 0, sizeof(r));
+	r.dev = st->st_dev;
+	r.ino = st->st_ino;
+	r.size = st->st_size;
+	r.mtime = st->st_mtim;
+	r.ctime = st->st_ctim;
+	memcpy(r.hash, hash_val, BLOCKSIZE);
+	// smaller than PIPE_BUF, so a report is written whole or not at all
+	if (write(report_fds[1], &r, sizeof(r)) < 0 && errno != EAGAIN) {
+		perror("report_digest: write");
+	}
+}
+
+
+/**
+ * Helper function that puts the digests the transfer children reported so
+ * far into the digest cache.
+ */
+static void collect_digests() {
+	struct digest_report r;
+	while (report_fds[0] >= 0 &&
+		   read(report_fds[0], &r, sizeof(r)) == sizeof(r)) {
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		st.st_mode = S_IFREG;
+		st.st_dev = r.dev;
+		st.st_ino = r.ino;
+		st.st_size = r.size;
+		st.st_mtim = r.mtime;
+		st.st_ctim = r.ctime;
+		digest_store(&st, r.hash);
+	}
+}
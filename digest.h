@@ -0,0 +1,140 @@
+#ifndef _DIGEST_H_
+#define _DIGEST_H_
+
+#include <sys/stat.h>
+
+#include "hash.h"       // BLOCKSIZE
+
+#define DIGEST_BUCKETS (1 << 16)	// buckets of the in-memory digest cache
+#define DIGEST_MAGIC "rcopydc1"		// first bytes of a saved digest cache
+#define DIGEST_RECSIZE 64			// bytes per file in a saved digest cache
+
+/**
+ * A cached digest of a file or directory
+ * dev, ino			the identity of the file
+ * size				the size of a file when it was hashed
+ * mtime, ctime		the timestamps of a file when it was hashed
+ * gen				the digest generation of a directory digest, 0 for files
+ * used				1 if the file was seen in this run
+ * hash				the digest
+ * next				the next entry in the same bucket
+ */
+struct digest_entry {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    unsigned long gen;
+    int used;
+    char hash[BLOCKSIZE];
+    struct digest_entry *next;
+};
+
+/**
+ * Get the digest of the regular file name in dir_fd, reusing the cached
+ * digest while the file's (dev, inode, size, mtime, ctime) is unchanged
+ * @param  dir_fd   the directory of the file, or AT_FDCWD
+ * @param  name     the name or path of the file relative to dir_fd
+ * @param  st       the lstat of the file
+ * @param  hash_val filled with the digest
+ * @return          0 on success, -1 on failure
+ */
+int digest_file(int dir_fd, const char *name, const struct stat *st,
+				char *hash_val);
+
+/**
+ * Hash the regular file name in dir_fd whatever the cache holds for it, and
+ * cache the result, for a caller that must not trust a stat tuple to show a
+ * change
+ * @param  dir_fd   the directory of the file, or AT_FDCWD
+ * @param  name     the name or path of the file relative to dir_fd
+ * @param  st       the lstat of the file
+ * @param  hash_val filled with the digest
+ * @return          0 on success, -1 on failure
+ */
+int digest_reread(int dir_fd, const char *name, const struct stat *st,
+				  char *hash_val);
+
+/**
+ * Get the digest of a regular file or directory from the cache only, without
+ * reading anything
+ * @param  st       the lstat of the file or directory
+ * @param  hash_val filled with the digest
+ * @return          0 if the cached digest is still valid, -1 otherwise
+ */
+int digest_cached(const struct stat *st, char *hash_val);
+
+/**
+ * Remember the digest of a regular file computed elsewhere, e.g. over the
+ * bytes of a transfer as they were written
+ * @param  st       the stat of the file holding exactly those bytes
+ * @param  hash_val the digest
+ */
+void digest_store(const struct stat *st, const char *hash_val);
+
+/**
+ * Get the Merkle digest of the directory name in dir_fd. It is computed
+ * bottom-up over the (name, type, mode, size, digest) of its children in name
+ * order, skipping names that start with '.' and paths the filters exclude,
+ * so two trees have the same digest exactly when they hold the same files.
+ * Directory digests are memoized until digest_invalidate() or
+ * digest_forget(); file digests stay valid while their stat tuple does.
+ * The server passes no rel, so a server directory holding paths the client
+ * excludes never has the digest of the client's filtered directory.
+ * @param  dir_fd   the parent of the directory, or AT_FDCWD
+ * @param  name     the name or path of the directory relative to dir_fd
+ * @param  st       the lstat of the directory
+ * @param  hash_val filled with the digest
+ * @param  rel      the directory below the source root, or NULL to take
+ *                  every child without asking the filters
+ * @return          0 on success, -1 on failure
+ */
+int digest_dir(int dir_fd, const char *name, const struct stat *st,
+			   char *hash_val, const char *rel);
+
+/**
+ * Get the Merkle digest of a directory like digest_dir(), but only from file
+ * digests that are already cached, so that no file data is read
+ * @param  dir_fd   the parent of the directory, or AT_FDCWD
+ * @param  name     the name or path of the directory relative to dir_fd
+ * @param  st       the lstat of the directory
+ * @param  hash_val filled with the digest
+ * @param  rel      the directory below the source root, or NULL to take
+ *                  every child without asking the filters
+ * @return          0 on success, -1 if a file below it is not cached or on
+ *                  failure
+ */
+int digest_dir_cached(int dir_fd, const char *name, const struct stat *st,
+					  char *hash_val, const char *rel);
+
+/**
+ * Forget every directory digest. Must be called whenever the tree may have
+ * changed in places nobody can name, since a directory's own timestamps do
+ * not change with its grandchildren.
+ */
+void digest_invalidate();
+
+/**
+ * Forget the digest of one directory, after a write below it
+ * @param st the stat of the directory
+ */
+void digest_forget(const struct stat *st);
+
+/**
+ * Fill the cache with the file digests saved by an earlier run. A missing or
+ * unreadable cache file only means every file is hashed again.
+ * @param  path the cache file
+ * @return      the number of digests loaded
+ */
+int digest_load(const char *path);
+
+/**
+ * Save the digests of the files seen in this run, replacing the cache file
+ * atomically
+ * @param  path the cache file
+ * @return      0 on success, -1 on failure
+ */
+int digest_save(const char *path);
+
+#endif // _DIGEST_H_
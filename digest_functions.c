@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "digest.h"
+#include "filter.h"
+#include "ftree.h"
+
+// 64-bit FNV-1a, which mixes the entries of a directory far better than the
+// positional XOR of hash() would
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static struct digest_entry *buckets[DIGEST_BUCKETS];
+static unsigned long generation = 1; // of the directory digests still valid
+static int dirty = 0; // 1 if there are digests digest_save() has not written
+
+static struct digest_entry *lookup(const struct stat *st);
+static struct digest_entry *store(const struct stat *st);
+static uint64_t fnv(uint64_t h, const void *data, size_t len);
+static int join_rel(char *dst, const char *rel, const char *name);
+static int dir_digest(int dir_fd, const char *name, const struct stat *st,
+					  char *hash_val, const char *rel, int cached_only);
+static int compare_names(const void *a, const void *b);
+
+
+/**
+ * Get the digest of the regular file name in dir_fd, reusing the cached
+ * digest while the file's (dev, inode, size, mtime, ctime) is unchanged
+ * @param  dir_fd   the directory of the file, or AT_FDCWD
+ * @param  name     the name or path of the file relative to dir_fd
+ * @param  st       the lstat of the file
+ * @param  hash_val filled with the digest
+ * @return          0 on success, -1 on failure
+ */
+int digest_file(int dir_fd, const char *name, const struct stat *st,
+				char *hash_val) {
+	if (digest_cached(st, hash_val) == 0) {
+		return 0;
+	}
+	return digest_reread(dir_fd, name, st, hash_val);
+}
+
+
+/**
+ * Hash the regular file name in dir_fd whatever the cache holds for it, and
+ * cache the result, for a caller that must not trust a stat tuple to show a
+ * change
+ * @param  dir_fd   the directory of the file, or AT_FDCWD
+ * @param  name     the name or path of the file relative to dir_fd
+ * @param  st       the lstat of the file
+ * @param  hash_val filled with the digest
+ * @return          0 on success, -1 on failure
+ */
+int digest_reread(int dir_fd, const char *name, const struct stat *st,
+				  char *hash_val) {
+	int fd;
+	FILE *f;
+	if ((fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		perror("digest_reread: openat");
+		return -1;
+	}
+	if (!(f = fdopen(fd, "rb"))) {
+		perror("digest_reread: fdopen");
+		close(fd);
+		return -1;
+	}
+	hash(hash_val, f);
+	if (fclose(f) != 0) {
+		perror("digest_reread: fclose");
+		return -1;
+	}
+
+	digest_store(st, hash_val);
+	return 0;
+}
+
+
+/**
+ * Get the digest of a regular file or directory from the cache only, without
+ * reading anything
+ * @param  st       the lstat of the file or directory
+ * @param  hash_val filled with the digest
+ * @return          0 if the cached digest is still valid, -1 otherwise
+ */
+int digest_cached(const struct stat *st, char *hash_val) {
+	struct digest_entry *e = lookup(st);
+	if (S_ISDIR(st->st_mode)) {
+		if (e && e->gen == generation) {
+			memcpy(hash_val, e->hash, BLOCKSIZE);
+			return 0;
+		}
+		return -1;
+	}
+	if (e && e->gen == 0 && e->size == st->st_size &&
+		e->mtime.tv_sec == st->st_mtim.tv_sec &&
+		e->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+		e->ctime.tv_sec == st->st_ctim.tv_sec &&
+		e->ctime.tv_nsec == st->st_ctim.tv_nsec) {
+		memcpy(hash_val, e->hash, BLOCKSIZE);
+		e->used = 1;
+		return 0;
+	}
+	return -1;
+}
+
+
+/**
+ * Remember the digest of a regular file computed elsewhere, e.g. over the
+ * bytes of a transfer as they were written
+ * @param  st       the stat of the file holding exactly those bytes
+ * @param  hash_val the digest
+ */
+void digest_store(const struct stat *st, const char *hash_val) {
+	struct digest_entry *e;
+	if ((e = store(st))) {
+		e->size = st->st_size;
+		e->mtime = st->st_mtim;
+		e->ctime = st->st_ctim;
+		e->gen = 0;
+		e->used = 1;
+		memcpy(e->hash, hash_val, BLOCKSIZE);
+		dirty = 1;
+	}
+}
+
+
+/**
+ * Get the Merkle digest of the directory name in dir_fd. It is computed
+ * bottom-up over the (name, type, mode, size, digest) of its children in name
+ * order, skipping names that start with '.' and paths the filters exclude,
+ * so two trees have the same digest exactly when they hold the same files.
+ * @param  dir_fd   the parent of the directory, or AT_FDCWD
+ * @param  name     the name or path of the directory relative to dir_fd
+ * @param  st       the lstat of the directory
+ * @param  hash_val filled with the digest
+ * @param  rel      the directory below the source root, or NULL to take
+ *                  every child without asking the filters
+ * @return          0 on success, -1 on failure
+ */
+int digest_dir(int dir_fd, const char *name, const struct stat *st,
+			   char *hash_val, const char *rel) {
+	return dir_digest(dir_fd, name, st, hash_val, rel, 0);
+}
+
+
+/**
+ * Get the Merkle digest of a directory like digest_dir(), but only from file
+ * digests that are already cached, so that no file data is read
+ * @param  dir_fd   the parent of the directory, or AT_FDCWD
+ * @param  name     the name or path of the directory relative to dir_fd
+ * @param  st       the lstat of the directory
+ * @param  hash_val filled with the digest
+ * @param  rel      the directory below the source root, or NULL to take
+ *                  every child without asking the filters
+ * @return          0 on success, -1 if a file below it is not cached or on
+ *                  failure
+ */
+int digest_dir_cached(int dir_fd, const char *name, const struct stat *st,
+					  char *hash_val, const char *rel) {
+	return dir_digest(dir_fd, name, st, hash_val, rel, 1);
+}
+
+
+/**
+ * Helper function of digest_dir() and digest_dir_cached() that computes the
+ * digest of a directory, giving up at the first file that is not cached if
+ * cached_only is set.
+ * @return 0 on success, -1 on failure
+ */
+static int dir_digest(int dir_fd, const char *name, const struct stat *st,
+					  char *hash_val, const char *rel, int cached_only) {
+	if (digest_cached(st, hash_val) == 0) {
+		return 0;
+	}
+
+	int fd;
+	DIR *dirp;
+	if ((fd = openat(dir_fd, name,
+					 O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		perror("digest_dir: openat");
+		return -1;
+	}
+	if (!(dirp = fdopendir(fd))) {
+		perror("digest_dir: fdopendir");
+		close(fd);
+		return -1;
+	}
+
+	// both sides must visit the children in the same order
+	char **names = NULL;
+	int nnames = 0, cap = 0;
+	struct dirent *dirent;
+	char child_rel[MAXPATH];
+	while ((dirent = readdir(dirp))) {
+		// ignore . files
+		if (strncmp(dirent->d_name, ".", 1) == 0) {
+			continue;
+		}
+		// and what the client does not send, before it is stat'ed
+		if (rel && (join_rel(child_rel, rel, dirent->d_name) < 0 ||
+					filter_excluded(child_rel, dirent->d_type))) {
+			continue;
+		}
+		if (nnames == cap) {
+			cap = cap ? cap * 2 : 16;
+			char **grown = realloc(names, cap * sizeof(char *));
+			if (!grown) {
+				perror("digest_dir: realloc");
+				break;
+			}
+			names = grown;
+		}
+		if (!(names[nnames] = strdup(dirent->d_name))) {
+			perror("digest_dir: strdup");
+			break;
+		}
+		nnames++;
+	}
+	qsort(names, nnames, sizeof(char *), compare_names);
+
+	int ret = dirent ? -1 : 0;
+	uint64_t h = FNV_OFFSET;
+	for (int i = 0; i < nnames && ret == 0; i++) {
+		struct stat child;
+		char child_hash[BLOCKSIZE];
+		int32_t type;
+
+		if (fstatat(fd, names[i], &child, AT_SYMLINK_NOFOLLOW) < 0) {
+			perror("digest_dir: fstatat");
+			ret = -1;
+		} else if (S_ISREG(child.st_mode)) {
+			type = REGFILE;
+			ret = cached_only ? digest_cached(&child, child_hash)
+							  : digest_file(fd, names[i], &child, child_hash);
+		} else if (S_ISDIR(child.st_mode)) {
+			type = REGDIR;
+			child.st_size = 0; // directory sizes differ between file systems
+			if (rel) {
+				join_rel(child_rel, rel, names[i]);
+			}
+			ret = dir_digest(fd, names[i], &child, child_hash,
+							 rel ? child_rel : NULL, cached_only);
+		} else { // never synced
+			continue;
+		}
+		if (ret < 0) {
+			break;
+		}
+
+		int32_t net_type = htobe32(type);
+		int32_t net_mode = htobe32(child.st_mode & 07777);
+		int64_t net_size = htobe64(child.st_size);
+		h = fnv(h, names[i], strlen(names[i]) + 1);
+		h = fnv(h, &net_type, sizeof(net_type));
+		h = fnv(h, &net_mode, sizeof(net_mode));
+		h = fnv(h, &net_size, sizeof(net_size));
+		h = fnv(h, child_hash, BLOCKSIZE);
+	}
+
+	for (int i = 0; i < nnames; i++) {
+		free(names[i]);
+	}
+	free(names);
+	closedir(dirp);
+	if (ret < 0) {
+		return -1;
+	}
+
+	uint64_t net_h = htobe64(h);
+	memcpy(hash_val, &net_h, BLOCKSIZE);
+	struct digest_entry *e;
+	if ((e = store(st))) {
+		e->gen = generation;
+		memcpy(e->hash, hash_val, BLOCKSIZE);
+	}
+	return 0;
+}
+
+
+/**
+ * Forget every directory digest. Must be called whenever the tree may have
+ * changed in places nobody can name, since a directory's own timestamps do
+ * not change with its grandchildren.
+ */
+void digest_invalidate() {
+	generation++;
+}
+
+
+/**
+ * Forget the digest of one directory, after a write below it
+ * @param st the stat of the directory
+ */
+void digest_forget(const struct stat *st) {
+	struct digest_entry *e = lookup(st);
+	if (e) {
+		e->gen = 0; // never the generation of a valid directory digest
+	}
+}
+
+
+/**
+ * Fill the cache with the file digests saved by an earlier run. A missing or
+ * unreadable cache file only means every file is hashed again.
+ * @param  path the cache file
+ * @return      the number of digests loaded
+ */
+int digest_load(const char *path) {
+	FILE *f;
+	if (!(f = fopen(path, "rb"))) {
+		if (errno != ENOENT) {
+			perror("digest_load: fopen");
+		}
+		return 0;
+	}
+
+	char magic[sizeof(DIGEST_MAGIC) - 1];
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+		memcmp(magic, DIGEST_MAGIC, sizeof(magic)) != 0) {
+		fprintf(stderr, "digest_load: %s is not a digest cache\n", path);
+		fclose(f);
+		return 0;
+	}
+
+	// dev, ino, size, mtime and ctime as big-endian 64-bit words, then hash
+	uint64_t rec[DIGEST_RECSIZE / sizeof(uint64_t)];
+	int n = 0;
+	while (fread(rec, DIGEST_RECSIZE, 1, f) == 1) {
+		struct stat st;
+		st.st_dev = be64toh(rec[0]);
+		st.st_ino = be64toh(rec[1]);
+		struct digest_entry *e = store(&st);
+		if (!e) {
+			break;
+		}
+		e->size = be64toh(rec[2]);
+		e->mtime.tv_sec = be64toh(rec[3]);
+		e->mtime.tv_nsec = be64toh(rec[4]);
+		e->ctime.tv_sec = be64toh(rec[5]);
+		e->ctime.tv_nsec = be64toh(rec[6]);
+		e->gen = 0;
+		memcpy(e->hash, &rec[7], BLOCKSIZE);
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+
+/**
+ * Save the digests of the files seen in this run, replacing the cache file
+ * atomically
+ * @param  path the cache file
+ * @return      0 on success, -1 on failure
+ */
+int digest_save(const char *path) {
+	if (!dirty) {
+		return 0;
+	}
+
+	char tmp[4096];
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+		fprintf(stderr, "digest_save: %s: Path too long\n", path);
+		return -1;
+	}
+	FILE *f;
+	if (!(f = fopen(tmp, "wb"))) {
+		perror("digest_save: fopen");
+		return -1;
+	}
+
+	// a file changed within the timestamp granularity right after it was
+	// hashed would keep its stat tuple, so leave the newest ones out
+	time_t racy = time(NULL) - 1;
+	int ret = 0, skipped = 0;
+	if (fwrite(DIGEST_MAGIC, 1, sizeof(DIGEST_MAGIC) - 1, f) !=
+		sizeof(DIGEST_MAGIC) - 1) {
+		ret = -1;
+	}
+	for (int i = 0; i < DIGEST_BUCKETS && ret == 0; i++) {
+		for (struct digest_entry *e = buckets[i]; e && ret == 0; e = e->next) {
+			if (e->gen != 0 || !e->used) {
+				continue;
+			} else if (e->mtime.tv_sec >= racy || e->ctime.tv_sec >= racy) {
+				skipped++;
+				continue;
+			}
+			uint64_t rec[DIGEST_RECSIZE / sizeof(uint64_t)];
+			rec[0] = htobe64(e->dev);
+			rec[1] = htobe64(e->ino);
+			rec[2] = htobe64(e->size);
+			rec[3] = htobe64(e->mtime.tv_sec);
+			rec[4] = htobe64(e->mtime.tv_nsec);
+			rec[5] = htobe64(e->ctime.tv_sec);
+			rec[6] = htobe64(e->ctime.tv_nsec);
+			memcpy(&rec[7], e->hash, BLOCKSIZE);
+			if (fwrite(rec, DIGEST_RECSIZE, 1, f) != 1) {
+				ret = -1;
+			}
+		}
+	}
+	if (ret < 0) {
+		perror("digest_save: fwrite");
+	}
+	if (fclose(f) != 0 && ret == 0) {
+		perror("digest_save: fclose");
+		ret = -1;
+	}
+	if (ret == 0 && rename(tmp, path) < 0) {
+		perror("digest_save: rename");
+		ret = -1;
+	}
+	if (ret < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	dirty = skipped > 0;
+	return 0;
+}
+
+
+/**
+ * Helper function that finds the cache entry of a file.
+ * @return the entry, or NULL if the file has never been hashed
+ */
+static struct digest_entry *lookup(const struct stat *st) {
+	struct digest_entry *e =
+		buckets[(st->st_ino ^ st->st_dev) % DIGEST_BUCKETS];
+	for (; e; e = e->next) {
+		if (e->ino == st->st_ino && e->dev == st->st_dev) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Helper function that returns the cache entry of a file to be filled in,
+ * creating it if needed.
+ * @return the entry, or NULL if out of memory
+ */
+static struct digest_entry *store(const struct stat *st) {
+	struct digest_entry *e = lookup(st);
+	if (e) {
+		return e;
+	}
+
+	if (!(e = calloc(1, sizeof(struct digest_entry)))) {
+		perror("digest: calloc");
+		return NULL;
+	}
+	struct digest_entry **bucket =
+		&buckets[(st->st_ino ^ st->st_dev) % DIGEST_BUCKETS];
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->next = *bucket;
+	*bucket = e;
+	return e;
+}
+
+
+/**
+ * Helper function that folds len bytes into a 64-bit FNV-1a hash.
+ */
+static uint64_t fnv(uint64_t h, const void *data, size_t len) {
+	const unsigned char *p = data;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ p[i]) * FNV_PRIME;
+	}
+	return h;
+}
+
+
+/**
+ * Helper function that appends a name to a path below the source root.
+ * @return 0 on success, -1 if the path is too long
+ */
+static int join_rel(char *dst, const char *rel, const char *name) {
+	return snprintf(dst, MAXPATH, "%s%s%s", rel, rel[0] ? "/" : "", name) <
+				   MAXPATH
+			   ? 0
+			   : -1;
+}
+
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
@@ -0,0 +1,50 @@
+#ifndef _DIRCACHE_H_
+#define _DIRCACHE_H_
+
+#include <sys/types.h>  // dev_t ino_t
+
+#include "ftree.h"      // MAXPATH
+
+#define DIRCACHE_SIZE 64	// directory fds kept open by the server
+
+/**
+ * An open directory in the cache
+ * path				the directory path relative to the server root
+ * fd				the open directory file descriptor, -1 if unused
+ * dev				the device of the directory, to check path still leads to it
+ * ino				the inode of the directory
+ * used				the tick of the last lookup, for LRU eviction
+ */
+struct dircache_entry {
+    char path[MAXPATH];
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    unsigned long used;
+};
+
+/**
+ * Open the server root that all request paths are resolved against, replacing
+ * the root of an earlier call
+ * @param  root the root directory, normally "." (sandbox/dest)
+ * @return      0 on success, -1 on failure
+ */
+int dircache_init(const char *root);
+
+/**
+ * Resolve the parent directory of a request path. Every component is opened
+ * with O_NOFOLLOW relative to its cached parent, and absolute paths, empty
+ * components, "." and ".." are rejected, so the result never escapes the root.
+ * @param  path the request path relative to the root
+ * @param  name filled with the last component of path (MAXPATH bytes)
+ * @return      a directory fd valid until the next dircache call, or -1 with
+ *              errno set (EACCES if path tries to leave the root)
+ */
+int dircache_parent(const char *path, char *name);
+
+/**
+ * Close every cached directory except the root
+ */
+void dircache_flush();
+
+#endif // _DIRCACHE_H_
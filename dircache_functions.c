@@ -0,0 +1,261 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dircache.h"
+
+static struct dircache_entry cache[DIRCACHE_SIZE];
+static unsigned long tick = 0;
+static int root_fd = -1;
+
+static int valid_path(const char *path);
+static int lookup(const char *path);
+static int find(const char *path);
+static void drop(const char *path);
+static void insert(const char *path, int fd);
+
+
+/**
+ * Open the server root that all request paths are resolved against, replacing
+ * the root of an earlier call
+ * @param  root the root directory, normally "." (sandbox/dest)
+ * @return      0 on success, -1 on failure
+ */
+int dircache_init(const char *root) {
+	// a new root makes every cached directory meaningless
+	if (root_fd >= 0) {
+		dircache_flush();
+		close(root_fd);
+		root_fd = -1;
+	}
+	for (int i = 0; i < DIRCACHE_SIZE; i++) {
+		cache[i].fd = -1;
+	}
+
+	if ((root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		perror("dircache_init: open");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Resolve the parent directory of a request path. Every component is opened
+ * with O_NOFOLLOW relative to its cached parent, and absolute paths, empty
+ * components, "." and ".." are rejected, so the result never escapes the root.
+ * @param  path the request path relative to the root
+ * @param  name filled with the last component of path (MAXPATH bytes)
+ * @return      a directory fd valid until the next dircache call, or -1 with
+ *              errno set (EACCES if path tries to leave the root)
+ */
+int dircache_parent(const char *path, char *name) {
+	if (!valid_path(path)) {
+		fprintf(stderr, "dircache_parent: rejected path %s\n", path);
+		errno = EACCES;
+		return -1;
+	}
+
+	const char *slash = strrchr(path, '/');
+	if (!slash) { // directly under the root
+		strncpy(name, path, MAXPATH);
+		return root_fd;
+	}
+	strncpy(name, slash + 1, MAXPATH);
+
+	char parent[MAXPATH];
+	size_t len = slash - path;
+	memcpy(parent, path, len);
+	parent[len] = '\0';
+
+	int fd;
+	if ((fd = lookup(parent)) >= 0) {
+		return fd;
+	}
+
+	// find the deepest cached ancestor and open the rest from there
+	char prefix[MAXPATH];
+	size_t start = 0;
+	int dir_fd = root_fd;
+	strncpy(prefix, parent, MAXPATH);
+	for (char *p = strrchr(prefix, '/'); p; p = strrchr(prefix, '/')) {
+		*p = '\0';
+		if ((fd = lookup(prefix)) >= 0) {
+			dir_fd = fd;
+			start = p - prefix + 1;
+			break;
+		}
+	}
+
+	while (start < len) {
+		char *end = strchr(parent + start, '/');
+		size_t stop = end ? (size_t)(end - parent) : len;
+
+		char component[MAXPATH];
+		memcpy(component, parent + start, stop - start);
+		component[stop - start] = '\0';
+
+		if ((fd = openat(dir_fd, component,
+						 O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+			return -1;
+		}
+
+		memcpy(prefix, parent, stop);
+		prefix[stop] = '\0';
+		insert(prefix, fd);
+
+		dir_fd = fd;
+		start = stop + 1;
+	}
+
+	return dir_fd;
+}
+
+
+/**
+ * Close every cached directory except the root
+ */
+void dircache_flush() {
+	for (int i = 0; i < DIRCACHE_SIZE; i++) {
+		if (cache[i].fd >= 0) {
+			close(cache[i].fd);
+			cache[i].fd = -1;
+		}
+	}
+}
+
+
+/**
+ * Helper function that checks that every component of path is a plain name.
+ * @return 1 if path is valid, 0 otherwise
+ */
+static int valid_path(const char *path) {
+	if (strnlen(path, MAXPATH) == MAXPATH) {
+		return 0;
+	}
+
+	const char *component = path;
+	while (1) {
+		const char *end = strchr(component, '/');
+		size_t len = end ? (size_t)(end - component) : strlen(component);
+
+		if (len == 0 || (len == 1 && component[0] == '.') ||
+			(len == 2 && component[0] == '.' && component[1] == '.')) {
+			return 0;
+		}
+		if (!end) {
+			return 1;
+		}
+		component = end + 1;
+	}
+}
+
+
+/**
+ * Helper function that looks up a cached directory and marks it used. A
+ * directory that path no longer leads to, because another shard or someone
+ * by hand removed or renamed it, is dropped so the path is opened again. The
+ * check stats only the last component, relative to the cached parent, so a
+ * hit costs no walk from the root. Requests come down the tree, so a
+ * directory renamed higher up is caught at its own level, and everything
+ * cached below it is dropped with it.
+ * @return the directory fd, or -1 if path is not cached
+ */
+static int lookup(const char *path) {
+	int i = find(path);
+	if (i < 0) {
+		return -1;
+	}
+
+	// a parent that is not cached is rare: it was evicted first
+	struct stat dir_stat;
+	const char *slash = strrchr(path, '/');
+	int parent = -1, ret;
+	if (slash) {
+		char parent_path[MAXPATH];
+		memcpy(parent_path, path, slash - path);
+		parent_path[slash - path] = '\0';
+		parent = find(parent_path);
+	}
+	if (parent >= 0) {
+		ret = fstatat(cache[parent].fd, slash + 1, &dir_stat,
+					  AT_SYMLINK_NOFOLLOW);
+	} else {
+		ret = fstatat(root_fd, path, &dir_stat, AT_SYMLINK_NOFOLLOW);
+	}
+	if (ret < 0 || dir_stat.st_dev != cache[i].dev ||
+		dir_stat.st_ino != cache[i].ino) {
+		drop(path);
+		return -1;
+	}
+	cache[i].used = ++tick;
+	return cache[i].fd;
+}
+
+
+/**
+ * Helper function that closes a cached directory and every cached directory
+ * below it, which were reached through it.
+ */
+static void drop(const char *path) {
+	size_t len = strlen(path);
+	for (int i = 0; i < DIRCACHE_SIZE; i++) {
+		if (cache[i].fd >= 0 && strncmp(cache[i].path, path, len) == 0 &&
+			(cache[i].path[len] == '\0' || cache[i].path[len] == '/')) {
+			close(cache[i].fd);
+			cache[i].fd = -1;
+		}
+	}
+}
+
+
+/**
+ * Helper function that finds the entry of a cached directory.
+ * @return the index of the entry, or -1 if path is not cached
+ */
+static int find(const char *path) {
+	for (int i = 0; i < DIRCACHE_SIZE; i++) {
+		if (cache[i].fd >= 0 && strcmp(cache[i].path, path) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/**
+ * Helper function that caches an open directory, evicting the least recently
+ * used one when the cache is full. A directory that cannot be stat'ed gets
+ * no identity, so the next lookup closes it.
+ */
+static void insert(const char *path, int fd) {
+	struct stat dir_stat;
+	if (fstat(fd, &dir_stat) < 0) {
+		perror("insert: fstat");
+		dir_stat.st_dev = 0;
+		dir_stat.st_ino = 0;
+	}
+
+	int victim = 0;
+	for (int i = 0; i < DIRCACHE_SIZE; i++) {
+		if (cache[i].fd < 0) {
+			victim = i;
+			break;
+		}
+		if (cache[i].used < cache[victim].used) {
+			victim = i;
+		}
+	}
+
+	if (cache[victim].fd >= 0) {
+		close(cache[victim].fd);
+	}
+	strncpy(cache[victim].path, path, MAXPATH);
+	cache[victim].fd = fd;
+	cache[victim].dev = dir_stat.st_dev;
+	cache[victim].ino = dir_stat.st_ino;
+	cache[victim].used = ++tick;
+}
@@ -0,0 +1,65 @@
+#ifndef _FANOUT_H_
+#define _FANOUT_H_
+
+#include <stddef.h>
+
+#define MAXDEST 16					// servers one client can replicate to
+#define FANOUT_BUFSIZE (1 << 20)	// bytes queued for one slow server
+
+/**
+ * One destination of a fan-out stream
+ * fd				the socket of the destination
+ * buf				the bytes not yet accepted by the socket
+ * head				the offset of the first queued byte in buf
+ * len				the number of queued bytes
+ * failed			1 if the destination stopped accepting data
+ */
+struct fanout_dest {
+    int fd;
+    char *buf;
+    size_t head;
+    size_t len;
+    int failed;
+};
+
+/**
+ * A byte stream written once and delivered to several sockets. Each socket
+ * drains its own queue as fast as it can; the writer only blocks when a
+ * queue would grow past FANOUT_BUFSIZE.
+ * n				the number of destinations
+ * dest				the destinations
+ * record			a file that gets a copy of the stream, or -1
+ */
+struct fanout {
+    int n;
+    struct fanout_dest dest[MAXDEST];
+    int record;
+};
+
+/**
+ * Set up a fan-out stream to the sockets in fds
+ * @param  fo  the fan-out stream to initialize
+ * @param  fds the destination sockets
+ * @param  n   the number of sockets, at most MAXDEST
+ * @return     0 on success, -1 on failure
+ */
+int fanout_init(struct fanout *fo, int *fds, int n);
+
+/**
+ * Queue len bytes for every destination that has not failed, and write them
+ * to the record file if there is one
+ * @param  fo   the fan-out stream
+ * @param  data the bytes to send
+ * @param  len  the number of bytes
+ * @return      0 while at least one destination is alive, -1 otherwise
+ */
+int fanout_write(struct fanout *fo, const void *data, size_t len);
+
+/**
+ * Wait until every queued byte is sent and release the queues
+ * @param  fo the fan-out stream
+ * @return    0 if every destination received the whole stream, -1 otherwise
+ */
+int fanout_finish(struct fanout *fo);
+
+#endif // _FANOUT_H_
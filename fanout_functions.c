@@ -0,0 +1,199 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "fanout.h"
+
+static void flush_dest(struct fanout_dest *d);
+static int wait_writable(struct fanout *fo);
+
+
+/**
+ * Set up a fan-out stream to the sockets in fds
+ * @param  fo  the fan-out stream to initialize
+ * @param  fds the destination sockets
+ * @param  n   the number of sockets, at most MAXDEST
+ * @return     0 on success, -1 on failure
+ */
+int fanout_init(struct fanout *fo, int *fds, int n) {
+	memset(fo, 0, sizeof(struct fanout));
+	fo->record = -1;
+	if (n > MAXDEST) {
+		fprintf(stderr, "fanout_init: too many destinations\n");
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (!(fo->dest[i].buf = malloc(FANOUT_BUFSIZE))) {
+			perror("fanout_init: malloc");
+			fo->n = i;
+			fanout_finish(fo);
+			return -1;
+		}
+		fo->dest[i].fd = fds[i];
+	}
+	fo->n = n;
+	return 0;
+}
+
+
+/**
+ * Queue len bytes for every destination that has not failed, and write them
+ * to the record file if there is one
+ * @param  fo   the fan-out stream
+ * @param  data the bytes to send
+ * @param  len  the number of bytes
+ * @return      0 while at least one destination is alive, -1 otherwise
+ */
+int fanout_write(struct fanout *fo, const void *data, size_t len) {
+	const char *p = data;
+
+	// the copy is complete before any socket sees the bytes
+	for (size_t done = 0; fo->record >= 0 && done < len;) {
+		ssize_t n = write(fo->record, p + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("fanout_write: write");
+			return -1;
+		}
+		done += n;
+	}
+
+	while (len > 0) {
+		size_t piece = len < FANOUT_BUFSIZE ? len : FANOUT_BUFSIZE;
+
+		// only the destinations whose queue is full hold the writer back
+		while (1) {
+			int full = 0;
+			for (int i = 0; i < fo->n; i++) {
+				flush_dest(&fo->dest[i]);
+				if (!fo->dest[i].failed &&
+					FANOUT_BUFSIZE - fo->dest[i].len < piece) {
+					full = 1;
+				}
+			}
+			if (!full) {
+				break;
+			}
+			if (wait_writable(fo) < 0) {
+				return -1;
+			}
+		}
+
+		int alive = 0;
+		for (int i = 0; i < fo->n; i++) {
+			struct fanout_dest *d = &fo->dest[i];
+			if (d->failed) {
+				continue;
+			}
+			if (d->head + d->len + piece > FANOUT_BUFSIZE) {
+				memmove(d->buf, d->buf + d->head, d->len);
+				d->head = 0;
+			}
+			memcpy(d->buf + d->head + d->len, p, piece);
+			d->len += piece;
+			flush_dest(d);
+			alive++;
+		}
+		if (alive == 0) {
+			fprintf(stderr, "fanout_write: every destination failed\n");
+			return -1;
+		}
+
+		p += piece;
+		len -= piece;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Wait until every queued byte is sent and release the queues
+ * @param  fo the fan-out stream
+ * @return    0 if every destination received the whole stream, -1 otherwise
+ */
+int fanout_finish(struct fanout *fo) {
+	int ret = 0;
+
+	while (1) {
+		int pending = 0;
+		for (int i = 0; i < fo->n; i++) {
+			flush_dest(&fo->dest[i]);
+			pending |= fo->dest[i].len > 0;
+		}
+		if (!pending || wait_writable(fo) < 0) {
+			break;
+		}
+	}
+
+	for (int i = 0; i < fo->n; i++) {
+		if (fo->dest[i].failed || fo->dest[i].len > 0) {
+			ret = -1;
+		}
+		free(fo->dest[i].buf);
+		fo->dest[i].buf = NULL;
+	}
+	return ret;
+}
+
+
+/**
+ * Helper function that sends as much of a queue as the socket accepts
+ * without blocking.
+ */
+static void flush_dest(struct fanout_dest *d) {
+	while (!d->failed && d->len > 0) {
+		ssize_t n = send(d->fd, d->buf + d->head, d->len,
+						 MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("fanout: send");
+				d->failed = 1;
+				d->len = 0;
+			}
+			return;
+		}
+		d->head += n;
+		d->len -= n;
+	}
+	d->head = 0;
+}
+
+
+/**
+ * Helper function that blocks until a destination with queued bytes can
+ * accept more.
+ * @return 0 on success, -1 if there is nothing left to wait for
+ */
+static int wait_writable(struct fanout *fo) {
+	struct pollfd pfds[MAXDEST];
+	int n = 0;
+
+	for (int i = 0; i < fo->n; i++) {
+		if (!fo->dest[i].failed && fo->dest[i].len > 0) {
+			pfds[n].fd = fo->dest[i].fd;
+			pfds[n].events = POLLOUT;
+			n++;
+		}
+	}
+	if (n == 0) {
+		return -1;
+	}
+
+	while (poll(pfds, n, -1) < 0) {
+		if (errno != EINTR) {
+			perror("fanout: poll");
+			return -1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,152 @@
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include <dirent.h>     // DT_DIR DT_UNKNOWN
+
+#define FILTER_FILE ".rcopy-filter"	// rules of a directory; never synced
+#define FILTER_BUCKETS 1024			// buckets of a rule index and dir cache
+
+// kinds of indexed rules
+#define FILTER_NAME 0		// the last component of the path is the key
+#define FILTER_PATH 1		// the whole path is the key
+#define FILTER_SUFFIX 2		// the last component ends with the key
+#define FILTER_HEAD 3		// the first component is the key; globs follow
+
+/*
+ * Include/exclude rules, in the manner of rsync:
+ *
+ *   - PATTERN    exclude what matches
+ *   + PATTERN    include what matches, whatever later rules say
+ *
+ * The first rule that matches a path decides; a path that no rule matches is
+ * included. An excluded directory is skipped with everything below it.
+ *
+ *   *            any run of characters other than '/'
+ *   **           any run of characters, '/' included
+ *   ?            any one character other than '/'
+ *   [...]        one character of a class; [!...] or [^...] negates it
+ *   \c           the character c itself
+ *   /PATTERN     matches the whole path below the directory of the rule
+ *   PATTERN/     matches directories only
+ *
+ * Any other pattern matches the end of a path at a '/': "*.o" every object
+ * file, "build/out" every out in a build directory. Rules given on the
+ * command line belong to the source root. A FILTER_FILE in a directory holds
+ * rules of that directory, which are checked before those of its parents and
+ * before the command line.
+ *
+ * The rules stay on the client. The server digests every file it holds, so a
+ * directory on the server that holds a path the rules exclude, e.g. one
+ * synced before the rule was added, never matches the client's digest and is
+ * compared file by file on every sync, like a directory holding any other
+ * file the source lacks. Removing such paths on the server restores the skip.
+ */
+
+/**
+ * One rule
+ * pattern			the pattern without its leading and trailing '/'
+ * include			1 for '+', 0 for '-'
+ * anchored			1 if the pattern started with '/'
+ * dir_only			1 if the pattern ended with '/'
+ * path				1 if the pattern spans several path components
+ * prefix			the length of the pattern before its first wildcard
+ */
+struct filter_rule {
+    char *pattern;
+    int include;
+    int anchored;
+    int dir_only;
+    int path;
+    size_t prefix;
+};
+
+/**
+ * An entry of the index of the rules without wildcards, of the "*.ext"
+ * rules and of the anchored rules that start with a literal component, so
+ * that thousands of them cost a few lookups per path
+ * kind				FILTER_NAME, FILTER_PATH, FILTER_SUFFIX or FILTER_HEAD
+ * key				the literal the rules match
+ * first			the first such rule that is not dir_only, or -1
+ * first_dir		the first such rule that is dir_only, or -1
+ * globs			for FILTER_HEAD, the rules still to be matched, in order
+ * nglobs			the length of globs
+ * next				the next entry in the same bucket
+ */
+struct filter_key {
+    int kind;
+    char *key;
+    int first;
+    int first_dir;
+    int *globs;
+    int nglobs;
+    struct filter_key *next;
+};
+
+/**
+ * The rules of the command line or of one FILTER_FILE, in order
+ * rules			the rules
+ * n				the number of rules
+ * cap				the capacity of rules
+ * index			the indexed rules by the hash of their key
+ * globs			the indices of the rules not in the index, in increasing order
+ * nglobs			the length of globs
+ */
+struct filter_set {
+    struct filter_rule *rules;
+    int n;
+    int cap;
+    struct filter_key *index[FILTER_BUCKETS];
+    int *globs;
+    int nglobs;
+};
+
+/**
+ * Add a command line rule after those already added
+ * @param  rule    a pattern, optionally prefixed with "+ " or "- "
+ * @param  include 1 if a pattern without a prefix includes, 0 if it excludes
+ * @return         0 on success, -1 if the rule is malformed
+ */
+int filter_add(const char *rule, int include);
+
+/**
+ * Add the rules in a file, one per line, after those already added. Lines
+ * without a prefix exclude; empty lines and lines starting with '#' or ';'
+ * are skipped.
+ * @param  path the file of rules
+ * @return      0 on success, -1 on failure
+ */
+int filter_read(const char *path);
+
+/**
+ * Start filtering the tree rooted at src. Until this is called every path
+ * is included, which is how the server runs.
+ * @param  src the source root
+ * @return     0 on success, -1 on failure
+ */
+int filter_init(const char *src);
+
+/**
+ * Tell whether a path is excluded. Callers ask before they stat or open it,
+ * with the type readdir gave.
+ * @param  rel  the path below the source root
+ * @param  type the d_type of the path; DT_UNKNOWN stats the path only if a
+ *              directory-only rule could decide, and a path that cannot be
+ *              stat'ed counts as a directory
+ * @return      1 if the path is excluded, 0 otherwise
+ */
+int filter_excluded(const char *rel, unsigned char type);
+
+/**
+ * Drop the rules of a directory, so that its FILTER_FILE is read again
+ * @param dir the directory below the source root, "" for the root
+ */
+void filter_forget(const char *dir);
+
+/**
+ * Get the path below the source root of a path on the server
+ * @param  server_path the server path, starting with the name of the root
+ * @return             the rest of server_path after that name
+ */
+const char *filter_rel(const char *server_path);
+
+#endif // _FILTER_H_
@@ -0,0 +1,642 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "filter.h"
+#include "ftree.h"
+
+/**
+ * The rules of one directory, read from its FILTER_FILE
+ * dir				the directory below the source root
+ * set				its rules, or NULL if it has no FILTER_FILE
+ * next				the next directory in the same bucket
+ */
+struct filter_dir {
+    char *dir;
+    struct filter_set *set;
+    struct filter_dir *next;
+};
+
+/**
+ * A path being matched
+ * rel				the path below the source root
+ * type				its d_type, resolved from DT_UNKNOWN at most once
+ */
+struct filter_query {
+    const char *rel;
+    unsigned char type;
+};
+
+static int add_rule(struct filter_set *set, const char *text, int include);
+static int index_rule(struct filter_set *set, int kind, const char *key,
+					  int k);
+static int add_glob(int **globs, int *nglobs, int k);
+static int read_rules(struct filter_set *set, FILE *f, const char *path);
+static struct filter_set *dir_rules(const char *rel, size_t len);
+static int set_match(struct filter_set *set, const char *sub,
+					 const char *name, struct filter_query *q);
+static void consider(struct filter_key *e, struct filter_query *q,
+					 int *best);
+static int first_glob(struct filter_set *set, int *globs, int nglobs,
+					  const char *sub, const char *name,
+					  struct filter_query *q, int best);
+static struct filter_key *lookup(struct filter_set *set, int kind,
+								 const char *key, size_t len);
+static int rule_match(struct filter_rule *r, const char *sub,
+					  const char *name);
+static int glob_match(const char *p, const char *s);
+static const char *class_match(const char *p, char c, int *matched);
+static int query_is_dir(struct filter_query *q);
+static unsigned int hash_key(int kind, const char *key, size_t len);
+static void free_set(struct filter_set *set);
+
+static char *root = NULL; // the source root, NULL while not filtering
+static struct filter_set global; // the rules of the command line
+static struct filter_dir *dirs[FILTER_BUCKETS];
+static pthread_mutex_t dirs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Add a command line rule after those already added
+ * @param  rule    a pattern, optionally prefixed with "+ " or "- "
+ * @param  include 1 if a pattern without a prefix includes, 0 if it excludes
+ * @return         0 on success, -1 if the rule is malformed
+ */
+int filter_add(const char *rule, int include) {
+	return add_rule(&global, rule, include);
+}
+
+
+/**
+ * Add the rules in a file, one per line, after those already added
+ * @param  path the file of rules
+ * @return      0 on success, -1 on failure
+ */
+int filter_read(const char *path) {
+	FILE *f;
+	if (!(f = fopen(path, "r"))) {
+		perror("filter_read: fopen");
+		return -1;
+	}
+	int ret = read_rules(&global, f, path);
+	fclose(f);
+	return ret;
+}
+
+
+/**
+ * Start filtering the tree rooted at src
+ * @param  src the source root
+ * @return     0 on success, -1 on failure
+ */
+int filter_init(const char *src) {
+	if (!(root = strdup(src))) {
+		perror("filter_init: strdup");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Tell whether a path is excluded, trying the rules of its directory, then
+ * of each directory above it, then of the command line.
+ * @param  rel  the path below the source root
+ * @param  type the d_type of the path
+ * @return      1 if the path is excluded, 0 otherwise
+ */
+int filter_excluded(const char *rel, unsigned char type) {
+	if (!root) {
+		return 0;
+	}
+	struct filter_query q = {rel, type};
+	const char *name = strrchr(rel, '/');
+	name = name ? name + 1 : rel;
+
+	// len is the length of the directory with its '/', 0 for the root
+	size_t len = name - rel;
+	while (1) {
+		struct filter_set *set = dir_rules(rel, len ? len - 1 : 0);
+		int k;
+		if (set && (k = set_match(set, rel + len, name, &q)) >= 0) {
+			return !set->rules[k].include;
+		}
+		if (len == 0) {
+			break;
+		}
+		for (len--; len > 0 && rel[len - 1] != '/'; len--)
+			;
+	}
+
+	int k = set_match(&global, rel, name, &q);
+	return k >= 0 && !global.rules[k].include;
+}
+
+
+/**
+ * Drop the rules of a directory, so that its FILTER_FILE is read again
+ * @param dir the directory below the source root, "" for the root
+ */
+void filter_forget(const char *dir) {
+	unsigned int b = hash_key(0, dir, strlen(dir)) % FILTER_BUCKETS;
+	pthread_mutex_lock(&dirs_lock);
+	for (struct filter_dir **p = &dirs[b]; *p; p = &(*p)->next) {
+		if (strcmp((*p)->dir, dir) == 0) {
+			struct filter_dir *d = *p;
+			*p = d->next;
+			free_set(d->set);
+			free(d->dir);
+			free(d);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&dirs_lock);
+}
+
+
+/**
+ * Get the path below the source root of a path on the server
+ * @param  server_path the server path, starting with the name of the root
+ * @return             the rest of server_path after that name
+ */
+const char *filter_rel(const char *server_path) {
+	const char *slash = strchr(server_path, '/');
+	return slash ? slash + 1 : "";
+}
+
+
+/**
+ * Helper function that parses a rule and adds it to the end of a set, to the
+ * index if its pattern is a literal name or path, a "*.ext" suffix or an
+ * anchored glob under a literal first component.
+ * @return 0 on success, -1 if the rule is malformed or out of memory
+ */
+static int add_rule(struct filter_set *set, const char *text, int include) {
+	if ((text[0] == '+' || text[0] == '-') && text[1] == ' ') {
+		include = text[0] == '+';
+		text += 2;
+	}
+
+	struct filter_rule r = {NULL, include, 0, 0, 0, 0};
+	if (text[0] == '/') {
+		r.anchored = 1;
+		text++;
+	}
+	size_t len = strlen(text);
+	if (len > 0 && text[len - 1] == '/') {
+		r.dir_only = 1;
+		len--;
+	}
+	if (len == 0) {
+		fprintf(stderr, "filter_add: empty pattern\n");
+		return -1;
+	}
+	if (!(r.pattern = strndup(text, len))) {
+		perror("filter_add: strndup");
+		return -1;
+	}
+	r.path = strchr(r.pattern, '/') || strstr(r.pattern, "**");
+	r.prefix = strcspn(r.pattern, "*?[\\");
+
+	if (set->n == set->cap) {
+		int cap = set->cap ? set->cap * 2 : 16;
+		struct filter_rule *grown =
+			realloc(set->rules, cap * sizeof(struct filter_rule));
+		if (!grown) {
+			perror("filter_add: realloc");
+			free(r.pattern);
+			return -1;
+		}
+		set->rules = grown;
+		set->cap = cap;
+	}
+	int k = set->n++;
+	set->rules[k] = r;
+
+	// literals and "*.ext" go into the index, and so do anchored globs
+	// under their first component; the rest is matched one by one
+	int literal = r.pattern[r.prefix] == '\0';
+	const char *tail = r.pattern + 1;
+	const char *slash = strchr(r.pattern, '/');
+	if (literal && r.anchored) {
+		return index_rule(set, FILTER_PATH, r.pattern, k);
+	} else if (literal && !r.path) {
+		return index_rule(set, FILTER_NAME, r.pattern, k);
+	} else if (!r.anchored && r.pattern[0] == '*' && tail[0] == '.' &&
+			   !strpbrk(tail, "*?[\\/")) {
+		return index_rule(set, FILTER_SUFFIX, tail, k);
+	} else if (r.anchored && slash && slash - r.pattern <= (long)r.prefix) {
+		char head[MAXPATH];
+		snprintf(head, MAXPATH, "%.*s", (int)(slash - r.pattern), r.pattern);
+		return index_rule(set, FILTER_HEAD, head, k);
+	}
+	return add_glob(&set->globs, &set->nglobs, k);
+}
+
+
+/**
+ * Helper function that appends rule k to a list of rules to be matched.
+ * @return 0 on success, -1 if out of memory
+ */
+static int add_glob(int **globs, int *nglobs, int k) {
+	int *grown = realloc(*globs, (*nglobs + 1) * sizeof(int));
+	if (!grown) {
+		perror("add_glob: realloc");
+		return -1;
+	}
+	*globs = grown;
+	(*globs)[(*nglobs)++] = k;
+	return 0;
+}
+
+
+/**
+ * Helper function that records rule k under its key, unless an earlier rule
+ * with the same key and kind already decides first.
+ * @return 0 on success, -1 if out of memory
+ */
+static int index_rule(struct filter_set *set, int kind, const char *key,
+					  int k) {
+	struct filter_key *e = lookup(set, kind, key, strlen(key));
+	if (!e) {
+		if (!(e = malloc(sizeof(struct filter_key))) ||
+			!(e->key = strdup(key))) {
+			perror("index_rule: malloc");
+			free(e);
+			return -1;
+		}
+		unsigned int b = hash_key(kind, key, strlen(key)) % FILTER_BUCKETS;
+		e->kind = kind;
+		e->first = e->first_dir = -1;
+		e->globs = NULL;
+		e->nglobs = 0;
+		e->next = set->index[b];
+		set->index[b] = e;
+	}
+	if (kind == FILTER_HEAD) {
+		return add_glob(&e->globs, &e->nglobs, k);
+	} else if (set->rules[k].dir_only && e->first_dir < 0) {
+		e->first_dir = k;
+	} else if (!set->rules[k].dir_only && e->first < 0) {
+		e->first = k;
+	}
+	return 0;
+}
+
+
+/**
+ * Helper function that adds the rules in an open file to a set, reporting
+ * and skipping malformed ones.
+ * @return 0 on success, -1 on failure
+ */
+static int read_rules(struct filter_set *set, FILE *f, const char *path) {
+	char line[MAXPATH + 4];
+	int lineno = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		size_t len = strcspn(line, "\n");
+		if (line[len] != '\n' && !feof(f)) {
+			// no pattern is this long; the rest must not be read as a rule
+			fprintf(stderr, "read_rules: %s:%d: line too long, skipped\n",
+					path, lineno);
+			int c;
+			while ((c = getc(f)) != EOF && c != '\n')
+				;
+			continue;
+		}
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#' || line[0] == ';') {
+			continue;
+		}
+		if (add_rule(set, line, 0) < 0) {
+			fprintf(stderr, "read_rules: %s:%d: rule skipped\n", path,
+					lineno);
+		}
+	}
+	if (ferror(f)) {
+		perror("read_rules: fgets");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Helper function that gets the rules of a directory, reading its
+ * FILTER_FILE the first time they are asked for.
+ * @param  rel the start of a path below the source root
+ * @param  len the length of the directory at the start of rel
+ * @return     the rules, or NULL if the directory has none
+ */
+static struct filter_set *dir_rules(const char *rel, size_t len) {
+	unsigned int b = hash_key(0, rel, len) % FILTER_BUCKETS;
+	struct filter_dir *d;
+
+	pthread_mutex_lock(&dirs_lock);
+	for (d = dirs[b]; d; d = d->next) {
+		if (strncmp(d->dir, rel, len) == 0 && d->dir[len] == '\0') {
+			pthread_mutex_unlock(&dirs_lock);
+			return d->set;
+		}
+	}
+
+	if (!(d = calloc(1, sizeof(struct filter_dir))) ||
+		!(d->dir = strndup(rel, len))) {
+		perror("dir_rules: calloc");
+		free(d);
+		pthread_mutex_unlock(&dirs_lock);
+		return NULL;
+	}
+	// a directory too deep for its FILTER_FILE to be named has no rules
+	char path[MAXPATH];
+	FILE *f;
+	int n = snprintf(path, MAXPATH, "%s/%s%s%s", root, d->dir, len ? "/" : "",
+					 FILTER_FILE);
+	if (n < 0 || n >= MAXPATH) {
+		fprintf(stderr, "dir_rules: %s/%s: path too long\n", root, d->dir);
+	} else if ((f = fopen(path, "r"))) {
+		if ((d->set = calloc(1, sizeof(struct filter_set)))) {
+			read_rules(d->set, f, path);
+		} else {
+			perror("dir_rules: calloc");
+		}
+		fclose(f);
+	} else if (errno != ENOENT && errno != ENOTDIR) {
+		perror("dir_rules: fopen");
+	}
+	d->next = dirs[b];
+	dirs[b] = d;
+	pthread_mutex_unlock(&dirs_lock);
+	return d->set;
+}
+
+
+/**
+ * Helper function that finds the first rule of a set that matches a path:
+ * the indexed rules by lookup, then the glob rules in order for as long as
+ * they come before the best match so far.
+ * @param  sub  the path below the directory of the set
+ * @param  name the last component of the path
+ * @return      the index of the rule, or -1 if none matches
+ */
+static int set_match(struct filter_set *set, const char *sub,
+					 const char *name, struct filter_query *q) {
+	int best = set->n;
+	if (best == 0) {
+		return -1;
+	}
+
+	consider(lookup(set, FILTER_NAME, name, strlen(name)), q, &best);
+	consider(lookup(set, FILTER_PATH, sub, strlen(sub)), q, &best);
+	for (const char *dot = strchr(name, '.'); dot; dot = strchr(dot + 1, '.')) {
+		consider(lookup(set, FILTER_SUFFIX, dot, strlen(dot)), q, &best);
+	}
+	struct filter_key *e = lookup(set, FILTER_HEAD, sub, strcspn(sub, "/"));
+	if (e) {
+		best = first_glob(set, e->globs, e->nglobs, sub, name, q, best);
+	}
+	best = first_glob(set, set->globs, set->nglobs, sub, name, q, best);
+	return best < set->n ? best : -1;
+}
+
+
+/**
+ * Helper function that matches a list of glob rules in order, stopping at
+ * the best match so far.
+ * @return the first rule that matches, or best if none before it does
+ */
+static int first_glob(struct filter_set *set, int *globs, int nglobs,
+					  const char *sub, const char *name,
+					  struct filter_query *q, int best) {
+	for (int i = 0; i < nglobs && globs[i] < best; i++) {
+		struct filter_rule *r = &set->rules[globs[i]];
+		if (rule_match(r, sub, name) && (!r->dir_only || query_is_dir(q))) {
+			return globs[i];
+		}
+	}
+	return best;
+}
+
+
+/**
+ * Helper function that lowers best to the first rule of an index entry that
+ * applies to the path, stat'ing it only if that takes a directory-only rule.
+ */
+static void consider(struct filter_key *e, struct filter_query *q,
+					 int *best) {
+	if (!e) {
+		return;
+	}
+	if (e->first >= 0 && e->first < *best) {
+		*best = e->first;
+	}
+	if (e->first_dir >= 0 && e->first_dir < *best && query_is_dir(q)) {
+		*best = e->first_dir;
+	}
+}
+
+
+/**
+ * Helper function that finds the index entry of a key.
+ * @return the entry, or NULL if no rule has this key
+ */
+static struct filter_key *lookup(struct filter_set *set, int kind,
+								 const char *key, size_t len) {
+	unsigned int b = hash_key(kind, key, len) % FILTER_BUCKETS;
+	for (struct filter_key *e = set->index[b]; e; e = e->next) {
+		if (e->kind == kind && strncmp(e->key, key, len) == 0 &&
+			e->key[len] == '\0') {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Helper function that matches a glob rule against a path: the whole path
+ * if it is anchored, its last component if it has a single component, and
+ * otherwise every tail of the path that starts a component.
+ * @return 1 if the rule matches, 0 otherwise
+ */
+static int rule_match(struct filter_rule *r, const char *sub,
+					  const char *name) {
+	// most rules fail on the literal start of their pattern
+	if (r->anchored) {
+		return strncmp(r->pattern, sub, r->prefix) == 0 &&
+			   glob_match(r->pattern, sub);
+	} else if (!r->path) {
+		return strncmp(r->pattern, name, r->prefix) == 0 &&
+			   glob_match(r->pattern, name);
+	}
+	for (const char *s = sub; s; s = strchr(s, '/')) {
+		if (*s == '/') {
+			s++;
+		}
+		if (glob_match(r->pattern, s)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Helper function that matches a whole string against a glob.
+ * @return 1 if it matches, 0 otherwise
+ */
+static int glob_match(const char *p, const char *s) {
+	for (; *p; p++, s++) {
+		switch (*p) {
+		case '*':
+			if (p[1] == '*') {
+				// ** runs across components
+				while (*p == '*') {
+					p++;
+				}
+				for (;; s++) {
+					if (glob_match(p, s)) {
+						return 1;
+					} else if (!*s) {
+						return 0;
+					}
+				}
+			}
+			for (p++;; s++) {
+				if (glob_match(p, s)) {
+					return 1;
+				} else if (!*s || *s == '/') {
+					return 0;
+				}
+			}
+		case '?':
+			if (!*s || *s == '/') {
+				return 0;
+			}
+			break;
+		case '[': {
+			int matched;
+			const char *end;
+			if (!*s || *s == '/') {
+				return 0;
+			}
+			// an unterminated class is a plain '['
+			if (!(end = class_match(p, *s, &matched))) {
+				if (*s != '[') {
+					return 0;
+				}
+				break;
+			}
+			if (!matched) {
+				return 0;
+			}
+			p = end;
+			break;
+		}
+		case '\\':
+			if (p[1]) {
+				p++;
+			}
+			// fall through
+		default:
+			if (*p != *s) {
+				return 0;
+			}
+		}
+	}
+	return *s == '\0';
+}
+
+
+/**
+ * Helper function that matches a character against the class at p.
+ * @param  p       the '[' starting the class
+ * @param  matched set to 1 if c is in the class, 0 otherwise
+ * @return         the ']' ending the class, or NULL if there is none
+ */
+static const char *class_match(const char *p, char c, int *matched) {
+	const char *q = p + 1;
+	int negate = *q == '!' || *q == '^';
+	if (negate) {
+		q++;
+	}
+
+	// a ']' right at the start belongs to the class
+	const char *start = q;
+	int found = 0;
+	for (; *q && (*q != ']' || q == start); q++) {
+		char lo = *q;
+		if (lo == '\\' && q[1]) {
+			lo = *++q;
+		}
+		if (q[1] == '-' && q[2] && q[2] != ']') {
+			char hi = q[2];
+			q += 2;
+			if (hi == '\\' && q[1]) {
+				hi = *++q;
+			}
+			found |= lo <= c && c <= hi;
+		} else {
+			found |= lo == c;
+		}
+	}
+	if (*q != ']') {
+		return NULL;
+	}
+	*matched = found != negate;
+	return q;
+}
+
+
+/**
+ * Helper function that tells whether the path of a query is a directory,
+ * stat'ing it the first time if readdir did not say.
+ */
+static int query_is_dir(struct filter_query *q) {
+	if (q->type == DT_UNKNOWN) {
+		char path[MAXPATH];
+		struct stat st;
+		snprintf(path, MAXPATH, "%s/%s", root, q->rel);
+		q->type = lstat(path, &st) < 0 || S_ISDIR(st.st_mode) ? DT_DIR
+															 : DT_REG;
+	}
+	return q->type == DT_DIR;
+}
+
+
+/**
+ * Helper function that hashes a key of the given kind with FNV-1a.
+ */
+static unsigned int hash_key(int kind, const char *key, size_t len) {
+	uint32_t h = 2166136261u ^ kind;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (unsigned char)key[i]) * 16777619u;
+	}
+	return h;
+}
+
+
+static void free_set(struct filter_set *set) {
+	if (!set) {
+		return;
+	}
+	for (int i = 0; i < set->n; i++) {
+		free(set->rules[i].pattern);
+	}
+	for (int b = 0; b < FILTER_BUCKETS; b++) {
+		while (set->index[b]) {
+			struct filter_key *e = set->index[b];
+			set->index[b] = e->next;
+			free(e->key);
+			free(e->globs);
+			free(e);
+		}
+	}
+	free(set->rules);
+	free(set->globs);
+	free(set);
+}
@@ -1,32 +1,64 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
 #include <libgen.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "batch.h"
 #include "client.h"
+#include "digest.h"
+#include "dircache.h"
 #include "ftree.h"
 #include "server.h"
+#include "verify.h"
+#include "watch.h"
 
-int rcopy_client(char *src, char *host, unsigned short port) {
-	int sock_fd;
-	if ((sock_fd = client_sock(host, port)) < 0) {
+static int connect_dests(struct dests *d, char **hosts, int nhosts,
+						 unsigned short port);
+static void close_dests(struct dests *d);
+static void serve(int listen_fd, int unix_fd, int cpu);
+static void restart_delay(int fails);
+static void stop_shards(pid_t *shards, int n);
+static struct client *accept_client(int listen_fd, struct client *head);
+static int serve_client(struct client *p);
+static void cache_path(char *dst, size_t len, const char *src);
+
+int rcopy_client(char *src, char **hosts, int nhosts, unsigned short port) {
+	struct dests d;
+	if (connect_dests(&d, hosts, nhosts, port) < 0) {
 		fprintf(stderr,
 				"error encountered during initializing client socket\n");
 		return -1;
 	}
 
+	// reuse the digests of the files that did not change since the last run
+	char cache[PATH_MAX];
+	cache_path(cache, sizeof(cache), src);
+	digest_load(cache);
+
 	char *server_path = basename(src);
 
-	if (traverse(sock_fd, src, server_path, host, port) < 0) {
+	if (traverse(&d, src, server_path) < 0 || flush_transfers(&d) < 0) {
 		fprintf(stderr, "error encountered during traversing\n");
 		return -1;
 	}
 
-	close(sock_fd);
+	close_dests(&d);
 
-	// wait
-	if (main_client_wait() < 0) {
+	// wait, then save the digests with those of the files the children sent
+	int waited = main_client_wait();
+	digest_save(cache);
+	if (waited < 0) {
 		fprintf(stderr, "traverse: main client wait\n");
 		return -1;
 	}
@@ -35,77 +67,518 @@ int rcopy_client(char *src, char *host, unsigned short port) {
 	return 0;
 }
 
+int rcopy_watch(char *src, char **hosts, int nhosts, unsigned short port) {
+	struct dests d;
+	if (connect_dests(&d, hosts, nhosts, port) < 0) {
+		fprintf(stderr,
+				"error encountered during initializing client socket\n");
+		return -1;
+	}
 
-void rcopy_server(unsigned short port) {
-	int listen_fd;
-	int nready, maxfd, client_fd;
-	fd_set allset;
-	fd_set rset;
-	struct client *p;
-	struct client *head = NULL;
+	char cache[PATH_MAX];
+	cache_path(cache, sizeof(cache), src);
+	digest_load(cache);
 
-	// Initialize server
-	if ((listen_fd = server_sock()) < 0) {
-		fprintf(stderr,
-				"error encountered during initializing server socket\n");
-		exit(-1);
+	char *server_path = basename(src);
+
+	// watch before the initial sync so no change falls between the two
+	struct watcher w;
+	if (watch_init(&w, src, server_path) < 0) {
+		fprintf(stderr, "error encountered during watching %s\n", src);
+		watch_free(&w);
+		close_dests(&d);
+		return -1;
 	}
 
-	// Initialize allset and add listen_fd to the
-	// set of file descriptors passed into select
-	FD_ZERO(&allset);
-	FD_SET(listen_fd, &allset);
-	// set maxfd to current listening fd
-	maxfd = listen_fd;
+	if (traverse(&d, src, server_path) < 0 || flush_transfers(&d) < 0) {
+		fprintf(stderr, "error encountered during traversing\n");
+		watch_free(&w);
+		close_dests(&d);
+		return -1;
+	}
 
+	// then keep the main connections open and only sync what changed
 	while (1) {
-		rset = allset;
+		if (main_client_reap() < 0) {
+			fprintf(stderr, "rcopy_watch: a transfer failed\n");
+		}
+		fflush(stdout);
+		digest_save(cache);
+		if (watch_collect(&w) < 0 || watch_flush(&w, &d) < 0) {
+			fprintf(stderr, "error encountered during watching %s\n", src);
+			break;
+		}
+	}
 
-		struct sockaddr_in peer;
-		peer.sin_family = PF_INET;
-		unsigned int len;
+	watch_free(&w);
+	close_dests(&d);
+	main_client_wait();
+	return -1;
+}
 
-		nready = select(maxfd + 1, &rset, NULL, NULL, NULL);
-		if (nready < 0) {
-			perror("rcopy_server: select");
-			continue;
+int rcopy_verify(char *src, char **hosts, int nhosts, unsigned short port,
+				 int jobs) {
+	int ret = 0;
+	for (int i = 0; i < nhosts; i++) {
+		int result = verify_tree(src, hosts[i], port, jobs);
+		if (result < 0) {
+			fprintf(stderr, "error encountered during verifying %s\n",
+					hosts[i]);
+			return -1;
 		}
+		ret |= result;
+	}
+	return ret;
+}
 
-		if (FD_ISSET(listen_fd, &rset)) {
-			// server is ready to accept a new connection
-			len = sizeof(peer);
-			if ((client_fd =
-					 accept(listen_fd, (struct sockaddr *)&peer, &len)) < 0) {
-				perror("accept");
+int rcopy_read_batch(char *batch, char **roots, int nroots,
+					 struct server_opts *opts) {
+	if (server_configure(opts) < 0) {
+		return -1;
+	}
+
+	for (int i = 0; i < nroots; i++) {
+		long count;
+		int fd;
+		if (dircache_init(roots[i]) < 0 ||
+			(fd = batch_open(batch, &count)) < 0) {
+			fprintf(stderr, "error encountered during opening %s for %s\n",
+					batch, roots[i]);
+			return -1;
+		}
+
+		// the batch is read like a client connection that never waits
+		struct in_addr ipaddr = {htonl(INADDR_LOOPBACK)};
+		struct client *cp = add_client(NULL, fd, ipaddr);
+		if (!cp) {
+			close(fd);
+			return -1;
+		}
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		int result;
+		while ((result = replay_client(cp)) == HANDLE_OK)
+			;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		double secs = (end.tv_sec - start.tv_sec) +
+					  (end.tv_nsec - start.tv_nsec) / 1e9;
+		off_t bytes = cp->nread;
+		remove_client(cp, fd);
+		if (fd != STDIN_FILENO) {
+			close(fd);
+		}
+		if (result < 0) {
+			fprintf(stderr, "error encountered during applying %s to %s\n",
+					batch, roots[i]);
+			return -1;
+		}
+		fprintf(stderr, "applied %s to %s: %lld bytes in %.2fs (%.1f MB/s)",
+				batch, roots[i], (long long)bytes, secs,
+				secs > 0 ? bytes / secs / 1e6 : 0);
+		if (count >= 0) {
+			fprintf(stderr, ", %ld records", count);
+		}
+		fprintf(stderr, "\n");
+	}
+	return 0;
+}
+
+/**
+ * Helper function that opens a main connection to every server.
+ * @return 0 on success, -1 if any server cannot be reached.
+ */
+static int connect_dests(struct dests *d, char **hosts, int nhosts,
+						 unsigned short port) {
+	if (nhosts > MAXDEST) {
+		fprintf(stderr, "at most %d servers are supported\n", MAXDEST);
+		return -1;
+	}
+
+	d->n = 0;
+	d->port = port;
+	for (int i = 0; i < nhosts; i++) {
+		if ((d->socks[i] = client_sock(hosts[i], port)) < 0) {
+			close_dests(d);
+			return -1;
+		}
+		d->hosts[i] = hosts[i];
+		d->n++;
+	}
+	return 0;
+}
+
+/**
+ * Helper function that closes the main connection to every server.
+ */
+static void close_dests(struct dests *d) {
+	for (int i = 0; i < d->n; i++) {
+		close(d->socks[i]);
+	}
+	d->n = 0;
+}
+
+
+void rcopy_server(unsigned short port, struct server_opts *opts) {
+	if (server_configure(opts) < 0) {
+		exit(-1);
+	}
+
+	// a Unix socket cannot be bound twice, so all shards share one listener
+	int unix_fd = -1;
+	if (opts->unix_path && (unix_fd = server_unix_sock(opts->unix_path)) < 0) {
+		fprintf(stderr, "error encountered during initializing %s\n",
+				opts->unix_path);
+		exit(-1);
+	}
+
+	if (opts->shards <= 1) {
+		int listen_fd;
+		if ((listen_fd = server_sock(port, 0)) < 0) {
+			fprintf(stderr,
+					"error encountered during initializing server socket\n");
+			exit(-1);
+		}
+		serve(listen_fd, unix_fd, -1);
+	}
+
+	// every shard gets its own SO_REUSEPORT listener, so the kernel spreads
+	// the connections over them; they are bound here, so a port that is
+	// taken fails once, and a restarted shard takes over the listener and
+	// the connections queued on it
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int *listeners = calloc(opts->shards, sizeof(int));
+	pid_t *shards = calloc(opts->shards, sizeof(pid_t));
+	time_t *started = calloc(opts->shards, sizeof(time_t));
+	int *fails = calloc(opts->shards, sizeof(int));
+	if (!listeners || !shards || !started || !fails) {
+		perror("rcopy_server: calloc");
+		exit(-1);
+	}
+	for (int i = 0; i < opts->shards; i++) {
+		if ((listeners[i] = server_sock(port, 1)) < 0) {
+			fprintf(stderr,
+					"error encountered during initializing server socket\n");
+			exit(-1);
+		}
+	}
+	while (1) {
+		for (int i = 0; i < opts->shards; i++) {
+			if (shards[i] > 0) {
 				continue;
 			}
-			FD_SET(client_fd, &allset);
-			if (client_fd > maxfd) {
-				maxfd = client_fd;
+			int cpu = opts->pin && ncpus > 0 ? i % ncpus : -1;
+			started[i] = time(NULL);
+			if ((shards[i] = fork()) < 0) {
+				perror("rcopy_server: fork");
+				stop_shards(shards, opts->shards);
+				exit(-1);
+			} else if (shards[i] == 0) {
+				for (int j = 0; j < opts->shards; j++) {
+					if (j != i) {
+						close(listeners[j]);
+					}
+				}
+				serve(listeners[i], unix_fd, cpu);
 			}
-			if (!(head = add_client(head, client_fd, peer.sin_addr))) {
-				fprintf(stderr, "rcopy_server: add_client\n");
+		}
+
+		// restart any shard that dies, backing off while it keeps dying
+		// right after it starts
+		int status;
+		pid_t pid = wait(&status);
+		if (pid < 0) {
+			perror("rcopy_server: wait");
+			stop_shards(shards, opts->shards);
+			exit(-1);
+		}
+		for (int i = 0; i < opts->shards; i++) {
+			if (shards[i] != pid) {
 				continue;
 			}
+			shards[i] = 0;
+			if (WIFEXITED(status) &&
+				WEXITSTATUS(status) == SERVER_SETUP_FAILED) {
+				fprintf(stderr, "rcopy_server: shard %d could not start\n", i);
+				stop_shards(shards, opts->shards);
+				exit(-1);
+			}
+			if (time(NULL) - started[i] >= SERVER_SHARD_QUICK) {
+				fails[i] = 0;
+			} else if (++fails[i] >= SERVER_SHARD_RETRIES) {
+				fprintf(stderr, "rcopy_server: shard %d exited %d times in a "
+						"row right after starting, giving up\n", i, fails[i]);
+				stop_shards(shards, opts->shards);
+				exit(-1);
+			}
+			fprintf(stderr, "rcopy_server: shard %d exited, restarting\n", i);
+			restart_delay(fails[i]);
+		}
+	}
+}
+
+/**
+ * Helper function that waits before restarting a shard that exited fails
+ * times in a row right after it started, doubling the delay every time.
+ * @param fails the number of such exits, 0 to restart at once
+ */
+static void restart_delay(int fails) {
+	if (fails == 0) {
+		return;
+	}
+	long ms = SERVER_SHARD_BACKOFF;
+	for (int i = 1; i < fails && ms < SERVER_SHARD_BACKOFF_MAX; i++) {
+		ms *= 2;
+	}
+	if (ms > SERVER_SHARD_BACKOFF_MAX) {
+		ms = SERVER_SHARD_BACKOFF_MAX;
+	}
+	struct timespec delay = {ms / 1000, ms % 1000 * 1000000};
+	while (nanosleep(&delay, &delay) < 0 && errno == EINTR)
+		;
+}
+
+/**
+ * Helper function that terminates the shards still running.
+ * @param shards the process ids of the shards, 0 for a shard not running
+ * @param n      the number of shards
+ */
+static void stop_shards(pid_t *shards, int n) {
+	for (int i = 0; i < n; i++) {
+		if (shards[i] > 0) {
+			kill(shards[i], SIGTERM);
+		}
+	}
+}
+
+/**
+ * Helper function that runs one event loop: accept connections on a listener
+ * of its own and handle every client connected to it. A shard that cannot
+ * set up exits with SERVER_SETUP_FAILED, which its supervisor does not retry.
+ * @param listen_fd the TCP listener of this loop
+ * @param unix_fd   the Unix socket listener shared by all shards, or -1
+ * @param cpu       the CPU to pin this loop to, or -1
+ */
+static void serve(int listen_fd, int unix_fd, int cpu) {
+	int nready, maxfd;
+	fd_set rset;
+	fd_set wset;
+	struct client *p, *next;
+	struct client *head = NULL;
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+			perror("serve: sched_setaffinity");
+		}
+	}
+
+	// all request paths are resolved relative to sandbox/dest
+	if (dircache_init(".") < 0) {
+		fprintf(stderr, "error encountered during opening the server root\n");
+		exit(SERVER_SETUP_FAILED);
+	}
+
+	while (1) {
+		// a client is only read while its unsent responses stay below the
+		// high-water mark and its host is within its rate limit, and only
+		// watched for writing while it has unsent responses
+		long wait_ms = -1;
+		FD_ZERO(&rset);
+		FD_ZERO(&wset);
+		FD_SET(listen_fd, &rset);
+		maxfd = listen_fd;
+		if (unix_fd >= 0) {
+			FD_SET(unix_fd, &rset);
+			maxfd = unix_fd > maxfd ? unix_fd : maxfd;
+		}
+		for (p = head; p != NULL; p = p->next) {
+			if (!p->closing && p->outlen - p->outpos < SERVER_HIGHWATER &&
+				session_allowed(p->session, &wait_ms)) {
+				FD_SET(p->fd, &rset);
+			}
+			if (p->outpos < p->outlen) {
+				FD_SET(p->fd, &wset);
+			}
+			if (p->fd > maxfd) {
+				maxfd = p->fd;
+			}
+		}
+
+		struct timeval timeout = {wait_ms / 1000, wait_ms % 1000 * 1000};
+		nready = select(maxfd + 1, &rset, &wset, NULL,
+						wait_ms >= 0 ? &timeout : NULL);
+		if (nready < 0) {
+			perror("rcopy_server: select");
+			continue;
+		}
+
+		if (FD_ISSET(listen_fd, &rset)) {
+			head = accept_client(listen_fd, head);
+		}
+		if (unix_fd >= 0 && FD_ISSET(unix_fd, &rset)) {
+			head = accept_client(unix_fd, head);
 		}
 
+		// deficit round robin over the client hosts with input waiting
 		for (p = head; p != NULL; p = p->next) {
+			p->result = HANDLE_OK;
 			if (FD_ISSET(p->fd, &rset)) {
-				int result = handle_client(p, head);
-				if (result == HANDLE_DONE || result < 0) {
-					if (result != HANDLE_DONE) {
-						fprintf(stderr, "rcopy_server: handle_client %d\n",
-								p->fd);
-					}
-					FD_CLR(p->fd, &allset);
-					if (close(p->fd) < 0) {
-						perror("rcopy_server: close");
-					}
-					if (!(head = remove_client(head, p->fd))) {
-						fprintf(stderr, "rcopy_server: remove_client\n");
-					}
+				p->rank = p->session->ready++;
+			}
+		}
+		session_round();
+
+		// each host is served from its start connection on, then wraps
+		// around to those before it
+		for (p = head; p != NULL; p = p->next) {
+			if (FD_ISSET(p->fd, &rset) && p->rank >= p->session->start) {
+				p->result = serve_client(p);
+			}
+		}
+
+		// the current client may be removed, so keep hold of the next one
+		for (p = head; p != NULL; p = next) {
+			next = p->next;
+			int result = p->result;
+			if (FD_ISSET(p->fd, &rset) && p->rank < p->session->start) {
+				result = serve_client(p);
+			}
+			// most responses fit in the socket buffer right away; the rest
+			// waits until the socket is writable
+			if (result >= 0 && p->outpos < p->outlen && flush_output(p) < 0) {
+				result = -1;
+			}
+			if (result < 0 || (p->closing && p->outpos == p->outlen)) {
+				if (close(p->fd) < 0) {
+					perror("rcopy_server: close");
 				}
+				head = remove_client(head, p->fd);
 			}
 		}
 	}
 }
+
+/**
+ * Helper function that handles a readable client for as long as it has input
+ * waiting and its host has credit left in this round, so a small request is
+ * answered in one round while a large transfer yields after a quantum.
+ * @param  p the client
+ * @return   the last result of handle_client
+ */
+static int serve_client(struct client *p) {
+	int result = HANDLE_OK;
+	while (p->session->deficit > 0 && !p->closing &&
+		   p->outlen - p->outpos < SERVER_HIGHWATER) {
+		off_t before = p->nread;
+		result = handle_client(p);
+		session_charge(p->session, p->nread - before);
+		if (result == HANDLE_DONE) {
+			p->closing = 1;
+		} else if (result < 0) {
+			fprintf(stderr, "rcopy_server: handle_client %d\n", p->fd);
+			break;
+		}
+		// nothing more has arrived for now
+		if (p->nread == before) {
+			break;
+		}
+	}
+	return result;
+}
+
+/**
+ * Helper function that accepts a connection waiting on a listener, if another
+ * shard did not take it first, and adds it to the clients.
+ * @param  listen_fd the TCP or Unix socket listener
+ * @param  head      the first client in the link list
+ * @return           the new head of the client link list
+ */
+static struct client *accept_client(int listen_fd, struct client *head) {
+	struct sockaddr_storage peer;
+	socklen_t len = sizeof(peer);
+	int client_fd;
+
+	if ((client_fd = accept(listen_fd, (struct sockaddr *)&peer, &len)) < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			perror("accept");
+		}
+		return head;
+	}
+	// select() cannot watch a descriptor past FD_SETSIZE
+	if (client_fd >= FD_SETSIZE) {
+		fprintf(stderr, "rcopy_server: too many clients\n");
+		close(client_fd);
+		return head;
+	}
+	if (set_nonblock(client_fd) < 0) {
+		close(client_fd);
+		return head;
+	}
+
+	// a peer on a Unix socket is on this host
+	struct in_addr ipaddr = {htonl(INADDR_LOOPBACK)};
+	if (peer.ss_family == AF_INET) {
+		ipaddr = ((struct sockaddr_in *)&peer)->sin_addr;
+	}
+
+	struct client *added = add_client(head, client_fd, ipaddr);
+	if (!added) {
+		fprintf(stderr, "rcopy_server: add_client\n");
+		close(client_fd);
+		return head;
+	}
+	return added;
+}
+
+/**
+ * Helper function that names the digest cache of src: a hidden file next to
+ * it, so it is never part of the synced tree. If that directory cannot be
+ * written, the cache goes under $XDG_CACHE_HOME/rcopy, or ~/.cache/rcopy,
+ * named after the absolute path of src.
+ * @param dst filled with the path of the cache
+ * @param len the size of dst
+ * @param src the source file or directory
+ */
+static void cache_path(char *dst, size_t len, const char *src) {
+	char dir_copy[MAXPATH], base_copy[MAXPATH];
+	strncpy(dir_copy, src, MAXPATH - 1);
+	dir_copy[MAXPATH - 1] = '\0';
+	strncpy(base_copy, src, MAXPATH - 1);
+	base_copy[MAXPATH - 1] = '\0';
+	char *dir = dirname(dir_copy);
+	snprintf(dst, len, "%s/.%s.rcopy_cache", dir, basename(base_copy));
+	if (access(dir, W_OK) == 0) {
+		return;
+	}
+
+	char abs[PATH_MAX], base[PATH_MAX];
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if (!realpath(src, abs)) {
+		return;
+	} else if (xdg && xdg[0] == '/') {
+		snprintf(base, sizeof(base), "%s/rcopy", xdg);
+	} else if (home && home[0] == '/') {
+		snprintf(base, sizeof(base), "%s/.cache/rcopy", home);
+	} else {
+		return;
+	}
+	// the cache home may not exist yet; its parent usually does
+	char parent[PATH_MAX];
+	snprintf(parent, sizeof(parent), "%s", base);
+	mkdir(dirname(parent), 0700);
+	if (mkdir(base, 0700) < 0 && errno != EEXIST) {
+		perror("cache_path: mkdir");
+		return;
+	}
+	for (char *p = abs; *p; p++) {
+		if (*p == '/') {
+			*p = '%';
+		}
+	}
+	snprintf(dst, len, "%s/%s.rcopy_cache", base, abs);
+}
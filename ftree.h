@@ -1,12 +1,14 @@
 #ifndef _FTREE_H_
 #define _FTREE_H_
 
+#include <stdint.h>
 #include <sys/stat.h>
+#include <sys/types.h>
 #include "hash.h"
 
 #define MAXPATH 128
 #define MAXDATA 256
-#define MAXCONNECTION 5
+#define MAXCONNECTION 128   // listen backlog; every transfer child connects anew
 
 // Input states
 #define AWAITING_TYPE 0
@@ -20,11 +22,28 @@
 #define REGFILE 1
 #define REGDIR 2
 #define TRANSFILE 3
+#define VERIFY 4        // compare only; mode tells the type of the original
+#define LINKFILE 5      // make path a hard link to target; followed by target
+#define PROBEFILE 6     // REGFILE or REGDIR not yet hashed, so without the
+                        // hash; mode tells which
 
 // Server responses
 #define OK 0
 #define SENDFILE 1
 #define ERROR 2
+#define SKIPDIR 3       // the server has the same directory subtree
+#define MISSING 4       // VERIFY: the server does not have the path
+#define MISMATCH 5      // VERIFY: the server has a different file
+#define HASHFILE 6      // PROBEFILE of a file: only the hash can tell, send it
+
+// Extent frame types of a TRANSFILE payload
+#define EXTENT_DATA 0   // followed by length bytes of file data
+#define EXTENT_HOLE 1   // a run of length zero bytes, sent without data
+#define EXTENT_END 2    // the file is complete; offset is the final size,
+                        // followed by the hash of the data sent
+
+// Size of an extent frame on the wire: type, offset, length
+#define EXTENT_HDRSIZE (sizeof(int) + 2 * sizeof(int64_t))
 
 #ifndef PORT
     #define PORT 30100
@@ -35,10 +54,28 @@ struct request {
     char path[MAXPATH];
     mode_t mode;
     char hash[BLOCKSIZE];
-    int size;
+    off_t size;
+    char target[MAXPATH];   // LINKFILE: the server path of the first link
+};
+
+/**
+ * An extent frame header. A regular file is sent as a sequence of EXTENT_DATA
+ * and EXTENT_HOLE frames terminated by one EXTENT_END frame and the
+ * BLOCKSIZE byte hash of the file computed as it was sent.
+ */
+struct extent {
+    int type;
+    off_t offset;
+    off_t length;
 };
 
-int rcopy_client(char *source, char *host, unsigned short port);
-void rcopy_server(unsigned short port);
+int rcopy_client(char *source, char **hosts, int nhosts, unsigned short port);
+int rcopy_watch(char *source, char **hosts, int nhosts, unsigned short port);
+int rcopy_verify(char *source, char **hosts, int nhosts, unsigned short port,
+				 int jobs);
+struct server_opts;
+void rcopy_server(unsigned short port, struct server_opts *opts);
+int rcopy_read_batch(char *batch, char **roots, int nroots,
+					 struct server_opts *opts);
 
 #endif // _FTREE_H_
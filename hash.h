@@ -1,10 +1,44 @@
 #ifndef _HASH_H_
 #define _HASH_H_
 
+#include <stdio.h>
+#include <sys/types.h>
+
 #define BLOCKSIZE 8
 
+// Tree hashing of large files
+#define HASH_CHUNK (4 << 20)			// bytes per leaf, a multiple of BLOCKSIZE
+#define HASH_PARALLEL_MIN (64 << 20)	// smaller files are hashed on one core
+#define HASH_MAXTHREADS 16
+#define HASH_READ (1 << 20)				// bytes read at a time by each thread
+
 // Hash manipulation helper functions
 char *hash(char *hash_val, FILE *f);
 int check_hash(const char *hash1, const char *hash2);
 
+/**
+ * Fold len bytes that sit at offset in a file into hash_val. Feeding every
+ * byte of a file through here, in any order, gives the same value as hash(),
+ * so a file can be hashed while it is sent or received.
+ * @param  hash_val the running hash, BLOCKSIZE bytes starting out as zeros
+ * @param  buf      the bytes
+ * @param  len      the number of bytes
+ * @param  offset   the file offset of the first byte
+ */
+void hash_update(char *hash_val, const void *buf, size_t len, off_t offset);
+
+/**
+ * Hash every HASH_CHUNK bytes of a file into its own leaf, in parallel.
+ * Since hash() folds the byte at offset n into hash_val[n % BLOCKSIZE], the
+ * XOR of all leaves is the hash of the whole file, and two files differ in
+ * exactly the chunks whose leaves differ.
+ * @param  leaves filled with BLOCKSIZE bytes for each of the
+ *                (size + HASH_CHUNK - 1) / HASH_CHUNK chunks
+ * @param  fd     the file to hash
+ * @param  size   the size of the file
+ * @return        0 on success, -1 if the file could not be read to size,
+ *                because it shrank while it was hashed
+ */
+int hash_tree(char *leaves, int fd, off_t size);
+
 #endif // _HASH_H_
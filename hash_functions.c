@@ -1,19 +1,96 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
 
-#define BLOCK_SIZE 8
+#include "hash.h"
 
-char *hash(char *hash_val, FILE *f) {
+#define BLOCK_SIZE BLOCKSIZE
+
+/**
+ * The share of a tree hash computed by one thread
+ * fd				the file
+ * size				the size of the file
+ * first			the first chunk of this thread
+ * last				one past the last chunk of this thread
+ * leaves			the leaves of the whole file
+ * failed			set if the file could not be read to size
+ */
+struct hash_job {
+    int fd;
+    off_t size;
+    off_t first;
+    off_t last;
+    char *leaves;
+    int failed;
+};
+
+/**
+ * Fold the bytes of f in [start, end) into hash_val. A byte at offset off
+ * is always folded into hash_val[off % BLOCK_SIZE], so the extents of a file
+ * can be hashed independently and in any order.
+ * @return 0 on success, -1 if the stream could not be positioned.
+ */
+static int hash_range(char *hash_val, FILE *f, off_t start, off_t end) {
     char ch;
-    int hash_index = 0;
+
+    if (fseeko(f, start, SEEK_SET) < 0) {
+        return -1;
+    }
+    for (off_t off = start; off < end && fread(&ch, 1, 1, f) != 0; off++) {
+        hash_val[off % BLOCK_SIZE] ^= ch;
+    }
+    return 0;
+}
+
+/**
+ * Hash the file f. Holes are runs of zero bytes which leave the hash
+ * unchanged, so only the data extents reported by SEEK_DATA/SEEK_HOLE are
+ * read.
+ */
+char *hash(char *hash_val, FILE *f) {
+    int fd = fileno(f);
+    off_t pos = 0, data, hole;
+    struct stat st;
 
     for (int index = 0; index < BLOCK_SIZE; index++) {
         hash_val[index] = '\0';
     }
 
-    while(fread(&ch, 1, 1, f) != 0) {
-        hash_val[hash_index] ^= ch;
-        hash_index = (hash_index + 1) % BLOCK_SIZE;
+    // large files are hashed chunk by chunk on every core
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size >= HASH_PARALLEL_MIN) {
+        off_t nchunks = (st.st_size + HASH_CHUNK - 1) / HASH_CHUNK;
+        char *leaves = malloc(nchunks * BLOCK_SIZE);
+        if (leaves && hash_tree(leaves, fd, st.st_size) == 0) {
+            for (off_t i = 0; i < nchunks; i++) {
+                for (int index = 0; index < BLOCK_SIZE; index++) {
+                    hash_val[index] ^= leaves[i * BLOCK_SIZE + index];
+                }
+            }
+            free(leaves);
+            return hash_val;
+        }
+        free(leaves);
+    }
+
+    while ((data = lseek(fd, pos, SEEK_DATA)) >= 0 &&
+           (hole = lseek(fd, data, SEEK_HOLE)) >= 0) {
+        hash_range(hash_val, f, data, hole);
+        pos = hole;
+    }
+
+    // ENXIO means there is no data past pos; anything else means the file
+    // system cannot report extents, so hash the remainder densely
+    if (errno != ENXIO) {
+        hash_range(hash_val, f, pos, INT64_MAX);
     }
 
     return hash_val;
@@ -28,3 +105,158 @@ int check_hash(const char *hash1, const char *hash2) {
     }
     return 0;
 }
+
+
+/**
+ * Fold len bytes that sit at offset in a file into hash_val. Feeding every
+ * byte of a file through here, in any order, gives the same value as hash().
+ */
+void hash_update(char *hash_val, const void *buf, size_t len, off_t offset) {
+    const unsigned char *p = buf;
+    size_t i = 0;
+
+    // bytes up to the next lane boundary, then whole words
+    for (; i < len && (offset + i) % BLOCK_SIZE != 0; i++) {
+        hash_val[(offset + i) % BLOCK_SIZE] ^= p[i];
+    }
+    uint64_t acc = 0, word;
+    for (; i + BLOCK_SIZE <= len; i += BLOCK_SIZE) {
+        memcpy(&word, p + i, BLOCK_SIZE);
+        acc ^= word;
+    }
+    char lanes[BLOCK_SIZE];
+    memcpy(lanes, &acc, BLOCK_SIZE);
+    for (int index = 0; index < BLOCK_SIZE; index++) {
+        hash_val[index] ^= lanes[index];
+    }
+    for (; i < len; i++) {
+        hash_val[(offset + i) % BLOCK_SIZE] ^= p[i];
+    }
+}
+
+
+/**
+ * Fold the bytes of fd in [start, end) into leaf, HASH_READ bytes at a time.
+ * @return 0 on success, -1 if the file ends before end or cannot be read
+ */
+static int hash_extent(char *leaf, int fd, char *buf, off_t start,
+                       off_t end) {
+    while (start < end) {
+        size_t len = end - start < HASH_READ ? end - start : HASH_READ;
+        ssize_t n = pread(fd, buf, len, start);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
+        }
+        hash_update(leaf, buf, n, start);
+        start += n;
+    }
+    return 0;
+}
+
+/**
+ * Thread body of hash_tree(): hash the chunks [first, last), only reading
+ * their data extents. The file is read rather than mapped, so one that is
+ * truncated meanwhile fails the job instead of raising SIGBUS.
+ */
+static void *hash_chunks(void *arg) {
+    struct hash_job *job = arg;
+    char *buf = malloc(HASH_READ);
+    if (!buf) {
+        job->failed = 1;
+        return NULL;
+    }
+
+    for (off_t i = job->first; i < job->last && !job->failed; i++) {
+        char *leaf = job->leaves + i * BLOCK_SIZE;
+        off_t pos = i * HASH_CHUNK;
+        off_t end = pos + HASH_CHUNK < job->size ? pos + HASH_CHUNK : job->size;
+        off_t data, hole;
+
+        memset(leaf, 0, BLOCK_SIZE);
+        while (pos < end) {
+            // without extent information the rest of the chunk is data
+            if ((data = lseek(job->fd, pos, SEEK_DATA)) < 0) {
+                data = errno == ENXIO ? end : pos;
+            }
+            if (data >= end) {
+                break;
+            }
+            if ((hole = lseek(job->fd, data, SEEK_HOLE)) < 0 || hole > end) {
+                hole = end;
+            }
+            if (hash_extent(leaf, job->fd, buf, data, hole) < 0) {
+                job->failed = 1;
+                break;
+            }
+            pos = hole;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Hash every HASH_CHUNK bytes of a file into its own leaf, in parallel.
+ * Since hash() folds the byte at offset n into hash_val[n % BLOCKSIZE], the
+ * XOR of all leaves is the hash of the whole file, and two files differ in
+ * exactly the chunks whose leaves differ.
+ * @param  leaves filled with BLOCKSIZE bytes for each of the
+ *                (size + HASH_CHUNK - 1) / HASH_CHUNK chunks
+ * @param  fd     the file to hash
+ * @param  size   the size of the file
+ * @return        0 on success, -1 if the file could not be read to size,
+ *                because it shrank while it was hashed
+ */
+int hash_tree(char *leaves, int fd, off_t size) {
+    off_t nchunks = (size + HASH_CHUNK - 1) / HASH_CHUNK;
+    if (nchunks == 0) {
+        return 0;
+    }
+    posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > HASH_MAXTHREADS) {
+        nthreads = HASH_MAXTHREADS;
+    }
+    if (nthreads > nchunks) {
+        nthreads = nchunks;
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    // each thread gets a contiguous run of chunks so its reads stay
+    // sequential
+    pthread_t threads[HASH_MAXTHREADS];
+    struct hash_job jobs[HASH_MAXTHREADS];
+    int started = 0;
+    for (long t = 0; t < nthreads; t++) {
+        jobs[t].fd = fd;
+        jobs[t].size = size;
+        jobs[t].first = nchunks * t / nthreads;
+        jobs[t].last = nchunks * (t + 1) / nthreads;
+        jobs[t].leaves = leaves;
+        jobs[t].failed = 0;
+        if (t > 0 && pthread_create(&threads[t], NULL, hash_chunks,
+                                    &jobs[t]) == 0) {
+            started |= 1 << t;
+        }
+    }
+    // job 0, and any job whose thread could not start, runs here once the
+    // other threads are already working
+    for (long t = 0; t < nthreads; t++) {
+        if (!(started & (1 << t))) {
+            hash_chunks(&jobs[t]);
+        }
+    }
+    int failed = 0;
+    for (long t = 0; t < nthreads; t++) {
+        if (started & (1 << t)) {
+            pthread_join(threads[t], NULL);
+        }
+        failed |= jobs[t].failed;
+    }
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,612 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "ftree.h"
+#include "hash.h"
+
+#ifndef PORT
+#define PORT 30000
+#endif
+
+#define LOADGEN_SESSIONS 64		// concurrent sessions of the last step
+#define LOADGEN_START 1			// concurrent sessions of the first step
+#define LOADGEN_DURATION 5		// seconds every step runs
+#define LOADGEN_SIZE (64 << 10)	// bytes of every synthetic file
+#define LOADGEN_FILES 16		// files every session writes in turn
+#define LOADGEN_ROOT "loadgen"	// server directory holding the sessions
+#define LOADGEN_TIMEOUT 10		// seconds before a silent server is an error
+#define LOADGEN_STACK (256 << 10)	// stack of a session thread
+#define LOADGEN_MIX "6:1:3"		// default REGFILE:REGDIR:TRANSFILE weights
+
+// the operations a session picks from
+#define OP_REGFILE 0
+#define OP_REGDIR 1
+#define OP_TRANSFILE 2
+#define NOPS 3
+
+/**
+ * The load shared by every session
+ * host				the server
+ * port				the port of the server
+ * root				the server directory holding the sessions
+ * weights			the relative frequency of each operation
+ * think_ms			the mean pause of a session between two requests
+ * payload			the content of every synthetic file
+ * size				the length of payload
+ * hash				the hash of payload
+ * stop				set once the current step is over
+ */
+struct load {
+	char *host;
+	unsigned short port;
+	char *root;
+	int weights[NOPS];
+	int think_ms;
+	char *payload;
+	size_t size;
+	char hash[BLOCKSIZE];
+	int stop;
+};
+
+/**
+ * One simulated client and what it measured
+ * load				the shared load
+ * id				the number of the session; its directory is root/id
+ * seed				the state of its random choices
+ * sock_fd			its main connection, or -1 if it has none
+ * lat				the latency of each completed request in microseconds
+ * nlat, cap		the number of latencies and the room for them
+ * bytes			the file data sent
+ * errors			requests the server answered with ERROR
+ * connects			connections attempted
+ * conn_errors		connections that could not be made or were lost before
+ *					the response
+ */
+struct session {
+	struct load *load;
+	int id;
+	unsigned int seed;
+	int sock_fd;
+	double *lat;
+	long nlat, cap;
+	long long bytes;
+	long errors;
+	long connects;
+	long conn_errors;
+};
+
+static int run_step(struct load *load, int nsessions, int duration);
+static void *session_main(void *arg);
+static void file_request(struct session *s, struct request *req);
+static int do_regfile(struct session *s, struct request *req);
+static int do_regdir(struct session *s, const char *path);
+static int do_transfile(struct session *s, struct request *req);
+static int connect_server(struct session *s);
+static int ask(struct session *s, struct request *req);
+static int write_full(int fd, const void *buf, size_t len);
+static int read_full(int fd, void *buf, size_t len);
+static void record(struct session *s, double start);
+static int parse_mix(const char *mix, int *weights);
+static double now_us();
+static int compare_doubles(const void *a, const void *b);
+
+
+static void usage(char *prog) {
+	printf("Usage:\n\t%s [--sessions N] [--start N] [--duration SECS]\n"
+		   "\t\t[--mix F:D:T] [--size BYTES] [--think MS] [--root DIR] HOST\n",
+		   prog);
+	printf("\t HOST - The server to load, or unix:PATH\n");
+	printf("\t --sessions N - Double the concurrent sessions from --start up "
+		   "to N\n\t\t(default %d to %d)\n", LOADGEN_START, LOADGEN_SESSIONS);
+	printf("\t --duration SECS - Run every step for SECS (default %d)\n",
+		   LOADGEN_DURATION);
+	printf("\t --mix F:D:T - Weights of REGFILE, REGDIR and TRANSFILE "
+		   "requests\n\t\t(default %s)\n", LOADGEN_MIX);
+	printf("\t --size BYTES - Size of the files sent (default %d)\n",
+		   LOADGEN_SIZE);
+	printf("\t --think MS - Mean pause between requests (default 0)\n");
+	printf("\t --root DIR - Server directory for the sessions (default %s)\n",
+		   LOADGEN_ROOT);
+}
+
+int main(int argc, char **argv) {
+	static struct option long_options[] = {
+		{"sessions", required_argument, NULL, 'n'},
+		{"start", required_argument, NULL, 's'},
+		{"duration", required_argument, NULL, 'd'},
+		{"mix", required_argument, NULL, 'm'},
+		{"size", required_argument, NULL, 'z'},
+		{"think", required_argument, NULL, 't'},
+		{"root", required_argument, NULL, 'r'},
+		{NULL, 0, NULL, 0}
+	};
+	int sessions = LOADGEN_SESSIONS, start = LOADGEN_START;
+	int duration = LOADGEN_DURATION;
+	struct load load;
+	int opt;
+
+	memset(&load, 0, sizeof(struct load));
+	load.port = PORT;
+	load.root = LOADGEN_ROOT;
+	load.size = LOADGEN_SIZE;
+	parse_mix(LOADGEN_MIX, load.weights);
+
+	while ((opt = getopt_long(argc, argv, "n:s:d:m:z:t:r:", long_options,
+							  NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			sessions = atoi(optarg);
+			break;
+		case 's':
+			start = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'm':
+			if (parse_mix(optarg, load.weights) < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'z':
+			load.size = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			load.think_ms = atoi(optarg);
+			break;
+		case 'r':
+			load.root = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (sessions < 1 || start < 1 || start > sessions || duration < 1 ||
+		load.think_ms < 0 || optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	load.host = argv[optind];
+
+	// every file carries the same bytes; only the sessions vary
+	if (!(load.payload = malloc(load.size ? load.size : 1))) {
+		perror("loadgen: malloc");
+		return 1;
+	}
+	unsigned int seed = time(NULL);
+	for (size_t i = 0; i < load.size; i++) {
+		load.payload[i] = rand_r(&seed);
+	}
+	hash_update(load.hash, load.payload, load.size, 0);
+
+	// the sessions make their directories inside the root
+	struct session boot;
+	memset(&boot, 0, sizeof(struct session));
+	boot.load = &load;
+	boot.sock_fd = -1;
+	if (do_regdir(&boot, load.root) < 0) {
+		fprintf(stderr, "loadgen: cannot create %s on %s\n", load.root,
+				load.host);
+		return 1;
+	}
+	close(boot.sock_fd);
+	free(boot.lat);
+
+	printf("%8s %10s %10s %9s %9s %9s %9s %8s %9s\n", "sessions", "requests",
+		   "req/s", "MB/s", "p50 ms", "p99 ms", "p999 ms", "errors",
+		   "conn err");
+	int n = start;
+	while (1) {
+		if (run_step(&load, n, duration) < 0) {
+			return 1;
+		}
+		if (n == sessions) {
+			break;
+		}
+		n = n * 2 < sessions ? n * 2 : sessions;
+	}
+
+	free(load.payload);
+	return 0;
+}
+
+
+/**
+ * Helper function that runs nsessions sessions at once for duration seconds
+ * and prints one line of the report.
+ * @return 0 on success, -1 if no session could be started
+ */
+static int run_step(struct load *load, int nsessions, int duration) {
+	struct session *sessions = calloc(nsessions, sizeof(struct session));
+	pthread_t *threads = calloc(nsessions, sizeof(pthread_t));
+	if (!sessions || !threads) {
+		perror("run_step: calloc");
+		free(sessions);
+		free(threads);
+		return -1;
+	}
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, LOADGEN_STACK);
+	__atomic_store_n(&load->stop, 0, __ATOMIC_RELAXED);
+
+	double start = now_us();
+	int started = 0;
+	for (; started < nsessions; started++) {
+		struct session *s = &sessions[started];
+		s->load = load;
+		s->id = started;
+		s->seed = started * 2654435761u ^ (unsigned int)start;
+		s->sock_fd = -1;
+		if (pthread_create(&threads[started], &attr, session_main, s) != 0) {
+			fprintf(stderr, "run_step: pthread_create\n");
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	sleep(duration);
+	__atomic_store_n(&load->stop, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	double secs = (now_us() - start) / 1e6;
+
+	long total = 0, errors = 0, connects = 0, conn_errors = 0;
+	long long bytes = 0;
+	for (int i = 0; i < started; i++) {
+		total += sessions[i].nlat;
+		errors += sessions[i].errors;
+		connects += sessions[i].connects;
+		conn_errors += sessions[i].conn_errors;
+		bytes += sessions[i].bytes;
+	}
+
+	double *lat = malloc((total ? total : 1) * sizeof(double));
+	if (!lat) {
+		perror("run_step: malloc");
+		return -1;
+	}
+	long k = 0;
+	for (int i = 0; i < started; i++) {
+		memcpy(lat + k, sessions[i].lat, sessions[i].nlat * sizeof(double));
+		k += sessions[i].nlat;
+		free(sessions[i].lat);
+	}
+	qsort(lat, total, sizeof(double), compare_doubles);
+
+	printf("%8d %10ld %10.1f %9.1f", started, total, total / secs,
+		   bytes / secs / 1e6);
+	if (total) {
+		printf(" %9.3f %9.3f %9.3f", lat[total * 50 / 100] / 1e3,
+			   lat[total * 99 / 100] / 1e3, lat[total * 999 / 1000] / 1e3);
+	} else {
+		printf(" %9s %9s %9s", "-", "-", "-");
+	}
+	printf(" %8ld %8.1f%%\n", errors,
+		   connects ? 100.0 * conn_errors / connects : 0);
+	fflush(stdout);
+
+	free(lat);
+	free(sessions);
+	free(threads);
+	return started ? 0 : -1;
+}
+
+
+/**
+ * Thread body of a session: make its directory, then issue requests drawn
+ * from the mix until the step is over.
+ */
+static void *session_main(void *arg) {
+	struct session *s = arg;
+	struct load *load = s->load;
+	int total = 0;
+	for (int i = 0; i < NOPS; i++) {
+		total += load->weights[i];
+	}
+
+	char dir[MAXPATH];
+	snprintf(dir, MAXPATH, "%s/%d", load->root, s->id);
+	while (!__atomic_load_n(&load->stop, __ATOMIC_RELAXED) &&
+		   do_regdir(s, dir) < 0) {
+		usleep(10000);
+	}
+
+	while (!__atomic_load_n(&load->stop, __ATOMIC_RELAXED)) {
+		int pick = rand_r(&s->seed) % total, op = 0;
+		while (pick >= load->weights[op]) {
+			pick -= load->weights[op++];
+		}
+
+		int result;
+		struct request req;
+		if (op == OP_REGDIR) {
+			result = do_regdir(s, dir);
+		} else {
+			file_request(s, &req);
+			result = op == OP_REGFILE ? do_regfile(s, &req)
+									  : do_transfile(s, &req);
+		}
+		// a server that refuses connections is not asked again at once
+		if (result < 0 && s->sock_fd < 0) {
+			usleep(10000);
+		}
+
+		if (load->think_ms > 0) {
+			long us = rand_r(&s->seed) % (2 * load->think_ms * 1000 + 1);
+			usleep(us);
+		}
+	}
+
+	if (s->sock_fd >= 0) {
+		close(s->sock_fd);
+	}
+	return NULL;
+}
+
+
+/**
+ * Helper function that fills in the request for one of the files of a
+ * session, picked at random.
+ */
+static void file_request(struct session *s, struct request *req) {
+	struct load *load = s->load;
+	memset(req, 0, sizeof(struct request));
+	snprintf(req->path, MAXPATH, "%s/%d/f%d", load->root, s->id,
+			 rand_r(&s->seed) % LOADGEN_FILES);
+	req->mode = S_IFREG | 0644;
+	memcpy(req->hash, load->hash, BLOCKSIZE);
+	req->size = load->size;
+}
+
+
+/**
+ * Helper function that asks about a file, as a client does before it decides
+ * to send it. The answer is not acted on.
+ * @return 0 on success, -1 on failure
+ */
+static int do_regfile(struct session *s, struct request *req) {
+	req->type = REGFILE;
+	double start = now_us();
+	if (ask(s, req) < 0) {
+		return -1;
+	}
+	record(s, start);
+	return 0;
+}
+
+
+/**
+ * Helper function that asks about a directory and creates it on a new
+ * connection if the server does not have it yet.
+ * @return 0 on success, -1 on failure
+ */
+static int do_regdir(struct session *s, const char *path) {
+	struct request req;
+	memset(&req, 0, sizeof(struct request));
+	req.type = REGDIR;
+	strncpy(req.path, path, MAXPATH - 1);
+	req.mode = S_IFDIR | 0755;
+
+	double start = now_us();
+	int response = ask(s, &req);
+	if (response < 0) {
+		return -1;
+	}
+	record(s, start);
+	return response == SENDFILE ? do_transfile(s, &req) : 0;
+}
+
+
+/**
+ * Helper function that sends a TRANSFILE request on a connection of its own,
+ * followed for a file by the payload as one data extent and its hash, and
+ * waits for the server to store it.
+ * @return 0 on success, -1 on failure
+ */
+static int do_transfile(struct session *s, struct request *req) {
+	struct load *load = s->load;
+	double start = now_us();
+	int sock_fd;
+	if ((sock_fd = connect_server(s)) < 0) {
+		return -1;
+	}
+
+	req->type = TRANSFILE;
+	int ret = send_request(sock_fd, req);
+	if (ret == 0 && S_ISREG(req->mode)) {
+		char hdr[EXTENT_HDRSIZE];
+		int type = htonl(EXTENT_DATA);
+		int64_t offset = htobe64(0), length = htobe64(load->size);
+		memcpy(hdr, &type, sizeof(int));
+		memcpy(hdr + sizeof(int), &offset, sizeof(int64_t));
+		memcpy(hdr + sizeof(int) + sizeof(int64_t), &length, sizeof(int64_t));
+		ret = write_full(sock_fd, hdr, EXTENT_HDRSIZE);
+		if (ret == 0) {
+			ret = write_full(sock_fd, load->payload, load->size);
+		}
+
+		type = htonl(EXTENT_END);
+		offset = htobe64(load->size);
+		length = htobe64(0);
+		memcpy(hdr, &type, sizeof(int));
+		memcpy(hdr + sizeof(int), &offset, sizeof(int64_t));
+		memcpy(hdr + sizeof(int) + sizeof(int64_t), &length, sizeof(int64_t));
+		if (ret == 0) {
+			ret = write_full(sock_fd, hdr, EXTENT_HDRSIZE);
+		}
+		if (ret == 0) {
+			ret = write_full(sock_fd, load->hash, BLOCKSIZE);
+		}
+	}
+
+	int response = ERROR;
+	if (ret == 0) {
+		ret = read_full(sock_fd, &response, sizeof(int));
+	}
+	close(sock_fd);
+	if (ret < 0) {
+		s->conn_errors++;
+		return -1;
+	} else if (ntohl(response) != OK) {
+		s->errors++;
+		return -1;
+	}
+
+	record(s, start);
+	if (S_ISREG(req->mode)) {
+		s->bytes += load->size;
+	}
+	return 0;
+}
+
+
+/**
+ * Helper function that opens a connection to the server that gives up on a
+ * silent server after LOADGEN_TIMEOUT seconds.
+ * @return the socket, or -1 on failure
+ */
+static int connect_server(struct session *s) {
+	s->connects++;
+	int sock_fd = client_sock(s->load->host, s->load->port);
+	if (sock_fd < 0) {
+		s->conn_errors++;
+		return -1;
+	}
+	struct timeval timeout = {LOADGEN_TIMEOUT, 0};
+	setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	return sock_fd;
+}
+
+
+/**
+ * Helper function that sends a request on the main connection of a session,
+ * connecting it first if needed, and reads the response. A connection that
+ * is lost is dropped, to be made again by the next request.
+ * @return the response, or -1 on failure
+ */
+static int ask(struct session *s, struct request *req) {
+	if (s->sock_fd < 0 && (s->sock_fd = connect_server(s)) < 0) {
+		return -1;
+	}
+
+	int response;
+	if (send_request(s->sock_fd, req) < 0 ||
+		read_full(s->sock_fd, &response, sizeof(int)) < 0) {
+		close(s->sock_fd);
+		s->sock_fd = -1;
+		s->conn_errors++;
+		return -1;
+	}
+	response = ntohl(response);
+	if (response == ERROR) {
+		s->errors++;
+		return -1;
+	}
+	return response;
+}
+
+
+/**
+ * Helper function that writes exactly len bytes to a socket.
+ * @return 0 on success, -1 on failure
+ */
+static int write_full(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+/**
+ * Helper function that reads exactly len bytes from a socket.
+ * @return 0 on success, -1 on failure or if the socket was closed
+ */
+static int read_full(int fd, void *buf, size_t len) {
+	char *p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+/**
+ * Helper function that keeps the latency of a request that began at start.
+ */
+static void record(struct session *s, double start) {
+	if (s->nlat == s->cap) {
+		long cap = s->cap ? s->cap * 2 : 1024;
+		double *grown = realloc(s->lat, cap * sizeof(double));
+		if (!grown) {
+			return;
+		}
+		s->lat = grown;
+		s->cap = cap;
+	}
+	s->lat[s->nlat++] = now_us() - start;
+}
+
+
+/**
+ * Helper function that parses "F:D:T" into the weights of the operations.
+ * @return 0 on success, -1 if the mix is malformed or all zero
+ */
+static int parse_mix(const char *mix, int *weights) {
+	if (sscanf(mix, "%d:%d:%d", &weights[OP_REGFILE], &weights[OP_REGDIR],
+			   &weights[OP_TRANSFILE]) != NOPS) {
+		return -1;
+	}
+	int total = 0;
+	for (int i = 0; i < NOPS; i++) {
+		if (weights[i] < 0) {
+			return -1;
+		}
+		total += weights[i];
+	}
+	return total > 0 ? 0 : -1;
+}
+
+static double now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
@@ -1,27 +1,154 @@
+#include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "batch.h"
+#include "client.h"
+#include "filter.h"
 #include "ftree.h"
+#include "verify.h"
 
 #ifndef PORT
 #define PORT 30000
 #endif
 
+static void usage() {
+	printf("Usage:\n\trcopy_client [--watch | --verify [--jobs N] | "
+		   "--write-batch FILE] [--prefetch N]\n"
+		   "\t\t[--exclude PATTERN]... [--include PATTERN]... "
+		   "[--filter-from FILE]...\n\t\tSRC HOST...\n");
+	printf("\t SRC - The file or directory to copy to the servers\n");
+	printf("\t HOST - The hostname of a server; the source is read once\n");
+	printf("\t\tand streamed to every HOST given\n");
+	printf("\t --watch - Keep running and sync changes as they happen\n");
+	printf("\t --verify - Only report how the copies differ from SRC\n");
+	printf("\t --jobs N - Verify with N parallel connections (default %d)\n",
+		   VERIFY_JOBS);
+	printf("\t --write-batch FILE - Also record the changes made to the one\n");
+	printf("\t\tHOST in FILE, for rcopy_server --read-batch\n");
+	printf("\t --prefetch N - Read up to N files ahead of the transfers\n");
+	printf("\t\t(default %d, 0 for none)\n", PREFETCH_DEPTH);
+	printf("\t --exclude PATTERN - Skip the paths PATTERN matches\n");
+	printf("\t --include PATTERN - Keep the paths PATTERN matches, even if a\n");
+	printf("\t\tlater rule excludes them; the first matching rule wins\n");
+	printf("\t --filter-from FILE - Read \"+ PATTERN\" and \"- PATTERN\" rules\n");
+	printf("\t\tfrom FILE; a %s in any directory adds rules there\n",
+		   FILTER_FILE);
+}
+
 int main(int argc, char **argv) {
 	/* Note: In most cases, you'll want HOST to be localhost or 127.0.0.1, so
 	 * you can test on your local machine.*/
-	if (argc != 3) {
-		printf("Usage:\n\trcopy_client SRC HOST\n");
-		printf("\t SRC - The file or directory to copy to the server\n");
-		printf("\t HOST - The hostname of the server");
+	static struct option long_options[] = {
+		{"watch", no_argument, NULL, 'w'},
+		{"verify", no_argument, NULL, 'v'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"write-batch", required_argument, NULL, 'b'},
+		{"prefetch", required_argument, NULL, 'p'},
+		{"exclude", required_argument, NULL, 'x'},
+		{"include", required_argument, NULL, 'i'},
+		{"filter-from", required_argument, NULL, 'f'},
+		{NULL, 0, NULL, 0}
+	};
+	int watch = 0, verify = 0, jobs = VERIFY_JOBS;
+	char *batch = NULL;
+	int prefetch;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "wvj:b:p:x:i:f:", long_options,
+							  NULL)) != -1) {
+		switch (opt) {
+		case 'w':
+			watch = 1;
+			break;
+		case 'v':
+			verify = 1;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'b':
+			batch = optarg;
+			break;
+		case 'p':
+			if ((prefetch = atoi(optarg)) < 0) {
+				usage();
+				return 1;
+			}
+			prefetch_configure(prefetch);
+			break;
+		case 'x':
+		case 'i':
+			if (filter_add(optarg, opt == 'i') < 0) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'f':
+			if (filter_read(optarg) < 0) {
+				return 1;
+			}
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	// a batch holds the changes for copies of one reference server
+	if (argc - optind < 2 || (watch && verify) ||
+		(batch && (watch || verify || argc - optind != 2))) {
+		usage();
+		return 1;
+	}
+	if (filter_init(argv[optind]) < 0) {
+		return 1;
+	}
+
+	if (verify) {
+		int result = rcopy_verify(argv[optind], argv + optind + 1,
+								  argc - optind - 1, PORT, jobs);
+		if (result < 0) {
+			printf("Errors encountered during verify\n");
+			return 2;
+		}
+		printf(result ? "Copies differ from the source\n"
+					  : "Copies match the source\n");
+		return result;
+	}
+
+	if (watch) {
+		// only returns when the watch could not be kept up
+		rcopy_watch(argv[optind], argv + optind + 1, argc - optind - 1,
+					PORT);
+		printf("Errors encountered during watch\n");
 		return 1;
 	}
 
-	if (rcopy_client(argv[1], argv[2], PORT) != 0) {
+	if (batch && batch_create(batch) < 0) {
+		printf("Errors encountered during creating %s\n", batch);
+		return 1;
+	}
+
+	if (rcopy_client(argv[optind], argv + optind + 1, argc - optind - 1,
+					 PORT) != 0) {
+		batch_discard();
 		printf("Errors encountered during copy\n");
 		return 1;
-	} else {
-		printf("Copy completed successfully\n");
-		return 0;
 	}
+
+	long count;
+	if (batch && (count = batch_finish()) < 0) {
+		printf("Errors encountered during writing %s\n", batch);
+		return 1;
+	} else if (batch) {
+		printf("Recorded %ld records in %s\n", count, batch);
+	}
+	printf("Copy completed successfully\n");
+	return 0;
 }
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <getopt.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,21 +8,171 @@
 #include <unistd.h>
 
 #include "ftree.h"
+#include "server.h"
 
 #ifndef PORT
 #define PORT 30000
 #endif
 
+static int make_dest(char *prefix, char *path);
+
+static void usage(char *prog) {
+	printf("Usage:\n\t%s [--shards N] [--pin] [--direct MIB] [--inplace MIB]\n"
+		   "\t\t[--unix PATH] [--rate KIB] PATH_PREFIX\n",
+		   prog);
+	printf("\t%s [--direct MIB] [--inplace MIB] --read-batch FILE "
+		   "PATH_PREFIX...\n", prog);
+	printf("\t PATH_PREFIX - The absolute path on the server that is used "
+		   "as the path prefix\n");
+	printf("\t\t for the destination in which to copy files and "
+		   "directories.\n");
+	printf("\t --shards N - Run N event loops, each with its own listener\n");
+	printf("\t --pin - Pin each event loop to its own CPU\n");
+	printf("\t --direct MIB - Write files of at least MIB MiB with O_DIRECT,\n");
+	printf("\t\t bypassing the page cache\n");
+	printf("\t --inplace MIB - Patch existing files of at least MIB MiB in\n");
+	printf("\t\t place, writing only the blocks that changed. Where the file\n");
+	printf("\t\t system cannot clone files (FICLONE), the file itself is\n");
+	printf("\t\t patched, and an interrupted or corrupted transfer leaves it\n");
+	printf("\t\t part old and part new until the next sync\n");
+	printf("\t --unix PATH - Also accept clients on this host at the Unix\n");
+	printf("\t\t socket PATH; they connect with the host unix:PATH\n");
+	printf("\t --rate KIB - Let each client host send at most KIB KiB/s,\n");
+	printf("\t\t counted across all shards\n");
+	printf("\t --read-batch FILE - Apply a batch written by rcopy_client\n");
+	printf("\t\t --write-batch to each PATH_PREFIX and exit; FILE may be -\n");
+	printf("\t\t for standard input with a single PATH_PREFIX\n");
+}
+
 int main(int argc, char **argv) {
+	static struct option long_options[] = {
+		{"shards", required_argument, NULL, 'j'},
+		{"pin", no_argument, NULL, 'p'},
+		{"direct", required_argument, NULL, 'd'},
+		{"inplace", required_argument, NULL, 'i'},
+		{"unix", required_argument, NULL, 'u'},
+		{"rate", required_argument, NULL, 'r'},
+		{"read-batch", required_argument, NULL, 'b'},
+		{NULL, 0, NULL, 0}
+	};
+	struct server_opts opts = {1, 0, 0, NULL, 0, 0};
+	char unix_path[MAXPATH];
+	char *batch = NULL;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "j:pd:i:u:r:b:", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'j':
+			if ((opts.shards = atoi(optarg)) < 1) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'p':
+			opts.pin = 1;
+			break;
+		case 'd':
+			if ((opts.direct_min = (off_t)atoi(optarg) << 20) < 1) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'i':
+			if ((opts.inplace_min = (off_t)atoi(optarg) << 20) < 1) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'u':
+			// the server changes into PATH_PREFIX before listening
+			if (optarg[0] == '/') {
+				strncpy(unix_path, optarg, MAXPATH - 1);
+				unix_path[MAXPATH - 1] = '\0';
+			} else {
+				char cwd[MAXPATH];
+				if (!getcwd(cwd, MAXPATH) ||
+					snprintf(unix_path, MAXPATH, "%s/%s", cwd, optarg) >=
+						MAXPATH) {
+					fprintf(stderr, "%s: path too long\n", optarg);
+					exit(1);
+				}
+			}
+			opts.unix_path = unix_path;
+			break;
+		case 'r':
+			if ((opts.rate = atol(optarg) << 10) < 1) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'b':
+			batch = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
 
-	if (argc != 2) {
-		printf("Usage:\n\t%s PATH_PREFIX\n", argv[0]);
-		printf("\t PATH_PREFIX - The absolute path on the server that is used "
-			   "as the path prefix\n");
-		printf("\t\t for the destination in which to copy files and "
-			   "directories.\n");
+	if (batch) {
+		// a stream can only be read once
+		if (argc - optind < 1 ||
+			(strcmp(batch, "-") == 0 && argc - optind != 1)) {
+			usage(argv[0]);
+			exit(1);
+		}
+		char **roots = calloc(argc - optind, sizeof(char *));
+		if (!roots) {
+			perror("calloc");
+			exit(1);
+		}
+		for (int i = 0; i < argc - optind; i++) {
+			if (!(roots[i] = malloc(MAXPATH)) ||
+				make_dest(argv[optind + i], roots[i]) < 0) {
+				exit(1);
+			}
+		}
+		exit(rcopy_read_batch(batch, roots, argc - optind, &opts) < 0 ? 1 : 0);
+	}
+
+	if (argc - optind != 1) {
+		usage(argv[0]);
 		exit(1);
 	}
+
+	char path[MAXPATH];
+	if (make_dest(argv[optind], path) < 0) {
+		exit(1);
+	}
+
+	// change into the dest directory.
+	chdir(path);
+
+	// remove write and access perissions for sandbox
+	if (chmod("..", 0400) < 0) {
+		perror("chmod");
+		exit(1);
+	}
+
+	/* IMPORTANT: All path operations in rcopy_server must be relative to
+	 * the current working directory.
+	 */
+	rcopy_server(PORT, &opts);
+
+	// Should never get here!
+	fprintf(stderr, "Server reached exit point.");
+	return 1;
+}
+
+
+/**
+ * Create PATH_PREFIX/sandbox/dest, the directory in which the source files
+ * and directories will be copied
+ * @param  prefix the PATH_PREFIX
+ * @param  path   filled with the dest directory (MAXPATH bytes)
+ * @return        0 on success, -1 on failure
+ */
+static int make_dest(char *prefix, char *path) {
 	/* NOTE:  The directory PATH_PREFIX/sandbox/dest will be the directory in
 	 * which the source files and directories will be copied.  It therefore
 	 * needs rwx permissions.  The directory PATH_PREFIX/sandbox will have
@@ -30,8 +181,7 @@ int main(int argc, char **argv) {
 	 */
 
 	// create the sandbox directory
-	char path[MAXPATH];
-	strncpy(path, argv[1], MAXPATH);
+	strncpy(path, prefix, MAXPATH);
 	strncat(path, "/", MAXPATH - strlen(path) + 1);
 	strncat(path, "sandbox", MAXPATH - strlen(path) + 1);
 
@@ -39,7 +189,7 @@ int main(int argc, char **argv) {
 		if (errno != EEXIST) {
 			fprintf(stderr, "couldn't open %s\n", path);
 			perror("mkdir");
-			exit(1);
+			return -1;
 		}
 	}
 
@@ -50,25 +200,8 @@ int main(int argc, char **argv) {
 		if (errno != EEXIST) {
 			fprintf(stderr, "couldn't open %s\n", path);
 			perror("mkdir");
-			exit(1);
+			return -1;
 		}
 	}
-
-	// change into the dest directory.
-	chdir(path);
-
-	// remove write and access perissions for sandbox
-	if (chmod("..", 0400) < 0) {
-		perror("chmod");
-		exit(1);
-	}
-
-	/* IMPORTANT: All path operations in rcopy_server must be relative to
-	 * the current working directory.
-	 */
-	rcopy_server(PORT);
-
-	// Should never get here!
-	fprintf(stderr, "Server reached exit point.");
-	return 1;
+	return 0;
 }
@@ -10,6 +10,7 @@
 
 #include "hash.h"       // hash()
 #include "ftree.h"      // request stuct
+#include "session.h"    // struct session
 
 // for read request
 #define WAIT_TYPE 0
@@ -19,6 +20,9 @@
 #define WAIT_SIZE 4
 #define WAIT_DATA 5
 #define WAIT_OK 6
+#define WAIT_EXTENT 7
+#define WAIT_TARGET 8
+#define WAIT_TRAILER 9
 
 // for handle client flag
 #define HANDLE_OK 0				// handle was successful
@@ -26,37 +30,162 @@
 #define HANDLE_READDONE 2		// the read was ok and there are no more field
 #define HANDLE_DONE 3			// the handling was done entirely
 
+// stop reading from a client while this many response bytes are unsent
+#define SERVER_HIGHWATER (1 << 20)
+
+// for the file write path
+#define SERVER_WBUFSIZE (1 << 20)		// file data buffered per transfer
+#define SERVER_WBUFPOOL 16				// idle write buffers kept for reuse
+#define SERVER_WRITEBEHIND (8 << 20)	// write-back window of large files
+#define SERVER_ALIGN 4096				// O_DIRECT buffer and offset alignment
+#define SERVER_INPLACE_BLOCK 4096		// unit left alone if unchanged in place
+
+// for the shard supervisor
+#define SERVER_SETUP_FAILED 3			// exit status of a shard that cannot start
+#define SERVER_SHARD_QUICK 2			// seconds a shard must run to be healthy
+#define SERVER_SHARD_RETRIES 5			// quick exits in a row before giving up
+#define SERVER_SHARD_BACKOFF 100		// ms before the first quick restart
+#define SERVER_SHARD_BACKOFF_MAX 5000	// ms cap of the doubling restart delay
+
 
 /**
  * A client Link List node
  * fd				file descriptor of the file
  * current_state	the current state of the client
- * file				the file to be synced
+ * file_fd			the file to be synced, or -1
+ * direct			1 if file_fd is open with O_DIRECT
+ * inplace			1 if file_fd holds the old data and is only patched
+ * snapshot			1 if file_fd is a clone of the file that replaces it once
+ *					complete
+ * wbuf				the file data not yet written, SERVER_ALIGN aligned
+ * rbuf				the old data of the range of wbuf when patching in place
+ * wlen				the number of bytes in wbuf
+ * woff				the file offset of wbuf
+ * synced			the written bytes below this offset are being written back
+ * dropped			the written bytes below this offset were advised out of the
+ *					page cache
+ * digest			the hash of the file data received so far
+ * remaining		the bytes left in the current data extent
  * client_req		the client request
+ * in				the bytes of a field that has only partly arrived
+ * inlen			the number of bytes in in
+ * out				the responses not yet taken by the socket
+ * outlen			the number of bytes in out
+ * outpos			the number of bytes of out already sent
+ * outcap			the capacity of out
+ * closing			1 once the client is done and only out is left to send
+ * nread			the bytes read from the socket so far
+ * session			the scheduling session of the client host
+ * rank				its place among the readable connections of its session
+ *					this round
+ * result			the result of handling it this round
  * next				the next client node
  */
 struct client {
     int fd;
     int current_state;
-    FILE *file;
+    int file_fd;
+    int direct;
+    int inplace;
+    int snapshot;
+    char *wbuf;
+    char *rbuf;
+    size_t wlen;
+    off_t woff;
+    off_t synced;
+    off_t dropped;
+    char digest[BLOCKSIZE];
+    off_t remaining;
     struct request client_req;
 	struct in_addr ipaddr;
+    char in[MAXPATH];
+    size_t inlen;
+    char *out;
+    size_t outlen;
+    size_t outpos;
+    size_t outcap;
+    int closing;
+    off_t nread;
+    struct session *session;
+    int rank;
+    int result;
     struct client *next;
 };
 
+/**
+ * Server configuration from the command line
+ * shards			the number of event loop processes
+ * pin				1 to pin each shard to its own CPU
+ * direct_min		write files at least this large with O_DIRECT, 0 for never
+ * unix_path		also listen on this Unix domain socket, or NULL
+ * rate				the bytes per second each client host may send across all
+ *					shards, 0 for any
+ * inplace_min		patch files at least this large in place, 0 for never
+ */
+struct server_opts {
+    int shards;
+    int pin;
+    off_t direct_min;
+    char *unix_path;
+    long rate;
+    off_t inplace_min;
+};
+
 /**
  * Initialize a server socket descriptor and set, bind and listen
+ * @param  port      the port to listen on
+ * @param  reuseport 1 to share the port with the listeners of other shards
+ * @return the listening file descriptor for server
+ */
+int server_sock(unsigned short port, int reuseport);
+
+/**
+ * Initialize a server socket descriptor listening on a Unix domain socket,
+ * replacing a stale socket left at path. A socket that a server still
+ * listens on is left to it, and this fails.
+ * @param  path the path of the socket
  * @return the listening file descriptor for server
  */
-int server_sock();
+int server_unix_sock(char *path);
+
+/**
+ * Apply the command line options that change how clients are handled, before
+ * any shard is forked
+ * @param  opts the server options
+ * @return      0 on success, -1 on failure
+ */
+int server_configure(struct server_opts *opts);
+
+/**
+ * Put a socket in non-blocking mode, so no peer can stall the event loop
+ * @param  fd the socket
+ * @return    0 on success, -1 on failure
+ */
+int set_nonblock(int fd);
+
+/**
+ * Send as much of the client's queued responses as the socket takes now
+ * @param  cp the client
+ * @return    0 on success (even if some output is left), -1 on failure
+ */
+int flush_output(struct client *cp);
 
 /**
  * handle the client at cp
  * @param  cp   the pointer pointing to the client
- * @param  head the first client in the link list
  * @return      0 on success, -1 otherwise.
  */
-int handle_client(struct client *cp, struct client *head);
+int handle_client(struct client *cp);
+
+/**
+ * Apply the next record of a batch file read through cp->fd. The records
+ * change the files the way the requests did on the reference server, except
+ * that nothing is compared: the batch already holds only what changed.
+ * @param  cp the pointer pointing to the client of the batch
+ * @return    HANDLE_OK if more records follow, HANDLE_DONE at the end of the
+ *            batch, -1 if the record could not be applied
+ */
+int replay_client(struct client *cp);
 
 /**
  * Add a client to the head of the client link list
@@ -81,7 +210,7 @@ struct client *remove_client(struct client *head, int fd);
  * @param  cp the client pointer
  * @return    HANDLE_READOK if current read is successful and waiting for
  *                          another field
- *            ERROR if error encountered
+ *            -1 if error encountered
  *            HANDLE_DONE if the socket is closed
  *            HANDLE_READDONE if the all fields have been read
  */
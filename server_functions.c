@@ -1,25 +1,73 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <dirent.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <linux/fs.h>
 #include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
 
+#include "batch.h"
+#include "digest.h"
+#include "dircache.h"
 #include "ftree.h"
 #include "hash.h"
 #include "server.h"
 
 static int make_dir(struct client *cp);
+static int replay_mode(struct client *cp);
+static int replay_done(struct client *cp);
 static int compare(struct request *request);
+static int sync_mode(const char *path, int dir_fd, char *name,
+					 struct stat *st, mode_t mode);
+static void forget_digests(const char *path);
+static int set_mode(int dir_fd, char *name, mode_t mode);
+static int verify(struct client *cp);
+static int make_link(struct client *cp);
+static int send_listing(struct client *cp, int dir_fd, char *name);
 static int read_data(struct client *cp);
+static int read_extent(struct client *cp);
+static int read_trailer(struct client *cp);
+static int discard_file(struct client *cp);
+static int punch_hole(struct client *cp, off_t offset, off_t length);
+static int finish_file(struct client *cp);
+static int open_file(struct client *cp);
+static int break_link(int dir_fd, char *name);
+static int open_inplace(struct client *cp, int dir_fd, char *name);
+static int snapshot_name(struct client *cp, char *name, char *snap);
+static int commit_snapshot(struct client *cp);
+static int flush_file(struct client *cp);
+static int patch_file(struct client *cp);
+static int write_at(int fd, const char *buf, size_t len, off_t off);
+static void write_behind(struct client *cp);
+static int clear_direct(struct client *cp);
+static void close_file(struct client *cp);
+static char *wbuf_get();
+static void wbuf_put(char *buf);
+static int read_field(struct client *cp, void *field, size_t len);
+static int queue_output(struct client *cp, const void *buf, size_t len);
+
+// read_field() found the socket closed
+#define READ_EOF -2
+
+static struct server_opts config = {1, 0, 0, NULL, 0, 0};
+static char *wbuf_pool[SERVER_WBUFPOOL]; // idle write buffers
+static int wbuf_npool = 0;
 
 /**
  * Initialize a server socket descriptor and set, bind and listen
+ * @param  port      the port to listen on
+ * @param  reuseport 1 to share the port with the listeners of other shards
  * @return the listening file descriptor for server
  */
-int server_sock() {
+int server_sock(unsigned short port, int reuseport) {
 	int listen_fd;
 	int on = 1;
 	struct sockaddr_in server;
 
 	server.sin_family = PF_INET;		 // allow sockets across machines
-	server.sin_port = htons(PORT);		 // which port will we be listening on
+	server.sin_port = htons(port);		 // which port will we be listening on
 	server.sin_addr.s_addr = INADDR_ANY; // listen on all network addresses
 	bzero(&(server.sin_zero), 8);
 
@@ -34,6 +82,13 @@ int server_sock() {
 				   sizeof(on)) < 0) {
 		perror("server_sock: setsockopt");
 	}
+	// Let every shard bind its own listener to the same port
+	if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT,
+								(const char *)&on, sizeof(on)) < 0) {
+		perror("server_sock: setsockopt SO_REUSEPORT");
+		close(listen_fd);
+		return -1;
+	}
 	// Associate the process with the address and a port
 	if (bind(listen_fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
 		perror("server_sock: bind");
@@ -46,11 +101,138 @@ int server_sock() {
 		close(listen_fd);
 		return -1;
 	}
+	// another shard may take the connection between select and accept
+	if (set_nonblock(listen_fd) < 0) {
+		close(listen_fd);
+		return -1;
+	}
 
 	return listen_fd;
 }
 
 
+/**
+ * Initialize a server socket descriptor listening on a Unix domain socket,
+ * replacing a stale socket left at path. A socket that a server still
+ * listens on is left to it, and this fails.
+ * @param  path the path of the socket
+ * @return the listening file descriptor for server
+ */
+int server_unix_sock(char *path) {
+	int listen_fd;
+	struct sockaddr_un server;
+	struct stat sock_stat;
+
+	memset(&server, 0, sizeof(server));
+	server.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(server.sun_path)) {
+		fprintf(stderr, "server_unix_sock: %s: Path too long\n", path);
+		return -1;
+	}
+	strcpy(server.sun_path, path);
+
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("server_unix_sock: socket");
+		return -1;
+	}
+	// the socket of a server that did not exit cleanly is still there, but
+	// one that a server still listens on is not taken from it
+	if (lstat(path, &sock_stat) == 0 && S_ISSOCK(sock_stat.st_mode)) {
+		int probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (probe_fd < 0) {
+			perror("server_unix_sock: socket");
+			close(listen_fd);
+			return -1;
+		}
+		int live = connect(probe_fd, (struct sockaddr *)&server,
+						   sizeof(server)) == 0 ||
+				   errno == EAGAIN;
+		int stale = !live && errno == ECONNREFUSED;
+		close(probe_fd);
+		if (live) {
+			fprintf(stderr, "server_unix_sock: %s: a server is already "
+							"listening there\n",
+					path);
+			close(listen_fd);
+			return -1;
+		}
+		if (stale && unlink(path) < 0) {
+			perror("server_unix_sock: unlink");
+		}
+	}
+	if (bind(listen_fd, (struct sockaddr *)&server, sizeof(server)) < 0) {
+		perror("server_unix_sock: bind");
+		close(listen_fd);
+		return -1;
+	}
+	if (listen(listen_fd, MAXCONNECTION) < 0) {
+		perror("server_unix_sock: listen");
+		close(listen_fd);
+		return -1;
+	}
+	// every shard accepts on this socket
+	if (set_nonblock(listen_fd) < 0) {
+		close(listen_fd);
+		return -1;
+	}
+
+	return listen_fd;
+}
+
+
+/**
+ * Apply the command line options that change how clients are handled, before
+ * any shard is forked
+ * @param  opts the server options
+ * @return      0 on success, -1 on failure
+ */
+int server_configure(struct server_opts *opts) {
+	config = *opts;
+	return session_configure(opts->rate);
+}
+
+
+/**
+ * Put a socket in non-blocking mode, so no peer can stall the event loop
+ * @param  fd the socket
+ * @return    0 on success, -1 on failure
+ */
+int set_nonblock(int fd) {
+	int flags;
+	if ((flags = fcntl(fd, F_GETFL)) < 0 ||
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("set_nonblock: fcntl");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Send as much of the client's queued responses as the socket takes now
+ * @param  cp the client
+ * @return    0 on success (even if some output is left), -1 on failure
+ */
+int flush_output(struct client *cp) {
+	while (cp->outpos < cp->outlen) {
+		ssize_t n = send(cp->fd, cp->out + cp->outpos, cp->outlen - cp->outpos,
+						 MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			perror("flush_output: send");
+			return -1;
+		}
+		cp->outpos += n;
+	}
+	cp->outlen = cp->outpos = 0;
+	return 0;
+}
+
+
 /**
  * Add a client to the head of the client link list
  * @param  head      the current head of the client link list
@@ -65,15 +247,32 @@ struct client *add_client(struct client *head, int client_fd,
 		perror("malloc");
 		return NULL;
 	}
+	// all connections from one host share a session
+	if (!(p->session = session_get(sin_addr))) {
+		free(p);
+		return NULL;
+	}
 
 	// initialize a meaningless request
-	struct request client_request = {-1, "\0", -1, "\0", -1};
+	struct request client_request = {-1, "\0", -1, "\0", -1, "\0"};
 
 	p->fd = client_fd;
 	p->current_state = WAIT_TYPE;
-	p->file = NULL;
+	p->file_fd = -1;
+	p->direct = 0;
+	p->inplace = p->snapshot = 0;
+	p->wbuf = NULL;
+	p->rbuf = NULL;
+	p->wlen = 0;
+	p->woff = p->synced = p->dropped = 0;
+	p->remaining = 0;
 	p->client_req = client_request;
 	p->ipaddr = sin_addr;
+	p->inlen = 0;
+	p->out = NULL;
+	p->outlen = p->outpos = p->outcap = 0;
+	p->closing = 0;
+	p->nread = 0;
 	p->next = head;
 	head = p;
 	return head;
@@ -95,6 +294,10 @@ struct client *remove_client(struct client *head, int client_fd) {
 	// This avoids a special case for removing the head of the list
 	if (*p) {
 		struct client *t = (*p)->next;
+		// an interrupted transfer leaves its file open
+		close_file(*p);
+		session_put((*p)->session);
+		free((*p)->out);
 		free(*p);
 		*p = t;
 	} else {
@@ -110,13 +313,23 @@ struct client *remove_client(struct client *head, int client_fd) {
 /**
  * Handle the client at cp
  * @param  cp   the pointer pointing to the client
- * @param  head the first client in the link list
  * @return      HANDLE_OK		if handle is successful
  *              -1			if error occured
  *              HANDLE_DONE	if socket is closed
  *              HANDLE_READOK	if need to read more fields
  */
-int handle_client(struct client *cp, struct client *head) {
+int handle_client(struct client *cp) {
+	// a file transfer in progress only carries extent frames
+	if (cp->current_state == WAIT_EXTENT || cp->current_state == WAIT_DATA ||
+		cp->current_state == WAIT_TRAILER) {
+		int result = read_data(cp);
+		if (result < 0) {
+			fprintf(stderr, "handle_client: read_data: %s\n",
+					cp->client_req.path);
+		}
+		return result;
+	}
+
 	int result = read_request(cp);
 	if (result != HANDLE_READDONE) {
 		return result;
@@ -124,10 +337,12 @@ int handle_client(struct client *cp, struct client *head) {
 
 	// if all fields are read then compare the file/dir and sync
 	struct request *request = &(cp->client_req);
-	printf("path: %s; type: %d; mode: %u; hash: %s; size: %u\n", request->path,
-		   request->type, request->mode, request->hash, request->size);
+	printf("path: %s; type: %d; mode: %u; hash: %s; size: %lld\n",
+		   request->path, request->type, request->mode, request->hash,
+		   (long long)request->size);
 
-	if (request->type == REGFILE || request->type == REGDIR) { // Main client
+	if (request->type == REGFILE || request->type == PROBEFILE ||
+		request->type == REGDIR) { // Main client
 		// compare file and send new request;
 		result = compare(request);
 		if (result < 0) {
@@ -135,11 +350,28 @@ int handle_client(struct client *cp, struct client *head) {
 			return -1;
 		}
 		result = htonl(result);
-		if (write(cp->fd, &result, sizeof(int)) < 0) {
-			perror("handle_client: write");
+		if (queue_output(cp, &result, sizeof(int)) < 0) {
+			return -1;
+		}
+
+		cp->current_state = WAIT_TYPE;
+
+	} else if (request->type == LINKFILE) { // Main client, later hard link
+		if ((result = make_link(cp)) < 0) {
+			fprintf(stderr, "handle_client: make_link: %s\n", request->path);
+			return -1;
+		}
+		result = htonl(result);
+		if (queue_output(cp, &result, sizeof(int)) < 0) {
 			return -1;
 		}
+		cp->current_state = WAIT_TYPE;
 
+	} else if (request->type == VERIFY) { // Verify client
+		if (verify(cp) < 0) {
+			fprintf(stderr, "handle_client: verify: %s\n", request->path);
+			return -1;
+		}
 		cp->current_state = WAIT_TYPE;
 
 	} else if (request->type == TRANSFILE) { // File transfer client
@@ -154,27 +386,14 @@ int handle_client(struct client *cp, struct client *head) {
 			}
 
 		} else if (S_ISREG(request->mode)) { // file
-			if (!cp->file) { // if file does not exist, create file
-				if (!(cp->file = fopen(request->path, "wb"))) {
-					perror("fopen");
-					return -1;
-				}
-			}
-			if (request->size > 0) { // if file has content then write file
-				result = read_data(cp);
-				if (result < 0) {
-					fprintf(stderr, "handle_client: read_data: %s\n",
-							cp->client_req.path);
-					return -1;
-				}
-			} else { // if file does not have content
-				request = OK;
-				if (write(cp->fd, &request, sizeof(int)) < 0) {
-					perror("make_dir: write");
-					return -1;
-				}
-				return result;
+			if (open_file(cp) < 0) {
+				fprintf(stderr, "handle_client: open_file: %s\n",
+						cp->client_req.path);
+				return -1;
 			}
+			// the content follows as extent frames
+			cp->current_state = WAIT_EXTENT;
+			result = HANDLE_OK;
 
 		} else { // Unsupported file type
 			fprintf(stderr, "Unsupported file type\n");
@@ -192,86 +411,154 @@ int handle_client(struct client *cp, struct client *head) {
 }
 
 
+/**
+ * Apply the next record of a batch file read through cp->fd. The records
+ * change the files the way the requests did on the reference server, except
+ * that nothing is compared: the batch already holds only what changed.
+ * @param  cp the pointer pointing to the client of the batch
+ * @return    HANDLE_OK if more records follow, HANDLE_DONE at the end of the
+ *            batch, -1 if the record could not be applied
+ */
+int replay_client(struct client *cp) {
+	struct request *request = &(cp->client_req);
+	int result;
+
+	if (cp->current_state == WAIT_EXTENT || cp->current_state == WAIT_DATA ||
+		cp->current_state == WAIT_TRAILER) {
+		if ((result = read_data(cp)) < 0) {
+			fprintf(stderr, "replay_client: read_data: %s\n", request->path);
+			return -1;
+		}
+		return result == HANDLE_DONE ? replay_done(cp) : HANDLE_OK;
+	}
+
+	result = read_request(cp);
+	if (result == HANDLE_DONE) {
+		fprintf(stderr, "replay_client: the batch ends without its end "
+						"record\n");
+		return -1;
+	} else if (result != HANDLE_READDONE) {
+		return result < 0 ? -1 : HANDLE_OK;
+	}
+	cp->current_state = WAIT_TYPE;
+
+	switch (request->type) {
+	case BATCH_END:
+		return HANDLE_DONE;
+	case REGFILE:
+	case REGDIR:
+	case PROBEFILE:
+		result = replay_mode(cp);
+		break;
+	case LINKFILE:
+		result = make_link(cp);
+		break;
+	case TRANSFILE:
+		if (S_ISDIR(request->mode)) {
+			return make_dir(cp) < 0 ? -1 : replay_done(cp);
+		} else if (S_ISREG(request->mode)) {
+			if (open_file(cp) < 0) {
+				fprintf(stderr, "replay_client: open_file: %s\n",
+						request->path);
+				return -1;
+			}
+			cp->current_state = WAIT_EXTENT;
+			return HANDLE_OK;
+		}
+		/* fall through */
+	default:
+		fprintf(stderr, "replay_client: invalid record for %s\n",
+				request->path);
+		return -1;
+	}
+
+	if (result != OK) {
+		fprintf(stderr, "replay_client: %s is not as on the reference "
+						"server\n",
+				request->path);
+		return -1;
+	}
+	return HANDLE_OK;
+}
+
+
 /**
  * Helper function that reads the request sent by the client.
  * @param  cp the client pointer
  * @return    HANDLE_READOK if current read is successful and waiting for
  *                          another field
- *            ERROR if error encountered
+ *            -1 if error encountered
  *            HANDLE_DONE if the socket is closed
  *            HANDLE_READDONE if the all fields have been read
  */
 int read_request(struct client *cp) {
-	ssize_t len;
 	struct request *request = &cp->client_req;
+	int result = -1;
 
 	switch (cp->current_state) {
 	case WAIT_TYPE: {
-		if ((len = read(cp->fd, &request->type, sizeof(int))) < 0) {
-			perror("read_request: read type");
-			return ERROR;
-		} else if (len == 0) { // socket closed
-			return HANDLE_READDONE;
+		result = read_field(cp, &request->type, sizeof(int));
+		if (result == READ_EOF && cp->inlen == 0) { // socket closed
+			return HANDLE_DONE;
+		} else if (result > 0) {
+			request->type = ntohl(request->type);
+			cp->current_state = WAIT_PATH;
 		}
-		request->type = ntohl(request->type);
-		cp->current_state = WAIT_PATH;
 		break;
 	}
 	case WAIT_PATH: {
-		if ((len = read(cp->fd, request->path, MAXPATH)) < 0) {
-			perror("read_request: read path");
-			return ERROR;
-		} else if (len == 0) {
-			fprintf(stderr, "read_request: socket closed when reading path. "
-							"Closing socket\n");
-			return -1;
+		if ((result = read_field(cp, request->path, MAXPATH)) > 0) {
+			request->path[MAXPATH - 1] = '\0';
+			cp->current_state = WAIT_MODE;
 		}
-		cp->current_state = WAIT_MODE;
 		break;
 	}
 	case WAIT_MODE: {
-		if ((len = read(cp->fd, &request->mode, sizeof(mode_t))) < 0) {
-			perror("read_request: read mode");
-			return ERROR;
-		} else if (len == 0) {
-			fprintf(stderr, "read_request: socket closed when reading mode. "
-							"Closing socket\n");
-			return -1;
+		if ((result = read_field(cp, &request->mode, sizeof(mode_t))) > 0) {
+			request->mode = ntohs(request->mode);
+			cp->current_state = WAIT_HASH;
 		}
-		request->mode = ntohs(request->mode);
-		cp->current_state = WAIT_HASH;
 		break;
 	}
 	case WAIT_HASH: {
-		if ((len = read(cp->fd, request->hash, BLOCKSIZE)) < 0) {
-			perror("read_request: read hash");
-			return ERROR;
-		} else if (len == 0) {
-			fprintf(stderr, "read_request: socket closed when reading hash. "
-							"Closing socket\n");
-			return -1;
+		if ((result = read_field(cp, request->hash, BLOCKSIZE)) > 0) {
+			cp->current_state = WAIT_SIZE;
 		}
-		cp->current_state = WAIT_SIZE;
 		break;
 	}
 	case WAIT_SIZE: {
-		if ((len = read(cp->fd, &request->size, sizeof(size_t))) < 0) {
-			perror("read_request: read size");
-			return ERROR;
-		} else if (len == 0) {
-			fprintf(stderr, "read_request: socket closed when reading size. "
-							"Closing socket\n");
-			return -1;
+		int64_t size;
+		if ((result = read_field(cp, &size, sizeof(int64_t))) > 0) {
+			request->size = be64toh(size);
+			if (request->type == LINKFILE) {
+				cp->current_state = WAIT_TARGET;
+				break;
+			}
+			cp->current_state = WAIT_OK;
+			return HANDLE_READDONE;
 		}
-		request->size = ntohs(request->size);
-		cp->current_state = WAIT_OK;
-		return HANDLE_READDONE;
+		break;
+	}
+	case WAIT_TARGET: {
+		if ((result = read_field(cp, request->target, MAXPATH)) > 0) {
+			request->target[MAXPATH - 1] = '\0';
+			cp->current_state = WAIT_OK;
+			return HANDLE_READDONE;
+		}
+		break;
 	}
 	case WAIT_OK: {
 		return HANDLE_READDONE;
 	}
 	}
 
+	if (result == READ_EOF) {
+		fprintf(stderr, "read_request: socket closed in the middle of a "
+						"request. Closing socket\n");
+		return -1;
+	} else if (result < 0) {
+		return -1;
+	}
 	return HANDLE_READOK;
 }
 
@@ -283,43 +570,55 @@ int read_request(struct client *cp) {
  *                          		server's file is different from the original
  *                            		file.
  *                 OK				if the server has exactly the same file.
+ *                 SKIPDIR			if the server has exactly the same directory
+ *                          		subtree.
+ *                 HASHFILE			if only the hash of a PROBEFILE of a file
+ *                          		can tell.
  *                 ERROR			if the server has different file type.
  *                 -1		if error occured during compare.
  */
 static int compare(struct request *request) {
 	struct stat server_stat;
+	char name[MAXPATH];
+	int dir_fd;
 
 	// get stat and check if file exist
-	if (lstat(request->path, &server_stat) < 0) {
+	if ((dir_fd = dircache_parent(request->path, name)) < 0 ||
+		fstatat(dir_fd, name, &server_stat, AT_SYMLINK_NOFOLLOW) < 0) {
 		if (errno != ENOENT) {
-			perror("compare: lstat");
+			perror("compare: fstatat");
 			return -1;
 		} else {
 			return SENDFILE;
 		}
 	}
 
-	if (request->type == REGFILE) {
+	if (S_ISREG(request->mode)) {
 
 		if (!S_ISREG(server_stat.st_mode)) { // check if both are REGFILE
 			fprintf(stderr, "compare: the files are not compatible: %s\n",
 					request->path);
 			return ERROR;
 		}
-		// compare size and hash
-		FILE *f;
-		if (!(f = fopen(request->path, "rb"))) {
-			perror("compare: fopen");
-			return -1;
+		// compare size, then hash only if the sizes agree
+		if (server_stat.st_size != request->size) {
+			return SENDFILE;
+		} else if (request->type == PROBEFILE && request->size > 0) {
+			return HASHFILE;
 		}
 		char server_hash[BLOCKSIZE] = "\0";
-		hash(server_hash, f);
-		if (check_hash(server_hash, request->hash) == 0 &&
-			server_stat.st_size == request->size) {
-			return OK;
-		} else {
+		if (digest_file(dir_fd, name, &server_stat, server_hash) < 0) {
+			return -1;
+		}
+		if (check_hash(server_hash, request->hash) != 0) {
+			return SENDFILE;
+		} else if (server_stat.st_nlink > 1 &&
+				   (server_stat.st_mode & 07777) != (request->mode & 07777)) {
+			// the mode is shared with the other links; a new copy is not
 			return SENDFILE;
 		}
+		return sync_mode(request->path, dir_fd, name, &server_stat,
+						 request->mode);
 
 	} else {
 		// make dir
@@ -328,12 +627,346 @@ static int compare(struct request *request) {
 					request->path);
 			return ERROR;
 		}
+		// the client can skip the whole subtree if it is identical; the
+		// server holds no filter rules, so paths the client excludes keep
+		// the digests apart (see filter.h). A PROBEFILE comes from a client
+		// that could not digest the subtree without reading it, so it
+		// compares the files one by one instead.
+		int response = OK;
+		char server_hash[BLOCKSIZE] = "\0";
+		if (request->type != PROBEFILE) {
+			if (!strchr(request->path, '/')) {
+				// a sync starts at its root; the tree may have been changed
+				// by hand since the last one, which no digest kept shows
+				digest_invalidate();
+			}
+			if (digest_dir(dir_fd, name, &server_stat, server_hash, NULL) <
+				0) {
+				return -1;
+			}
+			if (check_hash(server_hash, request->hash) == 0) {
+				response = SKIPDIR;
+			}
+		}
+		// last, since it may close dir_fd
+		if (sync_mode(request->path, dir_fd, name, &server_stat,
+					  request->mode) < 0) {
+			return -1;
+		}
+		return response;
+	}
+	return OK;
+}
 
+/**
+ * Helper function that gives an up-to-date file the permissions of the
+ * original, so that directory digests agree on both sides.
+ * @param  path   the request path of the file
+ * @param  dir_fd the parent directory of the file
+ * @param  name   the name of the file
+ * @param  st     the lstat of the file
+ * @param  mode   the mode of the original file
+ * @return        OK on success, -1 on failure
+ */
+static int sync_mode(const char *path, int dir_fd, char *name,
+					 struct stat *st, mode_t mode) {
+	if ((st->st_mode & 07777) == (mode & 07777)) {
 		return OK;
 	}
+	if (set_mode(dir_fd, name, mode) < 0) {
+		return -1;
+	}
+	st->st_mode = (st->st_mode & ~07777) | (mode & 07777);
+	forget_digests(path);
 	return OK;
 }
 
+/**
+ * Helper function that forgets the digests of the directories above a path
+ * that was written, which are the only ones the write changed. The cached
+ * parents of the path may be closed by the dircache calls this makes.
+ * @param path the request path that was written
+ */
+static void forget_digests(const char *path) {
+	char rest[MAXPATH], name[MAXPATH];
+	struct stat dir_stat;
+
+	strncpy(rest, path, MAXPATH - 1);
+	rest[MAXPATH - 1] = '\0';
+	for (char *slash = strrchr(rest, '/'); slash; slash = strrchr(rest, '/')) {
+		int dir_fd = dircache_parent(rest, name);
+		if (dir_fd < 0 || fstat(dir_fd, &dir_stat) < 0) {
+			// the directories cannot be told apart, so forget them all
+			digest_invalidate();
+			return;
+		}
+		digest_forget(&dir_stat);
+		*slash = '\0';
+	}
+}
+
+/**
+ * Helper function that changes the permissions of a file without following
+ * a symlink, so that a name swapped for a symlink since it was stat'ed never
+ * lets a client change the mode of what the link points to. The file is
+ * opened with O_NOFOLLOW and changed through its fd, since fchmodat() with
+ * AT_SYMLINK_NOFOLLOW fails for every file on C libraries older than 2.32
+ * or without /proc. A file the server may not open falls back to fchmodat().
+ * @param  dir_fd the parent directory of the file
+ * @param  name   the name of the file
+ * @param  mode   the new mode
+ * @return        0 on success, -1 on failure
+ */
+static int set_mode(int dir_fd, char *name, mode_t mode) {
+	int fd = openat(dir_fd, name,
+					O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	if (fd >= 0) {
+		int ret = fchmod(fd, mode & 07777);
+		if (ret < 0) {
+			perror("set_mode: fchmod");
+		}
+		close(fd);
+		return ret;
+	}
+
+	struct stat file_stat;
+	if (errno == EACCES &&
+		fchmodat(dir_fd, name, mode & 07777, AT_SYMLINK_NOFOLLOW) == 0) {
+		return 0;
+	}
+	// the permissions of a symlink cannot be changed
+	if (errno == ELOOP ||
+		(errno == EOPNOTSUPP &&
+		 fstatat(dir_fd, name, &file_stat, AT_SYMLINK_NOFOLLOW) == 0 &&
+		 S_ISLNK(file_stat.st_mode))) {
+		fprintf(stderr, "set_mode: %s was replaced by a symlink\n", name);
+	} else {
+		perror("set_mode: openat");
+	}
+	return -1;
+}
+
+/**
+ * Helper function that gives a path the reference server already had the
+ * permissions it has there.
+ * @param  cp the client pointer
+ * @return    OK on success, ERROR if the path is missing or of another type,
+ *            -1 on failure
+ */
+static int replay_mode(struct client *cp) {
+	struct request *req = &(cp->client_req);
+	struct stat st;
+	char name[MAXPATH];
+	int dir_fd;
+
+	if ((dir_fd = dircache_parent(req->path, name)) < 0 ||
+		fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+		if (errno != ENOENT) {
+			perror("replay_mode: fstatat");
+			return -1;
+		}
+		return ERROR;
+	}
+	if ((st.st_mode & S_IFMT) != (req->mode & S_IFMT)) {
+		return ERROR;
+	}
+	return sync_mode(req->path, dir_fd, name, &st, req->mode);
+}
+
+/**
+ * Helper function that ends a replayed transfer, which answered the way it
+ * would have answered a client.
+ * @param  cp the client pointer
+ * @return    HANDLE_OK if the transfer succeeded, -1 otherwise
+ */
+static int replay_done(struct client *cp) {
+	int response = ERROR;
+	if (cp->outlen - cp->outpos >= sizeof(int)) {
+		memcpy(&response, cp->out + cp->outpos, sizeof(int));
+		response = ntohl(response);
+	}
+	cp->outlen = cp->outpos = 0;
+	cp->current_state = WAIT_TYPE;
+
+	if (response != OK) {
+		fprintf(stderr, "replay_done: %s could not be applied\n",
+				cp->client_req.path);
+		return -1;
+	}
+	return HANDLE_OK;
+}
+
+/**
+ * Helper function that makes the path of a LINKFILE request a hard link to
+ * its target, replacing a regular file that is there.
+ * @param  cp the client pointer
+ * @return    OK if path is now a link to target,
+ *            SENDFILE if target is not a regular file of the right size, so
+ *                     the data has to be sent,
+ *            ERROR if path is a directory,
+ *            -1 on failure
+ */
+static int make_link(struct client *cp) {
+	struct request *req = &(cp->client_req);
+	struct stat target_stat, link_stat;
+	char target_name[MAXPATH], name[MAXPATH];
+	int target_fd, dir_fd;
+
+	// the next dircache call may close the parent of target
+	if ((dir_fd = dircache_parent(req->target, target_name)) < 0 ||
+		(target_fd = dup(dir_fd)) < 0) {
+		return errno == ENOENT ? SENDFILE : -1;
+	}
+	if (fstatat(target_fd, target_name, &target_stat, AT_SYMLINK_NOFOLLOW) <
+			0 ||
+		!S_ISREG(target_stat.st_mode) || target_stat.st_size != req->size) {
+		close(target_fd);
+		return SENDFILE;
+	}
+
+	int result = OK, need_link = 1;
+	if ((dir_fd = dircache_parent(req->path, name)) < 0) {
+		perror("make_link: dircache_parent");
+		result = -1;
+	} else if (fstatat(dir_fd, name, &link_stat, AT_SYMLINK_NOFOLLOW) == 0) {
+		if (S_ISDIR(link_stat.st_mode)) {
+			fprintf(stderr, "make_link: the files are not compatible: %s\n",
+					req->path);
+			result = ERROR;
+		} else if (link_stat.st_dev == target_stat.st_dev &&
+				   link_stat.st_ino == target_stat.st_ino) {
+			need_link = 0; // already linked
+		} else if (unlinkat(dir_fd, name, 0) < 0) {
+			perror("make_link: unlinkat");
+			result = -1;
+		}
+	} else if (errno != ENOENT) {
+		perror("make_link: fstatat");
+		result = -1;
+	}
+
+	if (result == OK && need_link) {
+		if (linkat(target_fd, target_name, dir_fd, name, 0) < 0) {
+			perror("make_link: linkat");
+			result = -1;
+		}
+	}
+	if (result == OK) {
+		result = sync_mode(req->path, dir_fd, name, &target_stat, req->mode);
+	}
+	if (result == OK && need_link) {
+		forget_digests(req->path);
+	}
+
+	close(target_fd);
+	return result;
+}
+
+/**
+ * Helper function that answers a VERIFY request without changing anything.
+ * A directory that exists is followed by the names of its children, so the
+ * client can report the paths that only the server has. Files are read
+ * rather than trusted to the digest cache, whose stat tuples miss a change
+ * that kept the size and times, such as a flipped bit on the disk.
+ * @param  cp the client pointer
+ * @return    0 on success; -1 on failure
+ */
+static int verify(struct client *cp) {
+	struct request *request = &(cp->client_req);
+	struct stat server_stat;
+	char name[MAXPATH];
+	int dir_fd;
+	int result = OK;
+
+	if ((dir_fd = dircache_parent(request->path, name)) < 0 ||
+		fstatat(dir_fd, name, &server_stat, AT_SYMLINK_NOFOLLOW) < 0) {
+		if (errno != ENOENT) {
+			perror("verify: fstatat");
+			return -1;
+		}
+		result = MISSING;
+	} else if (S_ISREG(request->mode)) {
+		char server_hash[BLOCKSIZE] = "\0";
+		if (!S_ISREG(server_stat.st_mode) ||
+			server_stat.st_size != request->size ||
+			(server_stat.st_mode & 07777) != (request->mode & 07777)) {
+			result = MISMATCH;
+		} else if (digest_reread(dir_fd, name, &server_stat, server_hash) <
+				   0) {
+			return -1;
+		} else if (check_hash(server_hash, request->hash) != 0) {
+			result = MISMATCH;
+		}
+	} else if (!S_ISDIR(server_stat.st_mode) || !S_ISDIR(request->mode)) {
+		result = MISMATCH;
+	}
+
+	int response = htonl(result);
+	if (queue_output(cp, &response, sizeof(int)) < 0) {
+		return -1;
+	}
+
+	if (result == OK && S_ISDIR(request->mode)) {
+		return send_listing(cp, dir_fd, name);
+	}
+	return 0;
+}
+
+/**
+ * Helper function that sends the number of children of a directory followed
+ * by their names, MAXPATH bytes each, skipping names that start with '.'.
+ * @return 0 on success; -1 on failure
+ */
+static int send_listing(struct client *cp, int dir_fd, char *name) {
+	int fd;
+	DIR *dirp;
+	if ((fd = openat(dir_fd, name,
+					 O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		perror("send_listing: openat");
+		return -1;
+	}
+	if (!(dirp = fdopendir(fd))) {
+		perror("send_listing: fdopendir");
+		close(fd);
+		return -1;
+	}
+
+	int count = 0;
+	struct dirent *dirent;
+	while ((dirent = readdir(dirp))) {
+		count += strncmp(dirent->d_name, ".", 1) != 0;
+	}
+	rewinddir(dirp);
+
+	// exactly count names follow, even if the directory changes meanwhile
+	int net_count = htonl(count);
+	int ret = 0;
+	if (queue_output(cp, &net_count, sizeof(int)) < 0) {
+		ret = -1;
+	}
+	while (ret == 0 && count > 0 && (dirent = readdir(dirp))) {
+		if (strncmp(dirent->d_name, ".", 1) == 0) {
+			continue;
+		}
+		char child[MAXPATH] = {0};
+		strncpy(child, dirent->d_name, MAXPATH - 1);
+		if (queue_output(cp, child, MAXPATH) < 0) {
+			ret = -1;
+		}
+		count--;
+	}
+	// pad if entries vanished between the two passes
+	while (ret == 0 && count-- > 0) {
+		char child[MAXPATH] = {0};
+		if (queue_output(cp, child, MAXPATH) < 0) {
+			ret = -1;
+		}
+	}
+
+	closedir(dirp);
+	return ret;
+}
+
 /**
  * Helper function that makes a directory and send the response to the client
  * @param  cp the client pointer
@@ -341,14 +974,29 @@ static int compare(struct request *request) {
  */
 static int make_dir(struct client *cp) {
 	struct request *req = &(cp->client_req);
-	if (mkdir(req->path, req->mode) < 0) {
-		perror("make_dir: mkdir");
+	char name[MAXPATH];
+	int dir_fd;
+	if ((dir_fd = dircache_parent(req->path, name)) < 0) {
+		perror("make_dir: dircache_parent");
+		return -1;
+	}
+	// another transfer may have created the directory in the meantime
+	struct stat dir_stat;
+	if (mkdirat(dir_fd, name, req->mode) < 0 &&
+		(errno != EEXIST || fstatat(dir_fd, name, &dir_stat,
+									AT_SYMLINK_NOFOLLOW) < 0 ||
+		 !S_ISDIR(dir_stat.st_mode))) {
+		perror("make_dir: mkdirat");
+		return -1;
+	}
+	// mkdirat applies the umask; the copy gets the original permissions
+	if (set_mode(dir_fd, name, req->mode) < 0) {
 		return -1;
 	}
+	forget_digests(req->path);
 
 	int response = htonl(OK);
-	if (write(cp->fd, &response, sizeof(int)) < 0) {
-		perror("make_dir: write");
+	if (queue_output(cp, &response, sizeof(int)) < 0) {
 		return -1;
 	}
 
@@ -356,41 +1004,736 @@ static int make_dir(struct client *cp) {
 }
 
 /**
- * read the data one MAXDATA bytes a time and write the data into the file
+ * Read the next extent frame or what has arrived of the current data extent
+ * and apply it to the file.
  * @param  cp the client pointer
  * @return    HANDLE_OK			if the current file is not entirely copied
  *            HANDLE_DONE		if the current file is done copying
  *            -1				if error occurred
  */
 static int read_data(struct client *cp) {
-	char buf[MAXDATA];
-	int num_read, num_wrote;
-	if ((num_read = read(cp->fd, buf, MAXDATA)) < 0) {
+	if (cp->current_state == WAIT_EXTENT) {
+		return read_extent(cp);
+	} else if (cp->current_state == WAIT_TRAILER) {
+		return read_trailer(cp);
+	}
+
+	// read straight into the write buffer, as much as it takes
+	ssize_t num_read;
+	size_t room = SERVER_WBUFSIZE - cp->wlen;
+	size_t want = cp->remaining < (off_t)room ? (size_t)cp->remaining : room;
+	if ((num_read = read(cp->fd, cp->wbuf + cp->wlen, want)) < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return HANDLE_OK;
+		}
 		perror("read_data: read");
 		return -1;
+	} else if (num_read == 0) {
+		fprintf(stderr, "read_data: socket closed in the middle of [%s]\n",
+				cp->client_req.path);
+		return -1;
+	}
+
+	// hash the data as it arrives, so it is never read back
+	hash_update(cp->digest, cp->wbuf + cp->wlen, num_read,
+				cp->woff + cp->wlen);
+	cp->nread += num_read;
+	cp->wlen += num_read;
+	if (cp->wlen == SERVER_WBUFSIZE && flush_file(cp) < 0) {
+		return -1;
+	}
+
+	cp->remaining -= num_read;
+	if (cp->remaining == 0) {
+		cp->current_state = WAIT_EXTENT;
+	}
+
+	return HANDLE_OK;
+}
+
+/**
+ * Helper function that reads one extent frame header and acts on it.
+ * @param  cp the client pointer
+ * @return    HANDLE_OK if more frames follow, HANDLE_DONE if the file is
+ *            complete, -1 if error occurred
+ */
+static int read_extent(struct client *cp) {
+	char hdr[EXTENT_HDRSIZE];
+	int result;
+
+	if ((result = read_field(cp, hdr, EXTENT_HDRSIZE)) == 0) {
+		return HANDLE_OK; // the rest of the header has not arrived yet
+	} else if (result == READ_EOF) {
+		fprintf(stderr, "read_extent: socket closed when reading extent. "
+						"Closing socket\n");
+		return -1;
+	} else if (result < 0) {
+		return -1;
+	}
+
+	struct extent ext;
+	int64_t offset, length;
+	memcpy(&ext.type, hdr, sizeof(int));
+	memcpy(&offset, hdr + sizeof(int), sizeof(int64_t));
+	memcpy(&length, hdr + sizeof(int) + sizeof(int64_t), sizeof(int64_t));
+	ext.type = ntohl(ext.type);
+	ext.offset = be64toh(offset);
+	ext.length = be64toh(length);
+
+	if (ext.offset < 0 || ext.length < 0) {
+		fprintf(stderr, "read_extent: invalid extent for [%s]\n",
+				cp->client_req.path);
+		return -1;
+	}
+
+	switch (ext.type) {
+	case EXTENT_DATA: {
+		// data that does not follow the buffered data starts a new write
+		if (ext.offset != cp->woff + (off_t)cp->wlen) {
+			if (flush_file(cp) < 0) {
+				return -1;
+			}
+			cp->woff = ext.offset;
+		}
+		// the extent is announced whole, so allocate it in one piece
+		if (ext.length > 0 &&
+			fallocate(cp->file_fd, FALLOC_FL_KEEP_SIZE, ext.offset,
+					  ext.length) < 0 &&
+			errno != EOPNOTSUPP) {
+			perror("read_extent: fallocate");
+			return -1;
+		}
+		cp->remaining = ext.length;
+		if (cp->remaining > 0) {
+			cp->current_state = WAIT_DATA;
+		}
+		return HANDLE_OK;
+	}
+	case EXTENT_HOLE: {
+		if (punch_hole(cp, ext.offset, ext.length) < 0) {
+			return -1;
+		}
+		return HANDLE_OK;
+	}
+	case EXTENT_END: {
+		if (ext.offset != cp->client_req.size) {
+			fprintf(stderr, "read_extent: [%s] ended at %lld, expected %lld\n",
+					cp->client_req.path, (long long)ext.offset,
+					(long long)cp->client_req.size);
+			return -1;
+		}
+		cp->current_state = WAIT_TRAILER;
+		return HANDLE_OK;
+	}
+	}
+
+	fprintf(stderr, "read_extent: unknown extent type %d\n", ext.type);
+	return -1;
+}
+
+/**
+ * Helper function that reads the hash the client computed over the data it
+ * sent and checks it against the hash of the data received.
+ * @param  cp the client pointer
+ * @return    HANDLE_OK if the hash has not fully arrived, HANDLE_DONE once
+ *            the file is complete or discarded, -1 if error occurred
+ */
+static int read_trailer(struct client *cp) {
+	char sent_hash[BLOCKSIZE];
+	int result;
+
+	if ((result = read_field(cp, sent_hash, BLOCKSIZE)) == 0) {
+		return HANDLE_OK;
+	} else if (result == READ_EOF) {
+		fprintf(stderr, "read_trailer: socket closed when reading hash. "
+						"Closing socket\n");
+		return -1;
+	} else if (result < 0) {
+		return -1;
+	}
+
+	if (check_hash(sent_hash, cp->digest) != 0) {
+		fprintf(stderr, "read_trailer: [%s] was corrupted in transfer\n",
+				cp->client_req.path);
+		return discard_file(cp);
+	}
+	return finish_file(cp);
+}
+
+/**
+ * Helper function that removes a file whose data did not arrive intact, or
+ * the clone it was patched in, and sends ERROR to the client, so the file is
+ * sent again on the next sync. A file patched without a clone is kept: it
+ * holds the old data but for the blocks that arrived, which the next sync
+ * patches again.
+ * @param  cp the client pointer
+ * @return    HANDLE_DONE on success, -1 on failure
+ */
+static int discard_file(struct client *cp) {
+	char name[MAXPATH];
+	int dir_fd;
+
+	// closing removes the clone of a file patched in a snapshot, and with
+	// it every change; a file written anew is incomplete
+	int written = !cp->inplace;
+	close_file(cp);
+	if (written &&
+		((dir_fd = dircache_parent(cp->client_req.path, name)) < 0 ||
+		 unlinkat(dir_fd, name, 0) < 0)) {
+		perror("discard_file: unlinkat");
+		return -1;
+	}
+	forget_digests(cp->client_req.path);
+
+	int response = htonl(ERROR);
+	if (queue_output(cp, &response, sizeof(int)) < 0) {
+		return -1;
+	}
+	return HANDLE_DONE;
+}
+
+/**
+ * Helper function that makes sure [offset, offset + length) of the file reads
+ * as zeros without allocating disk space for it. Ranges past the end of the
+ * file become holes once the file is extended by finish_file().
+ * @param  cp     the client pointer
+ * @param  offset the start of the hole
+ * @param  length the length of the hole
+ * @return        0 on success, -1 on failure
+ */
+static int punch_hole(struct client *cp, off_t offset, off_t length) {
+	int fd = cp->file_fd;
+	struct stat file_stat;
+
+	if (flush_file(cp) < 0 || fstat(fd, &file_stat) < 0) {
+		perror("punch_hole: fstat");
+		return -1;
+	}
+	if (offset >= file_stat.st_size || length == 0) {
+		return 0;
+	}
+
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+				  length) == 0) {
+		return 0;
+	} else if (errno != EOPNOTSUPP) {
+		perror("punch_hole: fallocate");
+		return -1;
 	}
 
-	if ((num_wrote = fwrite(buf, 1, num_read, cp->file)) != num_read) {
-		if (ferror(cp->file)) {
-			fprintf(stderr, "server:fwrite error for [%s]\n",
+	// the file system cannot punch holes; write the zeros out instead
+	char zeros[MAXDATA] = {0};
+	off_t end = offset + length;
+	if (end > file_stat.st_size) {
+		end = file_stat.st_size;
+	}
+	if (clear_direct(cp) < 0) {
+		return -1;
+	}
+	for (off_t pos = offset; pos < end; pos += MAXDATA) {
+		size_t want = end - pos < MAXDATA ? end - pos : MAXDATA;
+		if (pwrite(fd, zeros, want, pos) != (ssize_t)want) {
+			fprintf(stderr, "punch_hole: pwrite error for [%s]\n",
 					cp->client_req.path);
 			return -1;
 		}
 	}
 
-	// if all bytes are read then send a response to the client
-	if (num_wrote < MAXDATA) {
-		if (fclose(cp->file) < 0) {
-			perror("read_data: fclose");
+	return 0;
+}
+
+/**
+ * Helper function that sets the final size of the file, closes it and
+ * sends the response to the client. The hash of the received data becomes
+ * the cached digest of the file.
+ * @param  cp the client pointer
+ * @return    HANDLE_DONE on success, -1 on failure
+ */
+static int finish_file(struct client *cp) {
+	if (flush_file(cp) < 0) {
+		return -1;
+	}
+	// a trailing hole is recreated by extending the file
+	if (ftruncate(cp->file_fd, cp->client_req.size) < 0) {
+		perror("finish_file: ftruncate");
+		return -1;
+	}
+	if (fchmod(cp->file_fd, cp->client_req.mode & 07777) < 0) {
+		perror("finish_file: fchmod");
+		return -1;
+	}
+	if (cp->snapshot && commit_snapshot(cp) < 0) {
+		return -1;
+	}
+	struct stat file_stat;
+	if (fstat(cp->file_fd, &file_stat) < 0) {
+		perror("finish_file: fstat");
+		return -1;
+	}
+	// a large file leaves behind only the pages not yet on the disk; the
+	// rest of it is sent there without waiting
+	if (!cp->direct && cp->synced > 0) {
+		sync_file_range(cp->file_fd, cp->synced, 0, SYNC_FILE_RANGE_WRITE);
+		posix_fadvise(cp->file_fd, cp->dropped, 0, POSIX_FADV_DONTNEED);
+	}
+	forget_digests(cp->client_req.path);
+	digest_store(&file_stat, cp->digest);
+	close_file(cp);
+
+	int response = htonl(OK);
+	if (queue_output(cp, &response, sizeof(int)) < 0) {
+		return -1;
+	}
+	return HANDLE_DONE;
+}
+
+/**
+ * Helper function that creates the file of a TRANSFILE request with a write
+ * buffer. Files of at least direct_min bytes bypass the page cache with
+ * O_DIRECT where the file system supports it. Files of at least inplace_min
+ * bytes that the server already has are patched instead of written anew.
+ * A file the server has under other names too is unlinked first, so the
+ * new data never reaches them.
+ * @param  cp the client pointer
+ * @return    0 on success, -1 on failure
+ */
+static int open_file(struct client *cp) {
+	struct request *req = &cp->client_req;
+	char name[MAXPATH];
+	int dir_fd;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC;
+
+	if ((dir_fd = dircache_parent(req->path, name)) < 0) {
+		perror("open_file: dircache_parent");
+		return -1;
+	}
+	cp->file_fd = -1;
+	cp->direct = cp->inplace = cp->snapshot = 0;
+	if (break_link(dir_fd, name) < 0) {
+		return -1;
+	}
+	if (config.inplace_min > 0 && req->size >= config.inplace_min &&
+		(cp->inplace = open_inplace(cp, dir_fd, name)) < 0) {
+		cp->inplace = 0;
+		return -1;
+	}
+	if (cp->inplace) {
+		// the old data is read back to find what changed
+		if (!(cp->wbuf = wbuf_get()) || !(cp->rbuf = wbuf_get())) {
+			close_file(cp);
 			return -1;
 		}
-		int response = htonl(OK);
-		if (write(cp->fd, &response, sizeof(int)) < 0) {
-			perror("read_data: write");
+		cp->wlen = 0;
+		cp->woff = cp->synced = cp->dropped = 0;
+		memset(cp->digest, 0, BLOCKSIZE);
+		return 0;
+	}
+
+	if (config.direct_min > 0 && req->size >= config.direct_min &&
+		(cp->file_fd = openat(dir_fd, name, flags | O_DIRECT, 0666)) < 0 &&
+		errno != EINVAL) {
+		perror("open_file: openat");
+		return -1;
+	}
+	cp->direct = cp->file_fd >= 0;
+	if (!cp->direct &&
+		(cp->file_fd = openat(dir_fd, name, flags, 0666)) < 0) {
+		perror("open_file: openat");
+		return -1;
+	}
+
+	if (!(cp->wbuf = wbuf_get())) {
+		close_file(cp);
+		return -1;
+	}
+	cp->wlen = 0;
+	cp->woff = cp->synced = cp->dropped = 0;
+	memset(cp->digest, 0, BLOCKSIZE);
+	return 0;
+}
+
+/**
+ * Helper function that unlinks a regular file with other hard links, so that
+ * the file written in its place is a new one. The other links keep the old
+ * data, and a LINKFILE request joins them again if the client still has them
+ * linked.
+ * @param  dir_fd the parent directory of the file
+ * @param  name   the name of the file
+ * @return        0 on success, -1 on failure
+ */
+static int break_link(int dir_fd, char *name) {
+	struct stat file_stat;
+
+	if (fstatat(dir_fd, name, &file_stat, AT_SYMLINK_NOFOLLOW) < 0) {
+		if (errno == ENOENT) {
+			return 0;
+		}
+		perror("break_link: fstatat");
+		return -1;
+	}
+	if (S_ISREG(file_stat.st_mode) && file_stat.st_nlink > 1 &&
+		unlinkat(dir_fd, name, 0) < 0) {
+		perror("break_link: unlinkat");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Helper function that opens a regular file the server already has to be
+ * patched in place; open_file() has unlinked it if it had other links. The
+ * file is cloned first where the file system can share blocks between files;
+ * the clone gets the changes and only replaces the file once it is complete,
+ * so an interrupted or corrupted transfer leaves the old file as it was.
+ * Elsewhere the file itself is patched: a copy to patch would cost as much
+ * as writing the file anew.
+ * @param  cp     the client pointer
+ * @param  dir_fd the parent directory of the file
+ * @param  name   the name of the file
+ * @return        1 if cp->file_fd is open for patching, 0 if the file has to
+ *                be written anew, -1 on failure
+ */
+static int open_inplace(struct client *cp, int dir_fd, char *name) {
+	struct stat file_stat;
+	int fd;
+
+	if ((fd = openat(dir_fd, name, O_RDWR | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		if (errno == ENOENT || errno == ELOOP || errno == EISDIR) {
+			return 0;
+		}
+		perror("open_inplace: openat");
+		return -1;
+	}
+	if (fstat(fd, &file_stat) < 0) {
+		perror("open_inplace: fstat");
+		close(fd);
+		return -1;
+	}
+	if (!S_ISREG(file_stat.st_mode) || file_stat.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	char snap[MAXPATH];
+	int snap_fd;
+	if (snapshot_name(cp, name, snap) == 0 &&
+		(snap_fd = openat(dir_fd, snap,
+						  O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+						  0600)) >= 0) {
+		if (ioctl(snap_fd, FICLONE, fd) == 0) {
+			close(fd);
+			cp->file_fd = snap_fd;
+			cp->snapshot = 1;
+			return 1;
+		}
+		// the file system cannot share blocks; patch the file itself
+		close(snap_fd);
+		unlinkat(dir_fd, snap, 0);
+	}
+	cp->file_fd = fd;
+	return 1;
+}
+
+/**
+ * Helper function that names the clone of a file being patched: hidden, so
+ * no listing or digest includes it, and unique to the connection.
+ * @param  cp   the client pointer
+ * @param  name the name of the file
+ * @param  snap filled with the name of the clone (MAXPATH bytes)
+ * @return      0 on success, -1 if the name is too long
+ */
+static int snapshot_name(struct client *cp, char *name, char *snap) {
+	return snprintf(snap, MAXPATH, ".%s.rcopy-%d-%d", name, (int)getpid(),
+					cp->fd) < MAXPATH
+			   ? 0
+			   : -1;
+}
+
+/**
+ * Helper function that puts a complete clone in place of the file it was
+ * cloned from. Its data reaches the disk first, so a crash leaves either
+ * the old file or the new one.
+ * @param  cp the client pointer
+ * @return    0 on success, -1 on failure
+ */
+static int commit_snapshot(struct client *cp) {
+	char name[MAXPATH], snap[MAXPATH];
+	int dir_fd;
+
+	if (fdatasync(cp->file_fd) < 0) {
+		perror("commit_snapshot: fdatasync");
+		return -1;
+	}
+	if ((dir_fd = dircache_parent(cp->client_req.path, name)) < 0 ||
+		snapshot_name(cp, name, snap) < 0 ||
+		renameat(dir_fd, snap, dir_fd, name) < 0) {
+		perror("commit_snapshot: renameat");
+		return -1;
+	}
+	cp->snapshot = 0;
+	return 0;
+}
+
+/**
+ * Helper function that writes out the buffered file data.
+ * @param  cp the client pointer
+ * @return    0 on success, -1 on failure
+ */
+static int flush_file(struct client *cp) {
+	// O_DIRECT takes aligned offsets and lengths only, which leaves out the
+	// tail of a file; the rest of it goes through the page cache
+	if (cp->direct && ((cp->woff | cp->wlen) % SERVER_ALIGN) != 0 &&
+		clear_direct(cp) < 0) {
+		return -1;
+	}
+
+	if (cp->inplace ? patch_file(cp) < 0
+					: write_at(cp->file_fd, cp->wbuf, cp->wlen, cp->woff) < 0) {
+		return -1;
+	}
+	cp->woff += cp->wlen;
+	cp->wlen = 0;
+
+	if (!cp->direct) {
+		write_behind(cp);
+	}
+	return 0;
+}
+
+/**
+ * Helper function that writes the buffered data of a file patched in place.
+ * Only the SERVER_INPLACE_BLOCK blocks whose bytes differ from the old data
+ * are written, each run of them with one pwrite, so unchanged blocks are
+ * neither rewritten nor unshared from the file a clone was made of.
+ * @param  cp the client pointer
+ * @return    0 on success, -1 on failure
+ */
+static int patch_file(struct client *cp) {
+	ssize_t have;
+	while ((have = pread(cp->file_fd, cp->rbuf, cp->wlen, cp->woff)) < 0) {
+		if (errno != EINTR) {
+			perror("patch_file: pread");
 			return -1;
 		}
-		return HANDLE_DONE;
 	}
 
-	return HANDLE_OK;
+	size_t pos = 0, run = 0;
+	int changed = 0;
+	while (pos < cp->wlen) {
+		size_t n = SERVER_INPLACE_BLOCK -
+				   (cp->woff + pos) % SERVER_INPLACE_BLOCK;
+		if (n > cp->wlen - pos) {
+			n = cp->wlen - pos;
+		}
+		int same = pos + n <= (size_t)have &&
+				   memcmp(cp->wbuf + pos, cp->rbuf + pos, n) == 0;
+		if (!same && !changed) {
+			run = pos;
+			changed = 1;
+		} else if (same && changed) {
+			if (write_at(cp->file_fd, cp->wbuf + run, pos - run,
+						 cp->woff + run) < 0) {
+				return -1;
+			}
+			changed = 0;
+		}
+		pos += n;
+	}
+	if (changed && write_at(cp->file_fd, cp->wbuf + run, pos - run,
+							cp->woff + run) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Helper function that writes len bytes at off in a file.
+ * @return 0 on success, -1 on failure
+ */
+static int write_at(int fd, const char *buf, size_t len, off_t off) {
+	while (len > 0) {
+		ssize_t n = pwrite(fd, buf, len, off);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("write_at: pwrite");
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/**
+ * Helper function that keeps a large file from filling the page cache. Every
+ * SERVER_WRITEBEHIND bytes, the window just written is sent to the disk and
+ * the window before it, which has had time to get there, is dropped. Neither
+ * waits for the disk, which would stall every client of the event loop; the
+ * pages of the older window still being written stay cached.
+ * @param cp the client pointer
+ */
+static void write_behind(struct client *cp) {
+	off_t end = cp->woff;
+	if (end - cp->synced < SERVER_WRITEBEHIND) {
+		return;
+	}
+
+	// both calls are only advice; a failure leaves the pages cached
+	sync_file_range(cp->file_fd, cp->synced, end - cp->synced,
+					SYNC_FILE_RANGE_WRITE);
+	if (cp->synced > cp->dropped) {
+		posix_fadvise(cp->file_fd, cp->dropped, cp->synced - cp->dropped,
+					  POSIX_FADV_DONTNEED);
+		cp->dropped = cp->synced;
+	}
+	cp->synced = end;
+}
+
+/**
+ * Helper function that turns O_DIRECT off for the rest of the file.
+ * @param  cp the client pointer
+ * @return    0 on success, -1 on failure
+ */
+static int clear_direct(struct client *cp) {
+	int flags;
+	if (!cp->direct) {
+		return 0;
+	}
+	if ((flags = fcntl(cp->file_fd, F_GETFL)) < 0 ||
+		fcntl(cp->file_fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+		perror("clear_direct: fcntl");
+		return -1;
+	}
+	cp->direct = 0;
+	return 0;
+}
+
+/**
+ * Helper function that closes the file of a transfer, if any, and gives its
+ * buffers back to the pool. The clone of a file that was not completed is
+ * removed, leaving the file untouched.
+ * @param cp the client pointer
+ */
+static void close_file(struct client *cp) {
+	if (cp->file_fd >= 0 && close(cp->file_fd) < 0) {
+		perror("close_file: close");
+	}
+	cp->file_fd = -1;
+	if (cp->snapshot) {
+		char name[MAXPATH], snap[MAXPATH];
+		int dir_fd;
+		if ((dir_fd = dircache_parent(cp->client_req.path, name)) < 0 ||
+			snapshot_name(cp, name, snap) < 0 ||
+			unlinkat(dir_fd, snap, 0) < 0) {
+			perror("close_file: unlinkat");
+		}
+		cp->snapshot = 0;
+	}
+	cp->inplace = 0;
+	if (cp->wbuf) {
+		wbuf_put(cp->wbuf);
+		cp->wbuf = NULL;
+	}
+	if (cp->rbuf) {
+		wbuf_put(cp->rbuf);
+		cp->rbuf = NULL;
+	}
+}
+
+/**
+ * Helper function that takes a write buffer from the pool, or allocates one.
+ * @return the buffer, or NULL if out of memory
+ */
+static char *wbuf_get() {
+	if (wbuf_npool > 0) {
+		return wbuf_pool[--wbuf_npool];
+	}
+	void *buf;
+	int err;
+	if ((err = posix_memalign(&buf, SERVER_ALIGN, SERVER_WBUFSIZE)) != 0) {
+		errno = err;
+		perror("wbuf_get: posix_memalign");
+		return NULL;
+	}
+	return buf;
+}
+
+/**
+ * Helper function that returns a write buffer to the pool.
+ * @param buf the buffer
+ */
+static void wbuf_put(char *buf) {
+	if (wbuf_npool < SERVER_WBUFPOOL) {
+		wbuf_pool[wbuf_npool++] = buf;
+	} else {
+		free(buf);
+	}
+}
+
+/**
+ * Helper function that reads what has arrived of a field of len bytes, at
+ * most MAXPATH. A partly read field is kept in the client until the rest
+ * comes in, since the socket never blocks.
+ * @param  cp    the client pointer
+ * @param  field filled in once the whole field is read
+ * @param  len   the length of the field
+ * @return       1 if the field is complete, 0 if more bytes are needed,
+ *               READ_EOF if the socket is closed, -1 on failure
+ */
+static int read_field(struct client *cp, void *field, size_t len) {
+	ssize_t n = read(cp->fd, cp->in + cp->inlen, len - cp->inlen);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return 0;
+		}
+		perror("read_field: read");
+		return -1;
+	} else if (n == 0) {
+		return READ_EOF;
+	}
+
+	cp->nread += n;
+	cp->inlen += n;
+	if (cp->inlen < len) {
+		return 0;
+	}
+	memcpy(field, cp->in, len);
+	cp->inlen = 0;
+	return 1;
+}
+
+/**
+ * Helper function that appends a response to the client's output queue. It
+ * is sent by flush_output() as the socket becomes writable.
+ * @param  cp  the client pointer
+ * @param  buf the bytes to send
+ * @param  len the number of bytes
+ * @return     0 on success, -1 on failure
+ */
+static int queue_output(struct client *cp, const void *buf, size_t len) {
+	// reuse the space of what has been sent already
+	if (cp->outpos > 0) {
+		memmove(cp->out, cp->out + cp->outpos, cp->outlen - cp->outpos);
+		cp->outlen -= cp->outpos;
+		cp->outpos = 0;
+	}
+	if (cp->outlen + len > cp->outcap) {
+		size_t cap = cp->outcap ? cp->outcap : MAXDATA;
+		while (cap < cp->outlen + len) {
+			cap *= 2;
+		}
+		char *out = realloc(cp->out, cap);
+		if (!out) {
+			perror("queue_output: realloc");
+			return -1;
+		}
+		cp->out = out;
+		cp->outcap = cap;
+	}
+	memcpy(cp->out + cp->outlen, buf, len);
+	cp->outlen += len;
+	return 0;
 }
@@ -0,0 +1,78 @@
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <netinet/in.h>
+#include <time.h>
+
+#define SESSION_QUANTUM (256 << 10)	// bytes a session may read per round
+#define SESSION_BUCKETS 256			// client hosts rate limited at once
+
+/**
+ * The connections of one client host, scheduled as one unit so a host that
+ * opens many transfers gets no more than a host that opens one
+ * ipaddr			the address of the client host
+ * nclients			the number of connections from ipaddr
+ * ready			the number of readable connections of the session this round
+ * turn				the number of rounds the session has had
+ * start			the rank of the readable connection served first this round
+ * deficit			the bytes the session may still read this round
+ * bucket			the slot last holding the token bucket of ipaddr, or -1
+ * next				the next session
+ */
+struct session {
+    struct in_addr ipaddr;
+    int nclients;
+    int ready;
+    unsigned int turn;
+    int start;
+    long long deficit;
+    int bucket;
+    struct session *next;
+};
+
+/**
+ * Limit the bytes every client host may send per second. The token buckets
+ * are shared with the processes forked after this call, so a host whose
+ * connections land on several shards still gets the rate once.
+ * @param  rate the limit in bytes per second, 0 for none
+ * @return      0 on success, -1 on failure
+ */
+int session_configure(long rate);
+
+/**
+ * Find the session of a client host, creating it for its first connection
+ * @param  ipaddr the address of the client host
+ * @return        the session, or NULL if out of memory
+ */
+struct session *session_get(struct in_addr ipaddr);
+
+/**
+ * Release a connection of a session, freeing it with its last connection
+ * @param s the session
+ */
+void session_put(struct session *s);
+
+/**
+ * Check the rate limit of a session
+ * @param  s       the session
+ * @param  wait_ms lowered to the time until the session may read again, if
+ *                 it may not read now
+ * @return         1 if the session may read now, 0 otherwise
+ */
+int session_allowed(struct session *s, long *wait_ms);
+
+/**
+ * Start a deficit round robin round: every session that has a readable
+ * connection gets another quantum and starts the round at the next of its
+ * readable connections, and every other session loses its credit
+ */
+void session_round();
+
+/**
+ * Account for bytes a session has read
+ * @param s     the session
+ * @param bytes the number of bytes
+ */
+void session_charge(struct session *s, long bytes);
+
+#endif // _SESSION_H_
@@ -0,0 +1,246 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "session.h"
+
+/**
+ * The token bucket of a client host
+ * ipaddr			the address of the client host, 0 for a free slot
+ * tokens			the bytes the rate limit allows now
+ * last				when tokens was last refilled
+ */
+struct bucket {
+    struct in_addr ipaddr;
+    double tokens;
+    struct timespec last;
+};
+
+/**
+ * The token buckets of every shard, in memory shared between them
+ * lock				held while a bucket is looked up or changed
+ * slots			the buckets
+ */
+struct buckets {
+    pthread_mutex_t lock;
+    struct bucket slots[SESSION_BUCKETS];
+};
+
+static struct session *sessions = NULL;
+static long session_rate = 0;
+static struct buckets *buckets = NULL;
+
+static struct bucket *lock_bucket(struct session *s);
+static double burst();
+
+
+/**
+ * Limit the bytes every client host may send per second. The token buckets
+ * are shared with the processes forked after this call, so a host whose
+ * connections land on several shards still gets the rate once.
+ * @param  rate the limit in bytes per second, 0 for none
+ * @return      0 on success, -1 on failure
+ */
+int session_configure(long rate) {
+	session_rate = rate;
+	if (rate <= 0 || buckets) {
+		return 0;
+	}
+
+	buckets = mmap(NULL, sizeof(struct buckets), PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (buckets == MAP_FAILED) {
+		perror("session_configure: mmap");
+		buckets = NULL;
+		return -1;
+	}
+	// a shard that dies holding the lock must not stop the others
+	pthread_mutexattr_t attr;
+	if (pthread_mutexattr_init(&attr) != 0 ||
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0 ||
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0 ||
+		pthread_mutex_init(&buckets->lock, &attr) != 0) {
+		fprintf(stderr, "session_configure: cannot share the rate limit\n");
+		munmap(buckets, sizeof(struct buckets));
+		buckets = NULL;
+		return -1;
+	}
+	pthread_mutexattr_destroy(&attr);
+	return 0;
+}
+
+
+/**
+ * Find the session of a client host, creating it for its first connection
+ * @param  ipaddr the address of the client host
+ * @return        the session, or NULL if out of memory
+ */
+struct session *session_get(struct in_addr ipaddr) {
+	struct session *s;
+	for (s = sessions; s; s = s->next) {
+		if (s->ipaddr.s_addr == ipaddr.s_addr) {
+			s->nclients++;
+			return s;
+		}
+	}
+
+	if (!(s = calloc(1, sizeof(struct session)))) {
+		perror("session_get: calloc");
+		return NULL;
+	}
+	s->ipaddr = ipaddr;
+	s->nclients = 1;
+	s->bucket = -1;
+	s->next = sessions;
+	sessions = s;
+	return s;
+}
+
+
+/**
+ * Release a connection of a session, freeing it with its last connection
+ * @param s the session
+ */
+void session_put(struct session *s) {
+	if (--s->nclients > 0) {
+		return;
+	}
+
+	struct session **p;
+	for (p = &sessions; *p && *p != s; p = &(*p)->next)
+		;
+	if (*p) {
+		*p = s->next;
+	}
+	free(s);
+}
+
+
+/**
+ * Check the rate limit of a session
+ * @param  s       the session
+ * @param  wait_ms lowered to the time until the session may read again, if
+ *                 it may not read now
+ * @return         1 if the session may read now, 0 otherwise
+ */
+int session_allowed(struct session *s, long *wait_ms) {
+	if (!buckets) {
+		return 1;
+	}
+
+	// refill the bucket for the time since the last check
+	struct bucket *b = lock_bucket(s);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - b->last.tv_sec) +
+					 (now.tv_nsec - b->last.tv_nsec) / 1e9;
+	b->last = now;
+	b->tokens += elapsed * session_rate;
+	if (b->tokens > burst()) {
+		b->tokens = burst();
+	}
+	double tokens = b->tokens;
+	pthread_mutex_unlock(&buckets->lock);
+	if (tokens > 0) {
+		return 1;
+	}
+
+	long ms = (long)(-tokens * 1000 / session_rate) + 1;
+	if (*wait_ms < 0 || ms < *wait_ms) {
+		*wait_ms = ms;
+	}
+	return 0;
+}
+
+
+/**
+ * Start a deficit round robin round: every session that has a readable
+ * connection gets another quantum and starts the round at the next of its
+ * readable connections, and every other session loses its credit
+ */
+void session_round() {
+	for (struct session *s = sessions; s; s = s->next) {
+		if (s->ready) {
+			// one busy connection may spend the whole quantum, so the
+			// others of the host take turns at going first
+			s->start = s->turn++ % s->ready;
+			// credit is not saved up beyond one quantum
+			s->deficit += SESSION_QUANTUM;
+			if (s->deficit > SESSION_QUANTUM) {
+				s->deficit = SESSION_QUANTUM;
+			}
+		} else if (s->deficit > 0) {
+			// an overdraft is still paid back later
+			s->deficit = 0;
+		}
+		s->ready = 0;
+	}
+}
+
+
+/**
+ * Account for bytes a session has read
+ * @param s     the session
+ * @param bytes the number of bytes
+ */
+void session_charge(struct session *s, long bytes) {
+	s->deficit -= bytes;
+	if (buckets) {
+		lock_bucket(s)->tokens -= bytes;
+		pthread_mutex_unlock(&buckets->lock);
+	}
+}
+
+
+/**
+ * Helper function that takes the lock of the token buckets and finds the
+ * bucket of a session's host. A host without one gets a full bucket in a free
+ * slot, or else in the slot refilled longest ago: a bucket left alone for the
+ * second it takes to fill is no different from a new one.
+ * @param  s the session
+ * @return   the bucket, with the lock held
+ */
+static struct bucket *lock_bucket(struct session *s) {
+	if (pthread_mutex_lock(&buckets->lock) == EOWNERDEAD) {
+		// a bucket the dead shard was changing is off by one read at most
+		pthread_mutex_consistent(&buckets->lock);
+	}
+
+	struct bucket *slots = buckets->slots;
+	if (s->bucket >= 0 && slots[s->bucket].ipaddr.s_addr == s->ipaddr.s_addr) {
+		return &slots[s->bucket];
+	}
+	int free_slot = -1, oldest = 0;
+	for (int i = 0; i < SESSION_BUCKETS; i++) {
+		if (slots[i].ipaddr.s_addr == s->ipaddr.s_addr) {
+			s->bucket = i;
+			return &slots[i];
+		} else if (slots[i].ipaddr.s_addr == 0) {
+			if (free_slot < 0) {
+				free_slot = i;
+			}
+		} else if (slots[i].last.tv_sec < slots[oldest].last.tv_sec ||
+				   (slots[i].last.tv_sec == slots[oldest].last.tv_sec &&
+					slots[i].last.tv_nsec < slots[oldest].last.tv_nsec)) {
+			oldest = i;
+		}
+	}
+
+	s->bucket = free_slot >= 0 ? free_slot : oldest;
+	struct bucket *b = &slots[s->bucket];
+	b->ipaddr = s->ipaddr;
+	b->tokens = burst();
+	clock_gettime(CLOCK_MONOTONIC, &b->last);
+	return b;
+}
+
+
+/**
+ * Helper function that returns the capacity of a token bucket: one second of
+ * the rate, and at least one quantum so a round is never cut short.
+ */
+static double burst() {
+	return session_rate > SESSION_QUANTUM ? session_rate : SESSION_QUANTUM;
+}
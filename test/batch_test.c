@@ -0,0 +1,272 @@
+#include <endian.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../batch.h"
+#include "../ftree.h"
+
+#define RECORDS 3		// records in the batch the checks start from
+
+static char dir[] = "/tmp/rcopy_batch_XXXXXX";
+static char good[64];
+static char bad[64];
+static char *batch;
+static off_t batch_size;
+
+static int make_batch();
+static int write_bad(off_t size);
+static int expect_open(const char *name, long count);
+static int expect_refused(const char *name);
+static int expect_stdin(const char *name, const char *data, size_t len,
+						int ok);
+
+
+/*
+ * A batch of a few records is recorded with batch_request() and read back;
+ * then every truncation of it, every corrupt byte of its footer, footers
+ * that add up but point outside the file and files that are not batches at
+ * all must be refused before anything is applied.
+ */
+int main() {
+	int failed = 0;
+	char name[64];
+
+	if (!mkdtemp(dir)) {
+		perror("batch_test: mkdtemp");
+		return 1;
+	}
+	snprintf(good, sizeof(good), "%s/good", dir);
+	snprintf(bad, sizeof(bad), "%s/bad", dir);
+	if (make_batch() < 0) {
+		return 1;
+	}
+	failed += expect_open("complete batch", RECORDS);
+
+	// the messages batch_open() prints are expected from here on
+	int saved_stderr = dup(STDERR_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDERR_FILENO);
+	close(null_fd);
+
+	for (off_t size = 0; size < batch_size; size++) {
+		snprintf(name, sizeof(name), "cut to %ld bytes", (long)size);
+		failed += write_bad(size) < 0 || expect_refused(name);
+	}
+
+	// the footer is the index offset, the record count and the magic
+	size_t footer = 2 * sizeof(int64_t) + sizeof(BATCH_INDEX_MAGIC) - 1;
+	for (off_t at = batch_size - footer; at < batch_size; at++) {
+		snprintf(name, sizeof(name), "footer byte %ld flipped", (long)at);
+		batch[at] ^= 0x20;
+		failed += write_bad(batch_size) < 0 || expect_refused(name);
+		batch[at] ^= 0x20;
+	}
+	batch[0] ^= 0x20;
+	failed += write_bad(batch_size) < 0 || expect_refused("magic flipped");
+	batch[0] ^= 0x20;
+
+	// footers whose offset and count add up to the end of the file but
+	// which cannot describe it
+	uint64_t index_offset, count;
+	memcpy(&index_offset, batch + batch_size - footer, sizeof(int64_t));
+	index_offset = be64toh(index_offset);
+	uint64_t recsize = sizeof(int64_t) + MAXPATH;
+	uint64_t huge = INT64_MAX / recsize;
+	uint64_t forged[][2] = {
+		{index_offset + recsize * (RECORDS + 1), -1},
+		{index_offset - recsize, RECORDS + 1},
+		{index_offset - recsize * (RECORDS + 100), RECORDS + 100},
+		{index_offset + recsize * (huge + RECORDS), RECORDS - huge},
+		{0, (index_offset + recsize * RECORDS) / recsize},
+	};
+
+	char saved[2 * sizeof(int64_t)];
+	memcpy(saved, batch + batch_size - footer, sizeof(saved));
+	for (size_t i = 0; i < sizeof(forged) / sizeof(forged[0]); i++) {
+		snprintf(name, sizeof(name), "forged footer %zu", i);
+		index_offset = htobe64(forged[i][0]);
+		count = htobe64(forged[i][1]);
+		memcpy(batch + batch_size - footer, &index_offset, sizeof(int64_t));
+		memcpy(batch + batch_size - footer + sizeof(int64_t), &count,
+			   sizeof(int64_t));
+		failed += write_bad(batch_size) < 0 || expect_refused(name);
+	}
+	memcpy(batch + batch_size - footer, saved, sizeof(saved));
+
+	// files that are not batches
+	failed += write_bad(0) < 0 || expect_refused("empty file");
+	failed += expect_refused("/nonexistent/batch");
+	failed += expect_refused(dir);
+	int fd = open(bad, O_WRONLY | O_TRUNC);
+	for (int i = 0; fd >= 0 && i < 64; i++) {
+		if (write(fd, "not a batch file at all, just some text\n", 40) < 0) {
+			break;
+		}
+	}
+	close(fd);
+	failed += expect_refused("text file");
+
+	// a stream cannot be checked before it is applied, only its start
+	failed += expect_stdin("stream", batch, batch_size, 1);
+	failed += expect_stdin("corrupt stream", "rcopyb?1", 8, 0);
+	failed += expect_stdin("empty stream", "", 0, 0);
+
+	dup2(saved_stderr, STDERR_FILENO);
+	close(saved_stderr);
+
+	unlink(good);
+	unlink(bad);
+	rmdir(dir);
+	free(batch);
+	printf("batch_test: %s\n", failed ? "FAILED" : "passed");
+	return failed ? 1 : 0;
+}
+
+
+/**
+ * Helper function that records a batch of RECORDS requests at good and reads
+ * it into batch.
+ * @return 0 on success, -1 on failure
+ */
+static int make_batch() {
+	const char *paths[RECORDS] = {"src", "src/dir", "src/file"};
+	const mode_t modes[RECORDS] = {S_IFDIR | 0755, S_IFDIR | 0700,
+								   S_IFREG | 0644};
+
+	if (batch_create(good) < 0) {
+		return -1;
+	}
+	for (int i = 0; i < RECORDS; i++) {
+		struct request req;
+		memset(&req, 0, sizeof(struct request));
+		req.type = S_ISDIR(modes[i]) ? REGDIR : REGFILE;
+		strcpy(req.path, paths[i]);
+		req.mode = modes[i];
+		req.size = S_ISDIR(modes[i]) ? 0 : 12;
+		if (batch_request(&req) < 0) {
+			batch_discard();
+			return -1;
+		}
+	}
+	if (batch_finish() != RECORDS) {
+		fprintf(stderr, "make_batch: batch_finish did not count %d records\n",
+				RECORDS);
+		return -1;
+	}
+
+	struct stat st;
+	int fd = open(good, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0 || !(batch = malloc(st.st_size)) ||
+		read(fd, batch, st.st_size) != st.st_size) {
+		perror("make_batch: read");
+		return -1;
+	}
+	close(fd);
+	batch_size = st.st_size;
+	return 0;
+}
+
+
+/**
+ * Helper function that writes the first size bytes of batch to bad.
+ * @return 0 on success, -1 on failure
+ */
+static int write_bad(off_t size) {
+	int fd = open(bad, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, batch, size) != size || close(fd) < 0) {
+		perror("write_bad: write");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Helper function that checks that good opens at its first record with the
+ * given number of records.
+ * @return 0 if it does, 1 otherwise
+ */
+static int expect_open(const char *name, long count) {
+	long n;
+	int fd = batch_open(good, &n);
+	if (fd < 0) {
+		fprintf(stderr, "%s: refused\n", name);
+		return 1;
+	}
+	off_t at = lseek(fd, 0, SEEK_CUR);
+	close(fd);
+	if (n != count || at != sizeof(BATCH_MAGIC) - 1) {
+		fprintf(stderr, "%s: %ld records at offset %ld\n", name, n, (long)at);
+		return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * Helper function that checks that batch_open() refuses bad, or the path
+ * itself if name is one.
+ * @return 0 if it does, 1 otherwise
+ */
+static int expect_refused(const char *name) {
+	long n;
+	int fd = batch_open(name[0] == '/' ? name : bad, &n);
+	if (fd < 0) {
+		return 0;
+	}
+	close(fd);
+	dprintf(STDOUT_FILENO, "%s: opened with %ld records\n", name, n);
+	return 1;
+}
+
+
+/**
+ * Helper function that feeds data to batch_open("-") through a pipe on
+ * standard input, in a child so that the tests keep their own.
+ * @param  ok 1 if the stream must be opened, 0 if it must be refused
+ * @return    0 if batch_open() did as expected, 1 otherwise
+ */
+static int expect_stdin(const char *name, const char *data, size_t len,
+						int ok) {
+	int fds[2];
+	if (pipe(fds) < 0) {
+		perror("expect_stdin: pipe");
+		return 1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("expect_stdin: fork");
+		return 1;
+	} else if (pid == 0) {
+		long n;
+		close(fds[1]);
+		dup2(fds[0], STDIN_FILENO);
+		close(fds[0]);
+		int fd = batch_open("-", &n);
+		// a stream has no footer to count the records with
+		exit(fd >= 0 ? n != -1 : 2);
+	}
+
+	close(fds[0]);
+	// the child reads no more than the magic, so the rest may not fit
+	if (len > sizeof(BATCH_MAGIC) - 1) {
+		len = sizeof(BATCH_MAGIC) - 1;
+	}
+	int written = write(fds[1], data, len) == (ssize_t)len;
+	close(fds[1]);
+
+	int status;
+	if (!written || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		WEXITSTATUS(status) != (ok ? 0 : 2)) {
+		dprintf(STDOUT_FILENO, "%s: not %s\n", name, ok ? "opened" : "refused");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,286 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../filter.h"
+#include "../ftree.h"
+
+/**
+ * A path and whether the rules of its case should exclude it
+ * rel				the path below the test root
+ * type				the d_type to ask with
+ * excluded			1 if the path must be excluded, 0 if it must be kept
+ */
+struct expect {
+    const char *rel;
+    unsigned char type;
+    int excluded;
+};
+
+static char root[] = "/tmp/rcopy_filter_XXXXXX";
+
+static int run_case(const char *name, const char **rules,
+					const struct expect *paths);
+static int write_file(const char *rel, const char *text);
+
+
+/*
+ * The rules are global to a process and cannot be dropped, so every case runs
+ * in a child of its own. The root holds d/cache, a directory, f/cache, a file,
+ * and the FILTER_FILEs of sub and long.
+ */
+int main() {
+	int failed = 0;
+
+	if (!mkdtemp(root)) {
+		perror("filter_test: mkdtemp");
+		return 1;
+	}
+	char path[64];
+	const char *dirs[] = {"d", "d/cache", "f", "sub", "sub/deep", "long"};
+	for (int i = 0; i < 6; i++) {
+		snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+		if (mkdir(path, 0755) < 0) {
+			perror("filter_test: mkdir");
+			return 1;
+		}
+	}
+	if (write_file("f/cache", "") < 0 ||
+		write_file("sub/" FILTER_FILE, "# comment\n\n+ *.log\n- /x\n") < 0) {
+		return 1;
+	}
+	// a line longer than a rule may be, which ends in a rule of its own
+	char text[MAXPATH + 64] = "- ";
+	memset(text + 2, 'a', MAXPATH + 1);
+	strcpy(text + MAXPATH + 3, "keep\n- after\n");
+	if (write_file("long/" FILTER_FILE, text) < 0) {
+		return 1;
+	}
+
+	// * and ? stop at '/'; unanchored patterns match the last components
+	failed += run_case("suffix", (const char *[]){"*.o", NULL},
+		(struct expect[]){{"a.o", DT_REG, 1}, {"d/a.o", DT_REG, 1},
+						  {".o", DT_REG, 1}, {"a.oo", DT_REG, 0},
+						  {"a.o.c", DT_REG, 0}, {"ao", DT_REG, 0},
+						  {NULL, 0, 0}});
+	failed += run_case("double suffix", (const char *[]){"*.tar.gz", NULL},
+		(struct expect[]){{"x.tar.gz", DT_REG, 1}, {"x.gz", DT_REG, 0},
+						  {"x.tar", DT_REG, 0}, {NULL, 0, 0}});
+	failed += run_case("star", (const char *[]){"/src/*.c", NULL},
+		(struct expect[]){{"src/a.c", DT_REG, 1}, {"src/.c", DT_REG, 1},
+						  {"src/sub/a.c", DT_REG, 0},
+						  {"x/src/a.c", DT_REG, 0}, {"srcx/a.c", DT_REG, 0},
+						  {NULL, 0, 0}});
+	failed += run_case("double star", (const char *[]){"/src/**.c", NULL},
+		(struct expect[]){{"src/a.c", DT_REG, 1},
+						  {"src/sub/deep/a.c", DT_REG, 1},
+						  {"src/a.h", DT_REG, 0}, {"x/src/a.c", DT_REG, 0},
+						  {NULL, 0, 0}});
+	failed += run_case("double star inside", (const char *[]){"a/**/z", NULL},
+		(struct expect[]){{"a/b/z", DT_REG, 1}, {"a/b/c/z", DT_REG, 1},
+						  {"x/a/b/z", DT_REG, 1}, {"a/b/zz", DT_REG, 0},
+						  {NULL, 0, 0}});
+	failed += run_case("question mark", (const char *[]){"?.txt", NULL},
+		(struct expect[]){{"a.txt", DT_REG, 1}, {"d/b.txt", DT_REG, 1},
+						  {"ab.txt", DT_REG, 0}, {".txt", DT_REG, 0},
+						  {NULL, 0, 0}});
+	failed += run_case("question mark and slash", (const char *[]){"a?b", NULL},
+		(struct expect[]){{"a-b", DT_REG, 1}, {"a/b", DT_REG, 0},
+						  {NULL, 0, 0}});
+
+	// classes, negated classes, ranges and the literal ']' and '-'
+	failed += run_case("class", (const char *[]){"file[0-9]", NULL},
+		(struct expect[]){{"file3", DT_REG, 1}, {"filea", DT_REG, 0},
+						  {"file", DT_REG, 0}, {"file33", DT_REG, 0},
+						  {NULL, 0, 0}});
+	failed += run_case("negated class",
+		(const char *[]){"[!a-c]x", "[^a]y", NULL},
+		(struct expect[]){{"dx", DT_REG, 1}, {"ax", DT_REG, 0},
+						  {"cx", DT_REG, 0}, {"by", DT_REG, 1},
+						  {"ay", DT_REG, 0}, {NULL, 0, 0}});
+	failed += run_case("class edges", (const char *[]){"[]]z", "[a-]w", NULL},
+		(struct expect[]){{"]z", DT_REG, 1}, {"az", DT_REG, 0},
+						  {"-w", DT_REG, 1}, {"aw", DT_REG, 1},
+						  {"bw", DT_REG, 0}, {NULL, 0, 0}});
+	failed += run_case("unterminated class", (const char *[]){"[ab", NULL},
+		(struct expect[]){{"[ab", DT_REG, 1}, {"a", DT_REG, 0},
+						  {"b", DT_REG, 0}, {NULL, 0, 0}});
+
+	// an escaped wildcard is the character itself
+	failed += run_case("escape",
+		(const char *[]){"\\*star", "\\?q", "[\\]]e", NULL},
+		(struct expect[]){{"*star", DT_REG, 1}, {"xstar", DT_REG, 0},
+						  {"?q", DT_REG, 1}, {"aq", DT_REG, 0},
+						  {"]e", DT_REG, 1}, {"\\e", DT_REG, 0},
+						  {NULL, 0, 0}});
+
+	// paths, anchored or not
+	failed += run_case("path", (const char *[]){"build/out", NULL},
+		(struct expect[]){{"build/out", DT_REG, 1},
+						  {"x/build/out", DT_REG, 1},
+						  {"xbuild/out", DT_REG, 0},
+						  {"build/outx", DT_REG, 0}, {NULL, 0, 0}});
+	failed += run_case("anchored", (const char *[]){"/top", "name", NULL},
+		(struct expect[]){{"top", DT_REG, 1}, {"d/top", DT_REG, 0},
+						  {"name", DT_REG, 1}, {"d/name", DT_REG, 1},
+						  {NULL, 0, 0}});
+
+	// directory-only rules stat only when readdir gave no type
+	failed += run_case("directory only", (const char *[]){"cache/", "tmp*/",
+														   NULL},
+		(struct expect[]){{"cache", DT_DIR, 1}, {"cache", DT_REG, 0},
+						  {"d/cache", DT_UNKNOWN, 1},
+						  {"f/cache", DT_UNKNOWN, 0},
+						  {"gone/cache", DT_UNKNOWN, 1},
+						  {"tmp1", DT_DIR, 1}, {"tmp1", DT_REG, 0},
+						  {NULL, 0, 0}});
+
+	// the first matching rule decides, indexed or not
+	failed += run_case("first match", (const char *[]){"+ keep.o", "- *.o",
+													   NULL},
+		(struct expect[]){{"keep.o", DT_REG, 0}, {"x.o", DT_REG, 1},
+						  {"x.c", DT_REG, 0}, {NULL, 0, 0}});
+	failed += run_case("first match reversed",
+		(const char *[]){"- *.o", "+ keep.o", NULL},
+		(struct expect[]){{"keep.o", DT_REG, 1}, {NULL, 0, 0}});
+	failed += run_case("suffix before glob",
+		(const char *[]){"+ *.o", "- a*", NULL},
+		(struct expect[]){{"a.o", DT_REG, 0}, {"a.c", DT_REG, 1},
+						  {NULL, 0, 0}});
+	failed += run_case("glob before suffix",
+		(const char *[]){"- a*", "+ *.o", NULL},
+		(struct expect[]){{"a.o", DT_REG, 1}, {"b.o", DT_REG, 0},
+						  {NULL, 0, 0}});
+	failed += run_case("head", (const char *[]){"+ /src/keep*", "- /src/*",
+												NULL},
+		(struct expect[]){{"src/keep.c", DT_REG, 0},
+						  {"src/drop.c", DT_REG, 1},
+						  {"other/drop.c", DT_REG, 0}, {NULL, 0, 0}});
+
+	// the rules of a directory come before those of the command line
+	failed += run_case("directory rules", (const char *[]){"*.log", "+ x",
+															NULL},
+		(struct expect[]){{"a.log", DT_REG, 1}, {"sub/a.log", DT_REG, 0},
+						  {"sub/deep/a.log", DT_REG, 0},
+						  {"sub/x", DT_REG, 1}, {"sub/deep/x", DT_REG, 0},
+						  {"x", DT_REG, 0}, {NULL, 0, 0}});
+
+	// a line too long is skipped whole, not read as two rules; the message
+	// read_rules() prints is expected
+	int saved_stderr = dup(STDERR_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDERR_FILENO);
+	close(null_fd);
+	failed += run_case("long line", (const char *[]){NULL},
+		(struct expect[]){{"long/keep", DT_REG, 0}, {"long/after", DT_REG, 1},
+						  {NULL, 0, 0}});
+	dup2(saved_stderr, STDERR_FILENO);
+	close(saved_stderr);
+
+	// nothing is excluded before filter_init()
+	pid_t pid = fork();
+	if (pid == 0) {
+		filter_add("*", 0);
+		exit(filter_excluded("a", DT_REG) != 0);
+	}
+	int status;
+	if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "filter_test: rules applied before filter_init\n");
+		failed++;
+	}
+
+	// malformed rules are refused
+	const char *bad[] = {"/", "- ", "+ /", "//", NULL};
+	for (int i = 0; bad[i]; i++) {
+		if ((pid = fork()) == 0) {
+			// the message filter_add() prints is expected
+			int null_fd = open("/dev/null", O_WRONLY);
+			dup2(null_fd, STDERR_FILENO);
+			exit(filter_add(bad[i], 0) != -1);
+		}
+		if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+			WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "filter_test: accepted the rule \"%s\"\n", bad[i]);
+			failed++;
+		}
+	}
+
+	char cmd[64];
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+	if (system(cmd) != 0) {
+		fprintf(stderr, "filter_test: could not remove %s\n", root);
+	}
+	printf("filter_test: %s\n", failed ? "FAILED" : "passed");
+	return failed ? 1 : 0;
+}
+
+
+/**
+ * Helper function that checks the paths of a case against its rules in a
+ * child process.
+ * @param  name  the name of the case, for messages
+ * @param  rules the command line rules, without a prefix excluding, ending
+ *               with NULL
+ * @param  paths the paths to check, ending with a NULL rel
+ * @return       0 if every path was decided as expected, 1 otherwise
+ */
+static int run_case(const char *name, const char **rules,
+					const struct expect *paths) {
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("run_case: fork");
+		return 1;
+	}
+
+	if (pid == 0) {
+		int wrong = 0;
+		for (int i = 0; rules[i]; i++) {
+			if (filter_add(rules[i], 0) < 0) {
+				fprintf(stderr, "%s: filter_add(\"%s\") failed\n", name,
+						rules[i]);
+				exit(1);
+			}
+		}
+		if (filter_init(root) < 0) {
+			exit(1);
+		}
+		for (int i = 0; paths[i].rel; i++) {
+			int excluded = filter_excluded(paths[i].rel, paths[i].type);
+			if (excluded != paths[i].excluded) {
+				fprintf(stderr, "%s: %s was %s\n", name, paths[i].rel,
+						excluded ? "excluded" : "included");
+				wrong = 1;
+			}
+		}
+		exit(wrong);
+	}
+
+	int status;
+	if (waitpid(pid, &status, 0) < 0) {
+		perror("run_case: waitpid");
+		return 1;
+	}
+	return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+
+/**
+ * Helper function that creates a file below the root holding text.
+ * @return 0 on success, -1 on failure
+ */
+static int write_file(const char *rel, const char *text) {
+	char path[64];
+	snprintf(path, sizeof(path), "%s/%s", root, rel);
+	FILE *f = fopen(path, "w");
+	if (!f || fputs(text, f) == EOF || fclose(f) == EOF) {
+		perror("write_file: fopen");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,151 @@
+#!/bin/bash
+# Syncs a temporary tree to a local rcopy_server and checks the copy with
+# --verify after each round: a first copy with filters, sparse and hard-linked
+# files, changes patched in place, hard links split in the source, a batch
+# applied to a replica and a copy over the Unix socket. Run from the top of
+# the repository after make, with nothing else listening on PORT, the port
+# the binaries were built with.
+
+cd "$(dirname "$0")/.." || exit 1
+PORT=${PORT:-59620}
+TMP=$(mktemp -d /tmp/rcopy_roundtrip_XXXXXX) || exit 1
+SRC=$TMP/src
+DEST=$TMP/srv/sandbox/dest/src
+SERVER=
+FAILED=0
+
+cleanup() {
+	if [ -n "$SERVER" ]; then
+		kill "$SERVER" 2>/dev/null
+		wait "$SERVER" 2>/dev/null
+	fi
+	chmod -R u+rwx "$TMP" 2>/dev/null
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+fail() {
+	echo "roundtrip: $*"
+	FAILED=1
+}
+
+# the client's output goes to a log, shown only when a step fails
+client() {
+	if ! ./rcopy_client "$@" > "$TMP/client.log" 2>&1; then
+		fail "rcopy_client $* failed:"
+		cat "$TMP/client.log"
+		return 1
+	fi
+}
+
+# the filters must be given to --verify too, or it reports what they skip
+verify() {
+	client --verify --exclude '*.o' --exclude 'build/' "$SRC" "$@" ||
+		return 1
+	grep -q "Copies match the source" "$TMP/client.log" ||
+		fail "--verify did not report a match"
+}
+
+mkdir -p "$SRC/dir/sub" "$SRC/build" "$SRC/empty" "$TMP/srv"
+echo hello > "$SRC/file"
+: > "$SRC/zero"
+echo object > "$SRC/dir/main.o"
+echo output > "$SRC/build/out"
+head -c 3000000 /dev/urandom > "$SRC/dir/sub/large"
+chmod 600 "$SRC/dir/sub/large"
+ln "$SRC/file" "$SRC/dir/link"
+# a hole at each end and data in the middle
+truncate -s 4M "$SRC/sparse"
+dd if=/dev/urandom of="$SRC/sparse" bs=64K seek=20 count=4 conv=notrunc \
+	2>/dev/null
+
+./rcopy_server --inplace 1 --unix "$TMP/sock" "$TMP/srv" > "$TMP/server.log" \
+	2>&1 &
+SERVER=$!
+# wait for both listeners; a probe that connects and leaves is harmless
+listening() {
+	[ -S "$TMP/sock" ] && (exec 3<> "/dev/tcp/127.0.0.1/$PORT") 2>/dev/null
+}
+for i in $(seq 50); do
+	listening && break
+	sleep 0.1
+done
+if ! listening; then
+	echo "roundtrip: the server did not start:"
+	cat "$TMP/server.log"
+	exit 1
+fi
+
+# the first copy
+client --exclude '*.o' --exclude 'build/' "$SRC" localhost
+verify localhost
+[ -e "$DEST/dir/main.o" ] && fail "an excluded file was copied"
+[ -e "$DEST/build" ] && fail "an excluded directory was copied"
+[ "$(stat -c %i "$DEST/file")" = "$(stat -c %i "$DEST/dir/link")" ] ||
+	fail "the hard link was copied as a separate file"
+[ "$(stat -c %a "$DEST/dir/sub/large")" = 600 ] ||
+	fail "the permissions of a file were not copied"
+cmp -s "$SRC/sparse" "$DEST/sparse" || fail "the sparse file differs"
+
+# --verify must notice a change that was not synced
+echo changed >> "$SRC/file"
+./rcopy_client --verify --exclude '*.o' --exclude 'build/' "$SRC" localhost \
+	> "$TMP/client.log" 2>&1
+[ $? = 1 ] || fail "--verify did not notice a changed file"
+
+# a block changed in the middle of a large file is patched in place, so the
+# server writes little more than that block and its replies
+dd if=/dev/urandom of="$SRC/dir/sub/large" bs=4K seek=300 count=1 \
+	conv=notrunc 2>/dev/null
+echo new > "$SRC/dir/new"
+WRITTEN=$(awk '/^wchar/ {print $2}' /proc/$SERVER/io)
+client --exclude '*.o' --exclude 'build/' "$SRC" localhost
+WRITTEN=$(($(awk '/^wchar/ {print $2}' /proc/$SERVER/io) - WRITTEN))
+verify localhost
+[ "$WRITTEN" -lt 1000000 ] ||
+	fail "the large file was rewritten, not patched: $WRITTEN bytes written"
+
+# files hard-linked on the server but no longer in the source are written
+# apart, small ones and ones large enough to be patched in place alike
+head -c 1500000 /dev/urandom > "$SRC/dir/big"
+ln "$SRC/dir/big" "$SRC/dir/biglink"
+client --exclude '*.o' --exclude 'build/' "$SRC" localhost
+rm "$SRC/dir/link" "$SRC/dir/biglink"
+echo apart > "$SRC/dir/link"
+cp "$SRC/dir/big" "$SRC/dir/biglink"
+dd if=/dev/urandom of="$SRC/dir/biglink" bs=4K seek=100 count=1 \
+	conv=notrunc 2>/dev/null
+client --exclude '*.o' --exclude 'build/' "$SRC" localhost
+verify localhost
+
+# a batch of the next changes brings a replica of the server up to date
+cp -a "$TMP/srv" "$TMP/replica"
+head -c 200000 /dev/urandom >> "$SRC/dir/sub/large"
+echo batch > "$SRC/empty/batch"
+chmod 700 "$SRC/dir"
+client --write-batch "$TMP/batch" --exclude '*.o' --exclude 'build/' \
+	"$SRC" localhost
+verify localhost
+if ./rcopy_server --read-batch "$TMP/batch" "$TMP/replica" \
+	> "$TMP/server.log" 2>&1; then
+	diff -r "$TMP/srv/sandbox/dest" "$TMP/replica/sandbox/dest" > /dev/null ||
+		fail "the replica differs after --read-batch"
+	[ "$(stat -c %a "$TMP/replica/sandbox/dest/src/dir")" = 700 ] ||
+		fail "--read-batch did not apply the permissions of a directory"
+else
+	fail "--read-batch failed:"
+	cat "$TMP/server.log"
+fi
+
+# the same tree over the Unix socket
+echo unix > "$SRC/dir/sub/unix"
+client --exclude '*.o' --exclude 'build/' "$SRC" "unix:$TMP/sock"
+verify "unix:$TMP/sock"
+verify localhost
+
+if [ $FAILED = 0 ]; then
+	echo "roundtrip: passed"
+else
+	echo "roundtrip: FAILED"
+fi
+exit $FAILED
@@ -0,0 +1,63 @@
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+
+#include <pthread.h>
+
+#include "ftree.h"      // MAXPATH
+
+#define VERIFY_JOBS 4	// default number of worker threads and connections
+
+/**
+ * A path waiting to be verified
+ * src_path			the path of the original
+ * server_path		the path on the server
+ * missing			1 if a parent is already known to be missing
+ * next				the next item in the queue
+ */
+struct verify_item {
+    char src_path[MAXPATH];
+    char server_path[MAXPATH];
+    int missing;
+    struct verify_item *next;
+};
+
+/**
+ * The shared state of the verify workers
+ * host, port		the server to verify against
+ * lock, cond		protect and signal every field below
+ * queue			the paths waiting to be verified
+ * busy				the number of workers verifying a path
+ * failed			1 once any worker hit an error
+ * checked			the number of paths verified
+ * missing, extra, mismatched	the number of differences found
+ * bytes			the number of bytes hashed on the client
+ */
+struct verifier {
+    char *host;
+    unsigned short port;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct verify_item *queue;
+    int busy;
+    int failed;
+    long checked;
+    long missing;
+    long extra;
+    long mismatched;
+    long long bytes;
+};
+
+/**
+ * Compare the tree rooted at src with its copy on host without sending any
+ * file data. Both sides hash in parallel: jobs workers each keep their own
+ * connection. Every difference is printed to stdout as a tab separated
+ * "MISSING|EXTRA|MISMATCH	path" line, with path as it is on the server.
+ * @param  src  the source file or directory
+ * @param  host the server holding the copy
+ * @param  port the port of the server
+ * @param  jobs the number of workers
+ * @return      0 if the copy matches, 1 if it differs, -1 on failure
+ */
+int verify_tree(char *src, char *host, unsigned short port, int jobs);
+
+#endif // _VERIFY_H_
@@ -0,0 +1,405 @@
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "filter.h"
+#include "ftree.h"
+#include "hash.h"
+#include "verify.h"
+
+static void *verify_worker(void *arg);
+static int verify_path(struct verifier *v, int sock_fd,
+					   struct verify_item *item);
+static int push_children(struct verifier *v, struct verify_item *item,
+						 int missing, char ***names, int *nnames);
+static void push(struct verifier *v, const char *src_path,
+				 const char *server_path, int missing);
+static void report(struct verifier *v, const char *status, const char *path);
+static int read_full(int fd, void *buf, size_t len);
+static int compare_names(const void *a, const void *b);
+
+
+/**
+ * Compare the tree rooted at src with its copy on host without sending any
+ * file data. Both sides hash in parallel: jobs workers each keep their own
+ * connection. Every difference is printed to stdout as a tab separated
+ * "MISSING|EXTRA|MISMATCH	path" line, with path as it is on the server.
+ * @param  src  the source file or directory
+ * @param  host the server holding the copy
+ * @param  port the port of the server
+ * @param  jobs the number of workers
+ * @return      0 if the copy matches, 1 if it differs, -1 on failure
+ */
+int verify_tree(char *src, char *host, unsigned short port, int jobs) {
+	struct verifier v;
+	memset(&v, 0, sizeof(struct verifier));
+	v.host = host;
+	v.port = port;
+	pthread_mutex_init(&v.lock, NULL);
+	pthread_cond_init(&v.cond, NULL);
+
+	char src_copy[MAXPATH];
+	strncpy(src_copy, src, MAXPATH - 1);
+	src_copy[MAXPATH - 1] = '\0';
+	push(&v, src, basename(src_copy), 0);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+	if (!threads) {
+		perror("verify_tree: calloc");
+		return -1;
+	}
+	int started = 0;
+	for (; started < jobs; started++) {
+		if (pthread_create(&threads[started], NULL, verify_worker, &v) != 0) {
+			fprintf(stderr, "verify_tree: pthread_create\n");
+			break;
+		}
+	}
+	if (started == 0) {
+		verify_worker(&v);
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double secs = (end.tv_sec - start.tv_sec) +
+				  (end.tv_nsec - start.tv_nsec) / 1e9;
+	fflush(stdout);
+	fprintf(stderr,
+			"verify %s: %ld paths, %ld missing, %ld extra, %ld mismatched; "
+			"%lld bytes hashed in %.2fs (%.1f MB/s)\n",
+			host, v.checked, v.missing, v.extra, v.mismatched, v.bytes, secs,
+			secs > 0 ? v.bytes / secs / 1e6 : 0);
+
+	while (v.queue) {
+		struct verify_item *item = v.queue;
+		v.queue = item->next;
+		free(item);
+	}
+	pthread_mutex_destroy(&v.lock);
+	pthread_cond_destroy(&v.cond);
+
+	if (v.failed) {
+		return -1;
+	}
+	return v.missing || v.extra || v.mismatched ? 1 : 0;
+}
+
+
+/**
+ * Thread body of a verify worker: take paths off the shared queue until the
+ * queue is empty and no other worker can add to it.
+ */
+static void *verify_worker(void *arg) {
+	struct verifier *v = arg;
+	int sock_fd;
+
+	if ((sock_fd = client_sock(v->host, v->port)) < 0) {
+		pthread_mutex_lock(&v->lock);
+		v->failed = 1;
+		pthread_cond_broadcast(&v->cond);
+		pthread_mutex_unlock(&v->lock);
+		return NULL;
+	}
+
+	while (1) {
+		pthread_mutex_lock(&v->lock);
+		while (!v->queue && v->busy > 0 && !v->failed) {
+			pthread_cond_wait(&v->cond, &v->lock);
+		}
+		if (!v->queue || v->failed) {
+			pthread_cond_broadcast(&v->cond);
+			pthread_mutex_unlock(&v->lock);
+			break;
+		}
+		struct verify_item *item = v->queue;
+		v->queue = item->next;
+		v->busy++;
+		pthread_mutex_unlock(&v->lock);
+
+		int result = verify_path(v, sock_fd, item);
+		free(item);
+
+		pthread_mutex_lock(&v->lock);
+		v->busy--;
+		v->checked++;
+		if (result < 0) {
+			v->failed = 1;
+		}
+		pthread_cond_broadcast(&v->cond);
+		pthread_mutex_unlock(&v->lock);
+	}
+
+	close(sock_fd);
+	return NULL;
+}
+
+
+/**
+ * Helper function that verifies one path and queues its children.
+ * @return 0 on success, -1 on failure
+ */
+static int verify_path(struct verifier *v, int sock_fd,
+					   struct verify_item *item) {
+	struct stat src_stat;
+	if (lstat(item->src_path, &src_stat) < 0) {
+		perror("verify_path: lstat");
+		return -1;
+	}
+	if (!S_ISREG(src_stat.st_mode) && !S_ISDIR(src_stat.st_mode)) {
+		fprintf(stderr, "verify_path: %s: Not supported file format\n",
+				item->src_path);
+		return 0;
+	}
+
+	// below a missing directory everything is missing; no need to ask
+	if (item->missing) {
+		report(v, "MISSING", item->server_path);
+		return S_ISDIR(src_stat.st_mode)
+				   ? push_children(v, item, 1, NULL, NULL)
+				   : 0;
+	}
+
+	struct request req;
+	memset(&req, 0, sizeof(struct request));
+	req.type = VERIFY;
+	strncpy(req.path, item->server_path, MAXPATH - 1);
+	req.mode = src_stat.st_mode;
+	req.size = S_ISREG(src_stat.st_mode) ? src_stat.st_size : 0;
+	if (S_ISREG(src_stat.st_mode)) {
+		FILE *f;
+		if (!(f = fopen(item->src_path, "rb"))) {
+			perror("verify_path: fopen");
+			return -1;
+		}
+		hash(req.hash, f);
+		fclose(f);
+
+		pthread_mutex_lock(&v->lock);
+		v->bytes += src_stat.st_size;
+		pthread_mutex_unlock(&v->lock);
+	}
+
+	int response;
+	if (send_request(sock_fd, &req) < 0 ||
+		read_full(sock_fd, &response, sizeof(int)) < 0) {
+		fprintf(stderr, "verify_path: lost the server on %s\n",
+				item->server_path);
+		return -1;
+	}
+	response = ntohl(response);
+
+	if (response == MISSING) {
+		report(v, "MISSING", item->server_path);
+		if (S_ISDIR(src_stat.st_mode)) {
+			return push_children(v, item, 1, NULL, NULL);
+		}
+		return 0;
+	} else if (response == MISMATCH) {
+		report(v, "MISMATCH", item->server_path);
+		return 0;
+	} else if (response != OK) {
+		fprintf(stderr, "verify_path: invalid response %d for %s\n", response,
+				item->server_path);
+		return -1;
+	}
+	if (!S_ISDIR(src_stat.st_mode)) {
+		return 0;
+	}
+
+	// the directory exists on both sides: compare the children
+	int count;
+	if (read_full(sock_fd, &count, sizeof(int)) < 0) {
+		fprintf(stderr, "verify_path: lost the server on %s\n",
+				item->server_path);
+		return -1;
+	}
+	count = ntohl(count);
+
+	char **names = NULL;
+	int nnames = 0;
+	if (push_children(v, item, 0, &names, &nnames) < 0) {
+		return -1;
+	}
+
+	int ret = 0;
+	for (int i = 0; i < count; i++) {
+		char child[MAXPATH];
+		if (read_full(sock_fd, child, MAXPATH) < 0) {
+			fprintf(stderr, "verify_path: lost the server on %s\n",
+					item->server_path);
+			ret = -1;
+			break;
+		}
+		child[MAXPATH - 1] = '\0';
+		char *key = child;
+		if (child[0] != '\0' && !bsearch(&key, names, nnames, sizeof(char *),
+										 compare_names)) {
+			char server_path[MAXPATH];
+			if (snprintf(server_path, MAXPATH, "%s/%s", item->server_path,
+						 child) >= MAXPATH) {
+				fprintf(stderr, "verify_path: %s/%s: Path too long\n",
+						item->server_path, child);
+			}
+			// what the filters exclude is left alone on the server
+			if (!filter_excluded(filter_rel(server_path), DT_UNKNOWN)) {
+				report(v, "EXTRA", server_path);
+			}
+		}
+	}
+
+	for (int i = 0; i < nnames; i++) {
+		free(names[i]);
+	}
+	free(names);
+	return ret;
+}
+
+
+/**
+ * Helper function that queues the children of a source directory, skipping
+ * names that start with '.' and paths the filters exclude. missing marks
+ * them as absent on the server without asking. If names is not NULL it is set
+ * to the sorted names of the children, to be freed by the caller.
+ * @return 0 on success, -1 on failure
+ */
+static int push_children(struct verifier *v, struct verify_item *item,
+						 int missing, char ***names, int *nnames) {
+	DIR *dirp;
+	struct dirent *dirent;
+	int n = 0, cap = 0;
+	char **list = NULL;
+
+	if (!(dirp = opendir(item->src_path))) {
+		perror("push_children: opendir");
+		return -1;
+	}
+	while ((dirent = readdir(dirp))) {
+		// ignore . files
+		if (strncmp(dirent->d_name, ".", 1) == 0) {
+			continue;
+		}
+
+		char src_path[MAXPATH], server_path[MAXPATH];
+		if (snprintf(src_path, MAXPATH, "%s/%s", item->src_path,
+					 dirent->d_name) >= MAXPATH ||
+			snprintf(server_path, MAXPATH, "%s/%s", item->server_path,
+					 dirent->d_name) >= MAXPATH) {
+			fprintf(stderr, "push_children: %s/%s: Path too long\n",
+					item->src_path, dirent->d_name);
+			continue;
+		}
+		if (filter_excluded(filter_rel(server_path), dirent->d_type)) {
+			continue;
+		}
+		push(v, src_path, server_path, missing);
+
+		if (!names) {
+			continue;
+		}
+		if (n == cap) {
+			cap = cap ? cap * 2 : 16;
+			char **grown = realloc(list, cap * sizeof(char *));
+			if (!grown) {
+				perror("push_children: realloc");
+				break;
+			}
+			list = grown;
+		}
+		if (!(list[n] = strdup(dirent->d_name))) {
+			perror("push_children: strdup");
+			break;
+		}
+		n++;
+	}
+	closedir(dirp);
+
+	if (names) {
+		qsort(list, n, sizeof(char *), compare_names);
+		*names = list;
+		*nnames = n;
+	}
+	return dirent ? -1 : 0;
+}
+
+
+/**
+ * Helper function that adds a path to the shared queue and wakes a worker.
+ */
+static void push(struct verifier *v, const char *src_path,
+				 const char *server_path, int missing) {
+	struct verify_item *item = malloc(sizeof(struct verify_item));
+	if (!item) {
+		perror("push: malloc");
+		pthread_mutex_lock(&v->lock);
+		v->failed = 1;
+		pthread_mutex_unlock(&v->lock);
+		return;
+	}
+	strncpy(item->src_path, src_path, MAXPATH - 1);
+	item->src_path[MAXPATH - 1] = '\0';
+	strncpy(item->server_path, server_path, MAXPATH - 1);
+	item->server_path[MAXPATH - 1] = '\0';
+	item->missing = missing;
+
+	pthread_mutex_lock(&v->lock);
+	item->next = v->queue;
+	v->queue = item;
+	pthread_cond_signal(&v->cond);
+	pthread_mutex_unlock(&v->lock);
+}
+
+
+/**
+ * Helper function that prints one difference and counts it.
+ */
+static void report(struct verifier *v, const char *status, const char *path) {
+	pthread_mutex_lock(&v->lock);
+	printf("%s\t%s\n", status, path);
+	if (strcmp(status, "MISSING") == 0) {
+		v->missing++;
+	} else if (strcmp(status, "EXTRA") == 0) {
+		v->extra++;
+	} else {
+		v->mismatched++;
+	}
+	pthread_mutex_unlock(&v->lock);
+}
+
+
+/**
+ * Helper function that reads exactly len bytes from a socket.
+ * @return 0 on success, -1 on failure or if the socket was closed
+ */
+static int read_full(int fd, void *buf, size_t len) {
+	char *p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n <= 0) {
+			if (n < 0) {
+				perror("read_full: read");
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
@@ -0,0 +1,78 @@
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+#include <sys/inotify.h>
+
+#include "client.h"     // struct dests
+#include "ftree.h"      // MAXPATH
+
+#define WATCH_DEBOUNCE_MS 500	// quiet period that closes a batch
+#define WATCH_MAXBATCH_MS 5000	// longest a busy tree may delay a batch
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO | IN_ATTRIB)
+
+/**
+ * A path that changed since the last batch
+ * rel				the path relative to the source root ("" for the root)
+ * tree				1 if the whole subtree has to be synced (new directory)
+ */
+struct watch_path {
+    char *rel;
+    int tree;
+};
+
+/**
+ * The state of a watched source tree
+ * fd				the inotify file descriptor
+ * src				the source root given on the command line
+ * server_root		the name of the source root on the server
+ * dirs				the source-relative path of each watch descriptor
+ * ndirs			the length of dirs
+ * pending			the paths changed in the current batch
+ * npending			the number of paths in pending
+ * cap				the capacity of pending
+ * rescan			1 if events were lost and the whole tree must be synced
+ */
+struct watcher {
+    int fd;
+    char *src;
+    char *server_root;
+    char **dirs;
+    int ndirs;
+    struct watch_path *pending;
+    int npending;
+    int cap;
+    int rescan;
+};
+
+/**
+ * Create the inotify instance and watch every directory under src
+ * @param  w           the watcher to initialize
+ * @param  src         the source root
+ * @param  server_root the name of the source root on the server
+ * @return             0 on success, -1 on failure
+ */
+int watch_init(struct watcher *w, char *src, char *server_root);
+
+/**
+ * Block until at least one change is seen, then keep coalescing events until
+ * the tree has been quiet for WATCH_DEBOUNCE_MS
+ * @param  w the watcher
+ * @return   0 on success, -1 on failure
+ */
+int watch_collect(struct watcher *w);
+
+/**
+ * Sync the paths collected by watch_collect over the main connections
+ * @param  w the watcher
+ * @param  d the servers to sync to
+ * @return   0 on success, -1 on failure
+ */
+int watch_flush(struct watcher *w, struct dests *d);
+
+/**
+ * Release the inotify instance and the memory held by the watcher
+ * @param w the watcher
+ */
+void watch_free(struct watcher *w);
+
+#endif // _WATCH_H_
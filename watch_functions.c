@@ -0,0 +1,381 @@
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "digest.h"
+#include "filter.h"
+#include "ftree.h"
+#include "watch.h"
+
+static int watch_add_tree(struct watcher *w, const char *rel);
+static int watch_read_events(struct watcher *w);
+static int add_pending(struct watcher *w, const char *rel, int tree);
+static void join_path(char *dst, const char *root, const char *rel);
+static int compare_pending(const void *a, const void *b);
+static long now_ms();
+
+
+/**
+ * Create the inotify instance and watch every directory under src
+ * @param  w           the watcher to initialize
+ * @param  src         the source root
+ * @param  server_root the name of the source root on the server
+ * @return             0 on success, -1 on failure
+ */
+int watch_init(struct watcher *w, char *src, char *server_root) {
+	memset(w, 0, sizeof(struct watcher));
+	w->src = src;
+	w->server_root = server_root;
+
+	if ((w->fd = inotify_init1(IN_CLOEXEC)) < 0) {
+		perror("watch_init: inotify_init1");
+		return -1;
+	}
+
+	return watch_add_tree(w, "");
+}
+
+
+/**
+ * Block until at least one change is seen, then keep coalescing events until
+ * the tree has been quiet for WATCH_DEBOUNCE_MS
+ * @param  w the watcher
+ * @return   0 on success, -1 on failure
+ */
+int watch_collect(struct watcher *w) {
+	struct pollfd pfd = {w->fd, POLLIN, 0};
+	long start = -1;
+	int timeout = -1;
+
+	while (1) {
+		int nready = poll(&pfd, 1, timeout);
+		if (nready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("watch_collect: poll");
+			return -1;
+		} else if (nready == 0) { // quiet for a whole debounce window
+			return 0;
+		}
+
+		if (watch_read_events(w) < 0) {
+			return -1;
+		}
+
+		if (start < 0) {
+			start = now_ms();
+		}
+		long left = start + WATCH_MAXBATCH_MS - now_ms();
+		if (left <= 0) {
+			return 0;
+		}
+		timeout = left < WATCH_DEBOUNCE_MS ? left : WATCH_DEBOUNCE_MS;
+	}
+}
+
+
+/**
+ * Sync the paths collected by watch_collect over the main connections
+ * @param  w the watcher
+ * @param  d the servers to sync to
+ * @return   0 on success, -1 on failure
+ */
+int watch_flush(struct watcher *w, struct dests *d) {
+	char src_path[MAXPATH];
+	char server_path[MAXPATH];
+	const char *tree = NULL;
+	int ret = 0;
+
+	// the directory digests of the last batch are stale
+	digest_invalidate();
+
+	if (w->rescan) {
+		w->rescan = 0;
+		for (int i = 0; i < w->npending; i++) {
+			free(w->pending[i].rel);
+		}
+		w->npending = 0;
+		if (traverse(d, w->src, w->server_root) < 0) {
+			return -1;
+		}
+		return flush_transfers(d);
+	}
+
+	// sorting puts every directory in front of the paths below it
+	qsort(w->pending, w->npending, sizeof(struct watch_path),
+		  compare_pending);
+
+	for (int i = 0; i < w->npending && ret == 0; i++) {
+		struct watch_path *wp = &w->pending[i];
+		size_t len;
+
+		// skip duplicates and paths already covered by a synced subtree
+		if (i > 0 && strcmp(wp->rel, w->pending[i - 1].rel) == 0) {
+			continue;
+		}
+		if (tree && strncmp(wp->rel, tree, (len = strlen(tree))) == 0 &&
+			wp->rel[len] == '/') {
+			continue;
+		}
+
+		join_path(src_path, w->src, wp->rel);
+		join_path(server_path, w->server_root, wp->rel);
+
+		// the path may be gone again by the time the batch is flushed
+		struct stat src_stat;
+		if (lstat(src_path, &src_stat) < 0) {
+			continue;
+		}
+
+		if (wp->tree && S_ISDIR(src_stat.st_mode)) {
+			tree = wp->rel;
+			ret = traverse(d, src_path, server_path);
+		} else if (S_ISREG(src_stat.st_mode) || S_ISDIR(src_stat.st_mode)) {
+			ret = sync_path(d, src_path, server_path) < 0 ? -1 : 0;
+		}
+	}
+
+	for (int i = 0; i < w->npending; i++) {
+		free(w->pending[i].rel);
+	}
+	w->npending = 0;
+
+	// the batch is over, so nothing is coming to push the queue along
+	if (ret == 0) {
+		ret = flush_transfers(d);
+	}
+	return ret;
+}
+
+
+/**
+ * Release the inotify instance and the memory held by the watcher
+ * @param w the watcher
+ */
+void watch_free(struct watcher *w) {
+	for (int i = 0; i < w->ndirs; i++) {
+		free(w->dirs[i]);
+	}
+	for (int i = 0; i < w->npending; i++) {
+		free(w->pending[i].rel);
+	}
+	free(w->dirs);
+	free(w->pending);
+	if (w->fd >= 0) {
+		close(w->fd);
+	}
+}
+
+
+/**
+ * Helper function that adds a watch on rel and on every directory below it.
+ * @param  w   the watcher
+ * @param  rel the path relative to the source root
+ * @return     0 on success, -1 on failure
+ */
+static int watch_add_tree(struct watcher *w, const char *rel) {
+	char path[MAXPATH];
+	struct stat src_stat;
+	int wd;
+
+	join_path(path, w->src, rel);
+	if (lstat(path, &src_stat) < 0) {
+		perror("watch_add_tree: lstat");
+		return -1;
+	}
+	if (!S_ISDIR(src_stat.st_mode) && !S_ISREG(src_stat.st_mode)) {
+		return 0;
+	}
+
+	if ((wd = inotify_add_watch(w->fd, path, WATCH_EVENTS)) < 0) {
+		perror("watch_add_tree: inotify_add_watch");
+		return -1;
+	}
+
+	// remember which directory the watch descriptor stands for
+	if (wd >= w->ndirs) {
+		char **dirs = realloc(w->dirs, (wd + 1) * sizeof(char *));
+		if (!dirs) {
+			perror("watch_add_tree: realloc");
+			return -1;
+		}
+		memset(dirs + w->ndirs, 0, (wd + 1 - w->ndirs) * sizeof(char *));
+		w->dirs = dirs;
+		w->ndirs = wd + 1;
+	}
+	free(w->dirs[wd]);
+	if (!(w->dirs[wd] = strdup(rel))) {
+		perror("watch_add_tree: strdup");
+		return -1;
+	}
+
+	if (!S_ISDIR(src_stat.st_mode)) {
+		return 0;
+	}
+
+	DIR *dirp;
+	struct dirent *dirent;
+	if (!(dirp = opendir(path))) {
+		perror("watch_add_tree: opendir");
+		return -1;
+	}
+	while ((dirent = readdir(dirp))) {
+		// ignore . files
+		if (strncmp(dirent->d_name, ".", 1) == 0) {
+			continue;
+		}
+
+		char child[MAXPATH];
+		join_path(child, rel, dirent->d_name);
+		// an excluded directory is not watched, so its changes go unseen
+		if (filter_excluded(child, dirent->d_type)) {
+			continue;
+		}
+		join_path(path, w->src, child);
+		if (lstat(path, &src_stat) == 0 && S_ISDIR(src_stat.st_mode) &&
+			watch_add_tree(w, child) < 0) {
+			closedir(dirp);
+			return -1;
+		}
+	}
+	closedir(dirp);
+
+	return 0;
+}
+
+
+/**
+ * Helper function that drains the inotify queue into the pending list.
+ * @param  w the watcher
+ * @return   0 on success, -1 on failure
+ */
+static int watch_read_events(struct watcher *w) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	if ((len = read(w->fd, buf, sizeof(buf))) < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		perror("watch_read_events: read");
+		return -1;
+	}
+
+	for (char *p = buf; p < buf + len;) {
+		struct inotify_event *event = (struct inotify_event *)p;
+		p += sizeof(struct inotify_event) + event->len;
+
+		if (event->mask & IN_Q_OVERFLOW) {
+			w->rescan = 1;
+			continue;
+		}
+		if (event->wd < 0 || event->wd >= w->ndirs || !w->dirs[event->wd]) {
+			continue;
+		}
+
+		char rel[MAXPATH];
+		int rules = 0;
+		if (event->len == 0) { // the watched path itself changed
+			strncpy(rel, w->dirs[event->wd], MAXPATH - 1);
+			rel[MAXPATH - 1] = '\0';
+		} else if (strcmp(event->name, FILTER_FILE) == 0) {
+			// new rules may include or exclude anything in the directory
+			strncpy(rel, w->dirs[event->wd], MAXPATH - 1);
+			rel[MAXPATH - 1] = '\0';
+			filter_forget(rel);
+			rules = 1;
+		} else if (strncmp(event->name, ".", 1) == 0) {
+			continue;
+		} else {
+			join_path(rel, w->dirs[event->wd], event->name);
+			if (filter_excluded(rel, event->mask & IN_ISDIR ? DT_DIR
+															: DT_REG)) {
+				continue;
+			}
+		}
+
+		// a new directory needs its own watches and a full sync, since
+		// files may have been created in it before the watch was added
+		int tree = rules || ((event->mask & IN_ISDIR) &&
+							 (event->mask & (IN_CREATE | IN_MOVED_TO)));
+		if (tree && watch_add_tree(w, rel) < 0) {
+			w->rescan = 1;
+		}
+		if (add_pending(w, rel, tree) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * Helper function that appends a changed path to the pending list.
+ * @return 0 on success, -1 on failure
+ */
+static int add_pending(struct watcher *w, const char *rel, int tree) {
+	if (w->npending == w->cap) {
+		int cap = w->cap ? w->cap * 2 : 64;
+		struct watch_path *pending =
+			realloc(w->pending, cap * sizeof(struct watch_path));
+		if (!pending) {
+			perror("add_pending: realloc");
+			return -1;
+		}
+		w->pending = pending;
+		w->cap = cap;
+	}
+
+	if (!(w->pending[w->npending].rel = strdup(rel))) {
+		perror("add_pending: strdup");
+		return -1;
+	}
+	w->pending[w->npending].tree = tree;
+	w->npending++;
+	return 0;
+}
+
+
+/**
+ * Helper function that joins root and rel into dst, which must hold MAXPATH
+ * bytes. An empty rel stands for root itself.
+ */
+static void join_path(char *dst, const char *root, const char *rel) {
+	if (rel[0] == '\0') {
+		snprintf(dst, MAXPATH, "%s", root);
+	} else if (root[0] == '\0') {
+		snprintf(dst, MAXPATH, "%s", rel);
+	} else {
+		snprintf(dst, MAXPATH, "%s/%s", root, rel);
+	}
+}
+
+
+/**
+ * Order pending paths by name, and a subtree sync before a plain sync of the
+ * same path so the latter is dropped as a duplicate.
+ */
+static int compare_pending(const void *a, const void *b) {
+	const struct watch_path *pa = a, *pb = b;
+	int result = strcmp(pa->rel, pb->rel);
+	return result != 0 ? result : pb->tree - pa->tree;
+}
+
+
+/**
+ * Helper function that reads the monotonic clock in milliseconds.
+ */
+static long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}